@@ -0,0 +1,152 @@
+// Compares the client's contiguous token sequence against Wave's pooled std::list on
+// the operations the stepper repeats for every event: rendering a highlighted slice
+// (std::next to an offset) and locating a call inside the current sequence (std::search).
+// The sequence_index row is the index that long sequences get for repeated lookups; its
+// copy column is the time to build the index. The piece_sequence row is the token
+// stack's representation; its copy column is the time to splice a short result into
+// the middle, which is what each event costs the stack.
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/pool/pool_alloc.hpp>
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+
+#include "piece_sequence.hpp"
+#include "sequence_index.hpp"
+#include "token_sequence.hpp"
+#include "utils.hpp"
+
+namespace {
+    using token_type = boost::wave::cpplexer::lex_token<>;
+    using position_type = token_type::position_type;
+    using list_sequence = std::list<token_type, boost::fast_pool_allocator<token_type>>;
+    using small_sequence = ppstep::small_token_sequence<token_type>;
+
+    std::vector<token_type> make_tokens(std::size_t count) {
+        auto tokens = std::vector<token_type>();
+        tokens.reserve(count);
+        auto position = position_type("<bench>");
+        for (std::size_t i = 0; i < count; ++i) {
+            if (i % 4 == 3) {
+                tokens.emplace_back(boost::wave::T_COMMA, ",", position);
+            } else {
+                auto name = "BOOST_PP_TOKEN_" + std::to_string(i);
+                tokens.emplace_back(boost::wave::T_IDENTIFIER, token_type::string_type(name.c_str()), position);
+            }
+        }
+        return tokens;
+    }
+
+    template <class F>
+    double time_ms(std::size_t repeat, F&& f) {
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < repeat; ++i) f();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repeat;
+    }
+
+    // What formatting_event::print does: walk to the highlighted slice and print around it
+    template <class SequenceT>
+    std::size_t render(SequenceT const& tokens, std::size_t start, std::size_t end) {
+        std::ostringstream os;
+        auto it = tokens.begin();
+        auto sub_start = std::next(tokens.begin(), start);
+        auto sub_end = std::next(tokens.begin(), end);
+        ppstep::print_token_range(os, it, sub_start);
+        ppstep::print_token_range(os, sub_start, sub_end);
+        ppstep::print_token_range(os, sub_end, tokens.end());
+        return os.str().size();
+    }
+
+    // What the client's match() does: find the event's pattern in the token stack
+    template <class SequenceT, class PatternT>
+    std::size_t match(SequenceT const& tokens, PatternT const& pattern) {
+        auto found = ppstep::find_sublist(tokens, pattern, tokens.begin());
+        return found ? static_cast<std::size_t>(std::distance(tokens.begin(), found->first)) : 0;
+    }
+
+    // Stands in for the token pool's keys: ID and spelling
+    std::uint64_t key_of(token_type const& token) {
+        auto value = std::string_view(token.get_value().c_str(), token.get_value().size());
+        return std::hash<std::string_view>()(value) ^ (static_cast<std::uint64_t>(boost::wave::token_id(token)) << 32);
+    }
+
+    // Results are folded in here so the timed work cannot be optimised away
+    volatile std::size_t sink = 0;
+
+    template <class SequenceT>
+    void run(char const* name, std::vector<token_type> const& source, std::vector<token_type> const& pattern, std::size_t repeat) {
+        auto copy_ms = time_ms(repeat, [&] { SequenceT tokens(source.begin(), source.end()); });
+        auto tokens = SequenceT(source.begin(), source.end());
+        auto render_ms = time_ms(repeat, [&] { sink += render(tokens, source.size() / 2, source.size() / 2 + pattern.size()); });
+        auto match_ms = time_ms(repeat, [&] { sink += match(tokens, pattern); });
+
+        std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << copy_ms
+                  << std::setw(12) << render_ms
+                  << std::setw(12) << match_ms << '\n';
+    }
+
+    void run_indexed(std::vector<token_type> const& source, std::vector<token_type> const& pattern, std::size_t repeat) {
+        auto tokens = small_sequence(source.begin(), source.end());
+        auto build_ms = time_ms(repeat, [&] { sink += ppstep::sequence_index(source, key_of).size(); });
+        auto index = ppstep::sequence_index(source, key_of);
+        auto match_ms = time_ms(repeat, [&] {
+            auto hashed = ppstep::sequence_index::pattern();
+            for (auto const& token : pattern) hashed.push_back(key_of(token));
+            auto found = index.find(hashed, 0, [&](std::size_t at) {
+                return std::equal(pattern.begin(), pattern.end(), tokens.begin() + at);
+            });
+            sink += found ? *found : 0;
+        });
+
+        std::cout << std::left << std::setw(24) << "sequence_index" << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << build_ms
+                  << std::setw(12) << "-"
+                  << std::setw(12) << match_ms << '\n';
+    }
+
+    void run_pieces(std::vector<token_type> const& source, std::vector<token_type> const& pattern, std::size_t repeat) {
+        auto tokens = ppstep::piece_sequence<token_type>(std::vector<token_type>(source));
+        auto middle = source.size() / 2;
+        auto splice_ms = time_ms(repeat, [&] {
+            sink += tokens.splice(middle, middle + pattern.size(), std::vector<token_type>(pattern)).size();
+        });
+        auto match_ms = time_ms(repeat, [&] {
+            auto found = std::search(tokens.begin(), tokens.end(), pattern.begin(), pattern.end());
+            sink += found != tokens.end();
+        });
+
+        std::cout << std::left << std::setw(24) << "piece_sequence" << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << splice_ms
+                  << std::setw(12) << "-"
+                  << std::setw(12) << match_ms << '\n';
+    }
+}
+
+int main(int argc, char** argv) {
+    auto sizes = std::vector<std::size_t>{1000, 10000, 100000};
+    if (argc > 1) sizes = {std::stoul(argv[1])};
+
+    for (auto size : sizes) {
+        auto source = make_tokens(size);
+        // The pattern sits near the end, so matching scans nearly the whole sequence
+        auto pattern = std::vector<token_type>(source.end() - 8, source.end() - 3);
+        auto repeat = std::max<std::size_t>(1, 2000000 / size);
+
+        std::cout << size << " tokens, " << repeat << " repetitions (ms per operation)\n";
+        std::cout << std::left << std::setw(24) << "sequence" << std::right
+                  << std::setw(12) << "copy" << std::setw(12) << "render" << std::setw(12) << "match" << '\n';
+        run<list_sequence>("std::list (pooled)", source, pattern, repeat);
+        run<small_sequence>("small_token_sequence", source, pattern, repeat);
+        run_indexed(source, pattern, repeat);
+        run_pieces(source, pattern, repeat);
+        std::cout << '\n';
+    }
+}
@@ -0,0 +1,370 @@
+#ifndef PPSTEP_BREAKPOINT_HPP
+#define PPSTEP_BREAKPOINT_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "name_automaton.hpp"
+#include "symbol_table.hpp"
+
+namespace ppstep {
+    // What a condition can look at when its macro shows up. `result` is what the event
+    // produced: the call itself for calls, the expansion for expansions and rescans, the
+    // token for lexed tokens. Spellings are interned symbols. The tokens are only filled
+    // in when some condition of the macro asks for them.
+    struct breakpoint_facts {
+        std::size_t depth = 0;    // macros being expanded or rescanned, this one included
+        std::size_t size = 0;     // tokens in the result
+        std::vector<symbol_id> result;
+        std::vector<std::vector<symbol_id>> arguments;
+    };
+
+    // A breakpoint condition such as `depth>8 && arg[0] contains BAR`, compiled once into
+    // a flat list of tests. Tests within a clause are joined by `&&`, clauses by `||`,
+    // so evaluation is a single pass with short-circuiting and no tree to walk.
+    //
+    //   test    := number-subject op number | token-subject `contains` name
+    //   number  := `depth` | `argc` | `size` | `result.size` | `arg[N].size`
+    //   tokens  := `result` | `arg[N]`
+    //   op      := `==` | `!=` | `<` | `<=` | `>` | `>=`
+    struct breakpoint_condition {
+        enum class subject : std::uint8_t { depth, argc, size, argument_size, result, argument };
+        enum class relation : std::uint8_t { equal, not_equal, less, less_equal, greater, greater_equal, contains };
+
+        struct test {
+            subject what;
+            relation how;
+            bool ends_clause;
+            std::uint32_t index;   // argument number for argument subjects
+            std::uint64_t number;  // right-hand side of comparisons
+            symbol_id symbol;      // right-hand side of `contains`
+        };
+
+        // An empty condition always holds
+        breakpoint_condition() : tests(), text(), needs_result(false), needs_arguments(false) {}
+
+        // Throws std::runtime_error describing the first thing that does not parse
+        static breakpoint_condition compile(std::string_view source, symbol_table& symbols) {
+            auto condition = breakpoint_condition();
+            condition.text = std::string(source);
+            auto in = parser{source, 0};
+
+            in.skip_space();
+            while (true) {
+                condition.tests.push_back(condition.parse_test(in, symbols));
+                in.skip_space();
+                if (in.done()) break;
+                if (in.accept("&&") || in.accept_word("and")) continue;
+                if (in.accept("||") || in.accept_word("or")) {
+                    condition.tests.back().ends_clause = true;
+                    continue;
+                }
+                in.fail("expected `&&`, `||` or the end of the condition");
+            }
+            condition.tests.back().ends_clause = true;
+            return condition;
+        }
+
+        bool evaluate(breakpoint_facts const& facts) const {
+            bool clause = true;
+            for (auto const& t : tests) {
+                clause = clause && holds(t, facts);
+                if (t.ends_clause) {
+                    if (clause) return true;
+                    clause = true;
+                }
+            }
+            return tests.empty();
+        }
+
+        bool empty() const {
+            return tests.empty();
+        }
+
+        std::string const& source() const {
+            return text;
+        }
+
+        bool uses_result() const {
+            return needs_result;
+        }
+
+        bool uses_arguments() const {
+            return needs_arguments;
+        }
+
+    private:
+        struct parser {
+            std::string_view source;
+            std::size_t at;
+
+            bool done() const {
+                return at == source.size();
+            }
+
+            void skip_space() {
+                while (!done() && std::isspace(static_cast<unsigned char>(source[at]))) ++at;
+            }
+
+            bool accept(std::string_view literal) {
+                skip_space();
+                if (source.substr(at, literal.size()) != literal) return false;
+                at += literal.size();
+                return true;
+            }
+
+            bool accept_word(std::string_view word) {
+                skip_space();
+                auto end = at + word.size();
+                if (source.substr(at, word.size()) != word) return false;
+                if (end < source.size() && is_name_char(source[end])) return false;
+                at = end;
+                return true;
+            }
+
+            std::string_view name() {
+                skip_space();
+                auto start = at;
+                while (!done() && is_name_char(source[at])) ++at;
+                if (start == at) fail("expected a name");
+                return source.substr(start, at - start);
+            }
+
+            std::uint64_t number() {
+                skip_space();
+                auto start = at;
+                std::uint64_t value = 0;
+                while (!done() && std::isdigit(static_cast<unsigned char>(source[at]))) {
+                    value = value * 10 + static_cast<std::uint64_t>(source[at++] - '0');
+                }
+                if (start == at) fail("expected a number");
+                return value;
+            }
+
+            [[noreturn]] void fail(std::string const& what) const {
+                throw std::runtime_error(what + " at column " + std::to_string(at + 1) + " of \"" + std::string(source) + "\"");
+            }
+
+            static bool is_name_char(char c) {
+                return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+            }
+        };
+
+        test parse_test(parser& in, symbol_table& symbols) {
+            auto t = test{subject::depth, relation::equal, false, 0, 0, no_symbol};
+
+            if (in.accept_word("depth")) {
+                t.what = subject::depth;
+            } else if (in.accept_word("argc")) {
+                t.what = subject::argc;
+                needs_arguments = true;
+            } else if (in.accept_word("size")) {
+                t.what = subject::size;
+            } else if (in.accept_word("result")) {
+                t.what = subject::result;
+                if (in.accept(".")) {
+                    if (!in.accept_word("size")) in.fail("expected `size`");
+                    t.what = subject::size;
+                } else {
+                    needs_result = true;
+                }
+            } else if (in.accept_word("arg")) {
+                if (!in.accept("[")) in.fail("expected `[`");
+                t.index = static_cast<std::uint32_t>(in.number());
+                if (!in.accept("]")) in.fail("expected `]`");
+                t.what = subject::argument;
+                if (in.accept(".")) {
+                    if (!in.accept_word("size")) in.fail("expected `size`");
+                    t.what = subject::argument_size;
+                }
+                needs_arguments = true;
+            } else {
+                in.fail("expected depth, argc, size, result or arg[N]");
+            }
+
+            if (t.what == subject::result || t.what == subject::argument) {
+                if (!in.accept_word("contains")) in.fail("expected `contains`");
+                t.how = relation::contains;
+                t.symbol = symbols.intern(in.name());
+                return t;
+            }
+
+            if (in.accept("==")) t.how = relation::equal;
+            else if (in.accept("!=")) t.how = relation::not_equal;
+            else if (in.accept("<=")) t.how = relation::less_equal;
+            else if (in.accept(">=")) t.how = relation::greater_equal;
+            else if (in.accept("<")) t.how = relation::less;
+            else if (in.accept(">")) t.how = relation::greater;
+            else in.fail("expected a comparison");
+            t.number = in.number();
+            return t;
+        }
+
+        static bool holds(test const& t, breakpoint_facts const& facts) {
+            switch (t.what) {
+                case subject::result:
+                    return contains(facts.result, t.symbol);
+                case subject::argument:
+                    return t.index < facts.arguments.size() && contains(facts.arguments[t.index], t.symbol);
+                default:
+                    break;
+            }
+
+            std::uint64_t value = 0;
+            switch (t.what) {
+                case subject::depth: value = facts.depth; break;
+                case subject::argc: value = facts.arguments.size(); break;
+                case subject::size: value = facts.size; break;
+                case subject::argument_size:
+                    if (t.index >= facts.arguments.size()) return false;
+                    value = facts.arguments[t.index].size();
+                    break;
+                default: break;
+            }
+
+            switch (t.how) {
+                case relation::equal: return value == t.number;
+                case relation::not_equal: return value != t.number;
+                case relation::less: return value < t.number;
+                case relation::less_equal: return value <= t.number;
+                case relation::greater: return value > t.number;
+                case relation::greater_equal: return value >= t.number;
+                default: return false;
+            }
+        }
+
+        static bool contains(std::vector<symbol_id> const& tokens, symbol_id symbol) {
+            for (auto token : tokens) {
+                if (token == symbol) return true;
+            }
+            return false;
+        }
+
+        std::vector<test> tests;
+        std::string text;
+        bool needs_result;
+        bool needs_arguments;
+    };
+
+    // Breakpoints of one event type, on exact macro names and on name patterns. A name
+    // written as `/.../` is a regex, one containing `*`, `?` or `[` a glob; all patterns
+    // share one name_automaton. Which breakpoints apply to a macro is worked out the
+    // first time it shows up and remembered until the breakpoints change, so after that
+    // an event costs a bitset lookup however many patterns are set.
+    struct breakpoint_list {
+        using condition_list = std::vector<breakpoint_condition const*>;
+
+        // Throws std::runtime_error if the name is a pattern that does not parse
+        void add(std::string const& name, breakpoint_condition&& condition, symbol_table& symbols) {
+            forget();
+            if (!is_pattern(name)) {
+                auto macro = symbols.intern(name);
+                macros.insert(macro);
+                conditions[macro].push_back(std::move(condition));
+                return;
+            }
+
+            auto existing = std::find_if(patterns.begin(), patterns.end(), [&name](auto const& p) { return p.text == name; });
+            if (existing == patterns.end()) {
+                compile(automaton, name);
+                patterns.push_back({name, {}});
+                existing = patterns.end() - 1;
+            }
+            existing->conditions.push_back(std::move(condition));
+        }
+
+        void remove(std::string const& name, symbol_table const& symbols) {
+            forget();
+            if (!is_pattern(name)) {
+                auto macro = symbols.find(name);
+                macros.erase(macro);
+                conditions.erase(macro);
+                return;
+            }
+
+            auto existing = std::find_if(patterns.begin(), patterns.end(), [&name](auto const& p) { return p.text == name; });
+            if (existing == patterns.end()) return;
+            patterns.erase(existing);
+            automaton.clear();
+            for (auto const& p : patterns) compile(automaton, p.text);
+        }
+
+        bool empty() const {
+            return macros.empty() && patterns.empty();
+        }
+
+        // Conditions of every breakpoint on the macro, empty if it has none
+        condition_list const& of(symbol_id macro, symbol_table const& symbols) const {
+            static condition_list const none;
+            if (macro == no_symbol) return none;
+            if (!resolved.contains(macro)) resolve(macro, symbols);
+            if (!matched.contains(macro)) return none;
+            return applicable.at(macro);
+        }
+
+        static bool is_pattern(std::string_view name) {
+            return is_regex(name) || name.find_first_of("*?[") != std::string_view::npos;
+        }
+
+    private:
+        struct pattern_breakpoints {
+            std::string text;
+            std::vector<breakpoint_condition> conditions;
+        };
+
+        static bool is_regex(std::string_view name) {
+            return name.size() >= 2 && name.front() == '/' && name.back() == '/';
+        }
+
+        static void compile(name_automaton& into, std::string_view text) {
+            if (is_regex(text)) {
+                into.add_regex(text.substr(1, text.size() - 2));
+            } else {
+                into.add_glob(text);
+            }
+        }
+
+        void resolve(symbol_id macro, symbol_table const& symbols) const {
+            resolved.insert(macro);
+            auto found = condition_list();
+            auto exact = conditions.find(macro);
+            if (exact != conditions.end()) {
+                for (auto const& c : exact->second) found.push_back(&c);
+            }
+            if (!automaton.empty()) {
+                for (auto id : automaton.match(symbols.name(macro))) {
+                    for (auto const& c : patterns[id].conditions) found.push_back(&c);
+                }
+            }
+            if (found.empty()) return;
+            matched.insert(macro);
+            applicable[macro] = std::move(found);
+        }
+
+        void forget() {
+            resolved.clear();
+            matched.clear();
+            applicable.clear();
+        }
+
+        symbol_set macros;
+        std::unordered_map<symbol_id, std::vector<breakpoint_condition>> conditions;
+        std::vector<pattern_breakpoints> patterns;  // pattern i is number i in the automaton
+        name_automaton automaton;
+
+        // Memo of which breakpoints apply to each macro seen since the last change
+        mutable symbol_set resolved;
+        mutable symbol_set matched;
+        mutable std::unordered_map<symbol_id, condition_list> applicable;
+    };
+}
+
+#endif // PPSTEP_BREAKPOINT_HPP
@@ -1,6 +1,7 @@
 #ifndef PPSTEP_CLIENT_HPP
 #define PPSTEP_CLIENT_HPP
 
+#include <array>
 #include <vector>
 #include <stack>
 #include <optional>
@@ -17,17 +18,22 @@
 #include <ctime>
 #include <iomanip>
 #include <deque>
+#include <memory>
 
 #include "server_fwd.hpp"
 #include "client_fwd.hpp"
 #include "view.hpp"
 #include "utils.hpp"
+#include "stats.hpp"
+#include "symbol_table.hpp"
+#include "token_sequence.hpp"
+#include "token_handle.hpp"
+#include "history.hpp"
+#include "breakpoint.hpp"
+#include "sequence_index.hpp"
+#include "trace.hpp"
 
 namespace ppstep {
-    // Configurable history size limit to prevent OOM
-    constexpr std::size_t MAX_HISTORY_SIZE = 1000;  // Keep last 1000 events
-    constexpr std::size_t HISTORY_TRIM_SIZE = 800;  // Trim to this when limit hit
-    
     namespace ansi {
         constexpr auto black_fg = "\u001b[30m";
         constexpr auto white_fg = "\u001b[37;1m";
@@ -147,24 +153,79 @@ namespace ppstep {
             events::rescanned<ContainerT>,
             events::lexed<ContainerT>>;
     
-    template <class ContainerT>
+    // One level of the token stack. Levels share their unchanged tokens through the
+    // piece table, so a splice costs the size of the change rather than of the sequence.
     struct offset_container {
-        using iterator = typename ContainerT::const_iterator;
-        
-        offset_container(ContainerT&& tokens, iterator&& start) : tokens(std::move(tokens)), start(std::move(start)) {}
-        
-        offset_container(ContainerT&& tokens) : tokens(std::move(tokens)), start(this->tokens.end()) {}
+        // Matches this close to start are found by plain search
+        static constexpr std::size_t linear_search_limit = 256;
+        // Building an index costs about as much as a handful of full scans
+        static constexpr std::size_t scans_before_index = 4;
+
+        offset_container(handle_pieces&& handles, std::size_t start) : handles(std::move(handles)), index(), far_searches(0), start(start) {}
         
-        offset_container(offset_container<ContainerT> const&) = delete;
+        offset_container(offset_container const&) = delete;
         
-        std::optional<std::pair<iterator, iterator>> find_pattern(ContainerT const& pattern) const {
-            return find_sublist(tokens, pattern, start);
+        // First occurrence of the pattern at or after start, as indices into handles.
+        // Most patterns sit right at start, where a plain search is cheapest. Searches
+        // that have to look further scan the rest too at first, since they often miss
+        // and the sequence is popped; once a sequence has been scanned a few times it
+        // gets an index, so repeated lookups in a long sequence stop rescanning it.
+        template <class KeyOfT>
+        std::optional<std::pair<std::size_t, std::size_t>> find_pattern(sequence_index::pattern const& pattern, KeyOfT&& key_of) const {
+            auto const& keys = pattern.keys;
+            auto same = [&key_of](token_ref ref, std::uint64_t key) { return key_of(ref) == key; };
+
+            auto first = handles.at(start);
+            auto window = handles.size() - std::min(start, handles.size());
+            auto bounded = window > pattern.size + linear_search_limit;
+            auto limit = bounded ? handles.at(start + pattern.size + linear_search_limit) : handles.end();
+            auto match = std::search(first, limit, keys.begin(), keys.end(), same);
+            if (match != limit || !bounded) {
+                if (match == limit) return {};
+                auto at = start + static_cast<std::size_t>(std::distance(first, match));
+                return {{at, at + pattern.size}};
+            }
+
+            auto resume = start + linear_search_limit + 1;
+            if (!index && far_searches++ < scans_before_index) {
+                auto from = handles.at(resume);
+                match = std::search(from, handles.end(), keys.begin(), keys.end(), same);
+                if (match == handles.end()) return {};
+                auto at = resume + static_cast<std::size_t>(std::distance(from, match));
+                return {{at, at + pattern.size}};
+            }
+
+            if (!index) index.emplace(handles, key_of);
+            auto found = index->find(pattern, resume, [this, &keys, &same](std::size_t at) {
+                return std::equal(keys.begin(), keys.end(), handles.at(at), [&same](std::uint64_t key, token_ref ref) { return same(ref, key); });
+            });
+            if (!found) return {};
+            return {{*found, *found + pattern.size}};
         }
         
-        ContainerT tokens;
-        iterator start;
+        handle_pieces handles;
+        mutable std::optional<sequence_index> index;
+        mutable std::size_t far_searches;
+        std::size_t start;
     };
     
+    // Rebuilds an event over a different token container
+    template <class ToT, class FromT, class ConvertT>
+    preprocessing_event<ToT> convert_event(preprocessing_event<FromT> const& event, ConvertT&& convert) {
+        return std::visit([&convert](auto const& e) -> preprocessing_event<ToT> {
+            using event_type = std::decay_t<decltype(e)>;
+            if constexpr (std::is_same_v<event_type, events::call<FromT>>) {
+                return events::call<ToT>(convert(e.tokens), e.start, e.end);
+            } else if constexpr (std::is_same_v<event_type, events::expanded<FromT>>) {
+                return events::expanded<ToT>(convert(e.initial), e.start, e.end);
+            } else if constexpr (std::is_same_v<event_type, events::rescanned<FromT>>) {
+                return events::rescanned<ToT>(convert(e.cause), convert(e.initial), e.start, e.end);
+            } else {
+                return events::lexed<ToT>();
+            }
+        }, event);
+    }
+
     template <class ContainerT>
     struct historical_event {
         historical_event(ContainerT tokens, preprocessing_event<ContainerT>&& event) : tokens(std::move(tokens)), event(std::move(event)) {}
@@ -172,51 +233,114 @@ namespace ppstep {
         ContainerT tokens;
         preprocessing_event<ContainerT> event;
     };
+
+    // Serializes history events for spilled history segments: u8 kind, u32 start,
+    // u32 end, then the event's token sequences as handles
+    struct history_event_codec {
+        using event_type = preprocessing_event<handle_sequence>;
+
+        static std::size_t footprint(event_type const& event) {
+            return std::visit([](auto const& e) -> std::size_t {
+                using type = std::decay_t<decltype(e)>;
+                if constexpr (std::is_same_v<type, events::call<handle_sequence>>) {
+                    return history_detail::heap_size(e.tokens);
+                } else if constexpr (std::is_same_v<type, events::expanded<handle_sequence>>) {
+                    return history_detail::heap_size(e.initial);
+                } else if constexpr (std::is_same_v<type, events::rescanned<handle_sequence>>) {
+                    return history_detail::heap_size(e.cause) + history_detail::heap_size(e.initial);
+                } else {
+                    return 0;
+                }
+            }, event);
+        }
+
+        static void write(std::string& out, event_type const& event) {
+            using namespace history_detail;
+            put(out, static_cast<std::uint8_t>(event.index()));
+            std::visit([&out](auto const& e) {
+                using type = std::decay_t<decltype(e)>;
+                if constexpr (std::is_same_v<type, events::lexed<handle_sequence>>) {
+                    put(out, std::uint32_t(0));
+                    put(out, std::uint32_t(0));
+                } else {
+                    put(out, static_cast<std::uint32_t>(e.start));
+                    put(out, static_cast<std::uint32_t>(e.end));
+                }
+                if constexpr (std::is_same_v<type, events::call<handle_sequence>>) {
+                    put_handles(out, e.tokens);
+                } else if constexpr (std::is_same_v<type, events::expanded<handle_sequence>>) {
+                    put_handles(out, e.initial);
+                } else if constexpr (std::is_same_v<type, events::rescanned<handle_sequence>>) {
+                    put_handles(out, e.cause);
+                    put_handles(out, e.initial);
+                }
+            }, event);
+        }
+
+        static event_type read(char const*& next, char const* last) {
+            using namespace history_detail;
+            auto kind = get<std::uint8_t>(next, last);
+            std::size_t start = get<std::uint32_t>(next, last);
+            std::size_t end = get<std::uint32_t>(next, last);
+            switch (kind) {
+                case 0: return events::call<handle_sequence>(get_handles(next, last), start, end);
+                case 1: return events::expanded<handle_sequence>(get_handles(next, last), start, end);
+                case 2: {
+                    auto cause = get_handles(next, last);
+                    return events::rescanned<handle_sequence>(std::move(cause), get_handles(next, last), start, end);
+                }
+                case 3: return events::lexed<handle_sequence>();
+                default: throw std::runtime_error("history segment is truncated or corrupt");
+            }
+        }
+    };
     
     template <class TokenT, class ContainerT>
     struct client {
+        // Client-side history and rendering state; Wave's own sequences stay ContainerT
+        using sequence_type = small_token_sequence<TokenT>;
+
         client(server_state<ContainerT>& state, std::string prefix) 
             : state(&state), 
               cli(client_cli<TokenT, ContainerT>(*this, std::move(prefix))), 
               mode(stepping_mode::FREE), 
-              target_macro(), 
+              target_symbol(no_symbol), 
               target_found(false),
+              pool(state.symbols),
               recording_active(false),
               break_on_error(false),
               error_occurred(false),
               last_error_line(0),
-              lexed_token_count(0) {}
+              batch_mode(false),
+              diagnostics(&std::cerr),
+              prompting(true) {}
         
         client(server_state<ContainerT>& state) : client(state, "") {}
 
-        // Recording functionality
-        bool start_recording(const std::string& filename) {
+        // Recording functionality. Events are written by the recorder's own thread.
+        // `unit` is set for the parts of a compile database trace; binary traces keep it
+        // in their header, text ones get it from the merge.
+        bool start_recording(const std::string& filename, bool binary = false, std::string const& unit = std::string()) {
             if (recording_active) {
                 stop_recording();
             }
-            
-            record_file.open(filename, std::ios::out | std::ios::trunc);
-            if (!record_file.is_open()) {
+
+            recorder = std::make_unique<trace_recorder>(state->symbols);
+            if (!recorder->open(filename, binary, unit)) {
+                recorder.reset();
                 return false;
             }
-            
+
             recording_active = true;
             record_filename = filename;
-            
-            // Write header with timestamp
-            auto now = std::chrono::system_clock::now();
-            auto time_t = std::chrono::system_clock::to_time_t(now);
-            record_file << "=== PPSTEP TRACE ===" << std::endl;
-            record_file << "Started: " << std::ctime(&time_t);
-            record_file << "===================" << std::endl << std::endl;
-            
             return true;
         }
         
+        // Returns once every recorded event is in the file
         void stop_recording() {
             if (recording_active) {
-                record_file << std::endl << "=== END OF TRACE ===" << std::endl;
-                record_file.close();
+                recorder->close();
+                recorder.reset();
                 recording_active = false;
                 record_filename.clear();
             }
@@ -232,6 +356,7 @@ namespace ppstep {
         
         // Error handling functionality
         void on_error(const std::string& error_msg, const std::string& file, int line) {
+            ++stats.errors;
             error_occurred = true;
             last_error_message = error_msg;
             last_error_file = file;
@@ -239,10 +364,17 @@ namespace ppstep {
             
             // Record error if recording is active
             if (recording_active) {
-                record_file << "[PPSTEP-ERROR] " << file << ":" << line 
-                           << " - " << error_msg << std::endl;
+                recorder->error(file, static_cast<std::size_t>(std::max(line, 0)), error_msg);
             }
             
+            // Headless runs emit one compiler-style line per error in a single write
+            if (batch_mode) {
+                std::ostringstream line_out;
+                line_out << file << ':' << line << ": error: " << error_msg << '\n';
+                *diagnostics << line_out.str();
+                return;
+            }
+
             // Print error info
             std::cerr << "\n" << ansi::bold << "❌ ERROR: " << ansi::reset 
                       << error_msg << "\n";
@@ -267,108 +399,39 @@ namespace ppstep {
             error_occurred = false;
         }
         
-        // Helper function to output tokens with normalized whitespace
-        void output_tokens_normalized(std::ostream& os, const ContainerT& tokens) {
-            bool prev_was_whitespace = false;
-            bool need_space = false;
-            
-            for (const auto& tok : tokens) {
-                // Check if this is a whitespace token
-                if (IS_CATEGORY(tok, boost::wave::WhiteSpaceTokenType)) {
-                    // Mark that we've seen whitespace but don't output it yet
-                    if (!prev_was_whitespace && need_space) {
-                        // We need whitespace here
-                        prev_was_whitespace = true;
-                    }
-                } else {
-                    // This is a non-whitespace token
-                    auto val = tok.get_value();
-                    
-                    // Add a single space if we had whitespace before this token
-                    if (prev_was_whitespace || need_space) {
-                        // Don't add space at the beginning or before certain punctuation
-                        if (!val.empty() && need_space) {
-                            char first_char = val.c_str()[0];
-                            if (first_char != ',' && first_char != ';' && first_char != ')' && 
-                                first_char != ']' && first_char != '}') {
-                                os << " ";
-                            }
-                        }
-                    }
-                    
-                    os << val;
-                    
-                    // Determine if we need space after this token
-                    if (!val.empty()) {
-                        char last_char = val.c_str()[val.size() - 1];
-                        need_space = (last_char != '(' && last_char != '[' && last_char != '{');
-                    } else {
-                        need_space = false;
-                    }
-                    
-                    prev_was_whitespace = false;
-                }
-            }
+        // Where an event happens, for the trace
+        template <class ContextT>
+        trace_point trace_point_of(ContextT& ctx) const {
+            auto const& pos = ctx.get_main_pos();
+            return trace_point{std::string_view(pos.get_file().c_str(), pos.get_file().size()), pos.get_line(), pos.get_column(),
+                               state->expanding.size() + state->rescanning.size()};
         }
         
-        // Trim history to prevent memory bloat
-        void trim_history_if_needed() {
-            if (token_history.size() > MAX_HISTORY_SIZE) {
-                // Keep only the most recent HISTORY_TRIM_SIZE events
-                std::size_t to_remove = token_history.size() - HISTORY_TRIM_SIZE;
-                token_history.erase(token_history.begin(), token_history.begin() + to_remove);
-                
-                // Also trim lexed_tokens to match
-                if (lexed_tokens.size() > HISTORY_TRIM_SIZE * 10) {  // Heuristic
-                    std::size_t tokens_to_remove = lexed_tokens.size() / 2;
-                    lexed_tokens.erase(lexed_tokens.begin(), lexed_tokens.begin() + tokens_to_remove);
-                    lexed_token_count += tokens_to_remove;
-                }
-            }
-        }
-
         template <class ContextT>
         void on_lexed(ContextT& ctx, TokenT const& token) {
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (token.get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
+            ++stats.lexed;
 
-            if (token_stack.empty()) {
-                // Use deque for efficient building - don't store full history for every token
-                ContainerT last_tokens;
-                if (!token_history.empty()) {
-                    // Only keep reference to current position, not full copy
-                    last_tokens.push_back(token);
-                } else {
-                    last_tokens.push_back(token);
-                }
+            // Every lexed token is recorded, including those that only close the
+            // expansions on the token stack, so a replay sees what the session saw
+            if (recording_active) {
+                recorder->lexed(trace_point_of(ctx), token);
+            }
 
-                lexed_tokens.push_back(token);
-                token_history.push_back(historical_event<ContainerT>(std::move(last_tokens), events::lexed<ContainerT>()));
-                
-                // Trim history periodically
-                trim_history_if_needed();
+            // Batch mode never renders, so skip the token stack bookkeeping entirely
+            if (batch_mode) return;
 
-                // Record lexed token if recording
-                if (recording_active) {
-                    record_file << "[LEXED] " << token.get_value() << std::endl;
-                }
+            if (token_stack.empty()) {
+                record(ctx, handle_pieces(handle_sequence{pool.encode(token)}), events::lexed<handle_sequence>());
 
-                handle_prompt(ctx, token, preprocessing_event_type::LEXED);
+                handle_prompt(ctx, preprocessing_event_type::LEXED);
 
             } else {
-                auto const& last_tokens = newest_history()->tokens;
+                auto const& last_tokens = token_history.newest_tokens();
 
                 lex_buffer.push_back(token);
-                if (std::equal(std::next(std::begin(last_tokens), lexed_tokens.size()), std::end(last_tokens),
+                if (std::equal(std::begin(last_tokens), std::end(last_tokens),
                                std::begin(lex_buffer), std::end(lex_buffer),
-                               [](auto const& a, auto const& b) { return a.get_value() == b.get_value(); })) {
-                    lexed_tokens.insert(std::end(lexed_tokens), std::begin(lex_buffer), std::end(lex_buffer));
+                               [this](token_ref handle, auto const& token) { return pool.value_of(handle) == symbol_of(token); })) {
                     lex_buffer.clear();
                     reset_token_stack();
                 }
@@ -376,338 +439,230 @@ namespace ppstep {
         }
 
         // Overloaded version with preserved tokens for recording
-        template <class ContextT>
-        void on_expand_function(ContextT& ctx, TokenT const& call, std::vector<ContainerT> const& arguments, 
-                               ContainerT call_tokens, std::vector<ContainerT> const& preserved_arguments, 
-                               ContainerT preserved_call_tokens) {
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (call.get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
+        template <class ContextT, class ArgumentsT, class CallT, class PreservedArgumentsT, class PreservedCallT>
+        void on_expand_function(ContextT& ctx, TokenT const& call, ArgumentsT const& arguments, 
+                               CallT const& call_view, PreservedArgumentsT const& preserved_arguments, 
+                               PreservedCallT const& preserved_call_tokens) {
+            count_call();
 
             // Record function-like macro call if recording with normalized whitespace
             if (recording_active) {
-                record_file << "[CALL] ";
-                output_tokens_normalized(record_file, preserved_call_tokens);
-                record_file << std::endl;
-                
-                // Record arguments with normalized whitespace
-                if (!preserved_arguments.empty()) {
-                    for (size_t i = 0; i < preserved_arguments.size(); ++i) {
-                        record_file << "  ARG[" << i << "]: ";
-                        output_tokens_normalized(record_file, preserved_arguments[i]);
-                        record_file << std::endl;
-                    }
-                }
+                recorder->call(trace_point_of(ctx), preserved_call_tokens, preserved_arguments, true);
             }
 
+            if (batch_mode) return;
+
+            auto call_tokens = materialize(call_view);
+
             // Continue with normal processing using sanitized tokens
             if (token_stack.empty()) {
-                push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
             } else {
                 auto lookup = find_match_indices(token_stack.back(), call_tokens);
                 if (lookup) {
                     auto [start, end] = *lookup;
-                    // Don't prepend full lexed history - just store the event
-                    ContainerT event_tokens = call_tokens;
-                    token_history.push_back(historical_event<ContainerT>(
-                        std::move(event_tokens),
-                        events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count + start, lexed_tokens.size() + lexed_token_count + end)));
-                    trim_history_if_needed();
+                    // Render the call where it sits in the sequence it was found in
+                    record(ctx, token_stack.back().handles, events::call<handle_sequence>(encode(call_tokens), start, end));
                 } else {
                     reset_token_stack();
-                    push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                    push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
                 }
             }
             
-            handle_prompt(ctx, call, preprocessing_event_type::CALL);
+            handle_prompt(ctx, preprocessing_event_type::CALL);
         }
         
         // Keep original version for backward compatibility
-        template <class ContextT>
-        void on_expand_function(ContextT& ctx, TokenT const& call, std::vector<ContainerT> const& arguments, ContainerT call_tokens) {
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (call.get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
+        template <class ContextT, class ArgumentsT, class CallT>
+        void on_expand_function(ContextT& ctx, TokenT const& /*call*/, ArgumentsT const& arguments, CallT const& call_view) {
+            count_call();
 
             // Fallback for when preserved versions aren't available
             if (recording_active) {
-                record_file << "[CALL] ";
-                for (const auto& tok : call_tokens) {
-                    record_file << tok.get_value();
-                    record_file << " ";
-                }
-                record_file << std::endl;
-                
-                if (!arguments.empty()) {
-                    for (size_t i = 0; i < arguments.size(); ++i) {
-                        record_file << "  ARG[" << i << "]: ";
-                        for (const auto& tok : arguments[i]) {
-                            record_file << tok.get_value();
-                            record_file << " ";
-                        }
-                        record_file << std::endl;
-                    }
-                }
+                recorder->call(trace_point_of(ctx), call_view, arguments, false);
             }
 
+            if (batch_mode) return;
+
+            auto call_tokens = materialize(call_view);
+
             if (token_stack.empty()) {
-                push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
             } else {
                 auto lookup = find_match_indices(token_stack.back(), call_tokens);
                 if (lookup) {
                     auto [start, end] = *lookup;
-                    ContainerT event_tokens = call_tokens;
-                    token_history.push_back(historical_event<ContainerT>(
-                        std::move(event_tokens),
-                        events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count + start, lexed_tokens.size() + lexed_token_count + end)));
-                    trim_history_if_needed();
+                    // Render the call where it sits in the sequence it was found in
+                    record(ctx, token_stack.back().handles, events::call<handle_sequence>(encode(call_tokens), start, end));
                 } else {
                     reset_token_stack();
-                    push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                    push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
                 }
             }
             
-            handle_prompt(ctx, call, preprocessing_event_type::CALL);
+            handle_prompt(ctx, preprocessing_event_type::CALL);
         }
 
         template <class ContextT>
         void on_expand_object(ContextT& ctx, TokenT const& call) {
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (call.get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
+            count_call();
 
-            auto call_tokens = ContainerT{call};
+            auto call_tokens = sequence_type{call};
             
             // Record object-like macro call if recording
             if (recording_active) {
-                record_file << "[CALL] " << call.get_value() << std::endl;
+                recorder->object_call(trace_point_of(ctx), call);
             }
+
+            if (batch_mode) return;
             
             if (token_stack.empty()) {
-                push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
             } else {
                 auto lookup = find_match_indices(token_stack.back(), call_tokens);
                 if (lookup) {
                     auto [start, end] = *lookup;
-                    ContainerT event_tokens = call_tokens;
-                    token_history.push_back(historical_event<ContainerT>(
-                        std::move(event_tokens),
-                        events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count + start, lexed_tokens.size() + lexed_token_count + end)));
-                    trim_history_if_needed();
+                    // Render the call where it sits in the sequence it was found in
+                    record(ctx, token_stack.back().handles, events::call<handle_sequence>(encode(call_tokens), start, end));
                 } else {
                     reset_token_stack();
-                    push(std::move(call_tokens), events::call<ContainerT>(call_tokens, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + call_tokens.size()));
+                    push(ctx, call_tokens, events::call<handle_sequence>(encode(call_tokens), 0, call_tokens.size()));
                 }
             }
 
-            handle_prompt(ctx, call, preprocessing_event_type::CALL);
+            handle_prompt(ctx, preprocessing_event_type::CALL);
         }
 
         // Overloaded version with preserved tokens
-        template <class ContextT>
-        void on_expanded(ContextT& ctx, ContainerT const& initial, ContainerT const& result,
-                        ContainerT const& preserved_initial, ContainerT const& preserved_result) {
+        template <class ContextT, class ViewT, class PreservedT>
+        void on_expanded(ContextT& ctx, ViewT const& initial, ViewT const& result,
+                        PreservedT const& preserved_initial, PreservedT const& preserved_result) {
+            ++stats.expansions;
             if (initial.empty()) return;
 
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (initial.begin()->get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
-
             // Record expansion with normalized whitespace
             if (recording_active) {
-                record_file << "[EXPANDED]" << std::endl;
-                record_file << "  FROM: ";
-                output_tokens_normalized(record_file, preserved_initial);
-                record_file << std::endl;
-                record_file << "  TO:   ";
-                output_tokens_normalized(record_file, preserved_result);
-                record_file << std::endl;
+                recorder->expanded(trace_point_of(ctx), preserved_initial, preserved_result, true);
             }
 
+            if (batch_mode) return;
+
             // Continue with normal processing using sanitized tokens
             try {
-                auto const& [tokens, start, end] = match(initial);
+                auto const& [top, start, end] = match(initial);
 
-                ContainerT new_tokens;
+                handle_pieces new_handles;
                 std::size_t new_start, new_end;
-                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+                splice_between(*top, result, start, end, new_handles, new_start, new_end);
 
-                push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::expanded<ContainerT>(initial, lexed_tokens.size() + lexed_token_count + new_start, lexed_tokens.size() + lexed_token_count + new_end));
+                push(ctx,
+                     std::move(new_handles),
+                     new_start,
+                     events::expanded<handle_sequence>(encode(initial), new_start, new_end));
 
             } catch (std::logic_error const&) {
-                push(ContainerT(result), events::expanded<ContainerT>(initial, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + result.size()));
+                push(ctx, result, events::expanded<handle_sequence>(encode(initial), 0, result.size()));
             }
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::EXPANDED);
+            handle_prompt(ctx, preprocessing_event_type::EXPANDED);
         }
         
         // Keep original version for backward compatibility
-        template <class ContextT>
-        void on_expanded(ContextT& ctx, ContainerT const& initial, ContainerT const& result) {
+        template <class ContextT, class InitialT, class ResultT>
+        void on_expanded(ContextT& ctx, InitialT const& initial, ResultT const& result) {
+            ++stats.expansions;
             if (initial.empty()) return;
 
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (initial.begin()->get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
-
             // Fallback for when preserved versions aren't available
             if (recording_active) {
-                record_file << "[EXPANDED]" << std::endl;
-                record_file << "  FROM: ";
-                for (const auto& tok : initial) {
-                    record_file << tok.get_value() << " ";
-                }
-                record_file << std::endl;
-                record_file << "  TO:   ";
-                for (const auto& tok : result) {
-                    record_file << tok.get_value() << " ";
-                }
-                record_file << std::endl;
+                recorder->expanded(trace_point_of(ctx), initial, result, false);
             }
 
+            if (batch_mode) return;
+
             try {
-                auto const& [tokens, start, end] = match(initial);
+                auto const& [top, start, end] = match(initial);
 
-                ContainerT new_tokens;
+                handle_pieces new_handles;
                 std::size_t new_start, new_end;
-                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+                splice_between(*top, result, start, end, new_handles, new_start, new_end);
 
-                push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::expanded<ContainerT>(initial, lexed_tokens.size() + lexed_token_count + new_start, lexed_tokens.size() + lexed_token_count + new_end));
+                push(ctx,
+                     std::move(new_handles),
+                     new_start,
+                     events::expanded<handle_sequence>(encode(initial), new_start, new_end));
 
             } catch (std::logic_error const&) {
-                push(ContainerT(result), events::expanded<ContainerT>(initial, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + result.size()));
+                push(ctx, result, events::expanded<handle_sequence>(encode(initial), 0, result.size()));
             }
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::EXPANDED);
+            handle_prompt(ctx, preprocessing_event_type::EXPANDED);
         }
 
         // Overloaded version with preserved tokens
-        template <class ContextT>
-        void on_rescanned(ContextT& ctx, ContainerT const& cause, ContainerT const& initial, ContainerT const& result,
-                         ContainerT const& preserved_cause, ContainerT const& preserved_initial, ContainerT const& preserved_result) {
+        template <class ContextT, class ViewT, class PreservedT>
+        void on_rescanned(ContextT& ctx, ViewT const& cause, ViewT const& initial, ViewT const& result,
+                         PreservedT const& preserved_cause, PreservedT const& preserved_initial, PreservedT const& preserved_result) {
+            ++stats.rescans;
             if (initial.empty()) return;
 
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (initial.begin()->get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
-
             // Record rescan with normalized whitespace
             if (recording_active) {
-                record_file << "[RESCANNED]" << std::endl;
-                record_file << "  FROM:      ";
-                output_tokens_normalized(record_file, preserved_initial);
-                record_file << std::endl;
-                record_file << "  TO:        ";
-                output_tokens_normalized(record_file, preserved_result);
-                record_file << std::endl;
-                record_file << "  CAUSED BY: ";
-                output_tokens_normalized(record_file, preserved_cause);
-                record_file << std::endl;
+                recorder->rescanned(trace_point_of(ctx), preserved_cause, preserved_initial, preserved_result, true);
             }
 
+            if (batch_mode) return;
+
             // Continue with normal processing using sanitized tokens
             try {
-                auto const& [tokens, start, end] = match(initial);
+                auto const& [top, start, end] = match(initial);
 
-                ContainerT new_tokens;
+                handle_pieces new_handles;
                 std::size_t new_start, new_end;
-                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+                splice_between(*top, result, start, end, new_handles, new_start, new_end);
                 
-                push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + lexed_token_count + new_start, lexed_tokens.size() + lexed_token_count + new_end));
+                push(ctx,
+                     std::move(new_handles),
+                     new_start,
+                     events::rescanned<handle_sequence>(encode(cause), encode(initial), new_start, new_end));
 
             } catch (std::logic_error const&) {
-                push(ContainerT(result), events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + result.size()));
+                push(ctx, result, events::rescanned<handle_sequence>(encode(cause), encode(initial), 0, result.size()));
             }
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::RESCANNED);
+            handle_prompt(ctx, preprocessing_event_type::RESCANNED);
         }
         
         // Keep original version for backward compatibility
-        template <class ContextT>
-        void on_rescanned(ContextT& ctx, ContainerT const& cause, ContainerT const& initial, ContainerT const& result) {
+        template <class ContextT, class InitialT, class ResultT>
+        void on_rescanned(ContextT& ctx, InitialT const& cause, InitialT const& initial, ResultT const& result) {
+            ++stats.rescans;
             if (initial.empty()) return;
 
-            // Fast path: skip processing if target is set and not found yet
-            if (!target_macro.empty() && !target_found) {
-                if (initial.begin()->get_value() == target_macro) {
-                    target_found = true;
-                } else {
-                    return;
-                }
-            }
-
             // Fallback for when preserved versions aren't available
             if (recording_active) {
-                record_file << "[RESCANNED]" << std::endl;
-                record_file << "  FROM:      ";
-                for (const auto& tok : initial) {
-                    record_file << tok.get_value() << " ";
-                }
-                record_file << std::endl;
-                record_file << "  TO:        ";
-                for (const auto& tok : result) {
-                    record_file << tok.get_value() << " ";
-                }
-                record_file << std::endl;
-                record_file << "  CAUSED BY: ";
-                for (const auto& tok : cause) {
-                    record_file << tok.get_value() << " ";
-                }
-                record_file << std::endl;
+                recorder->rescanned(trace_point_of(ctx), cause, initial, result, false);
             }
 
+            if (batch_mode) return;
+
             try {
-                auto const& [tokens, start, end] = match(initial);
+                auto const& [top, start, end] = match(initial);
 
-                ContainerT new_tokens;
+                handle_pieces new_handles;
                 std::size_t new_start, new_end;
-                splice_between(*tokens, result, start, end, new_tokens, new_start, new_end);
+                splice_between(*top, result, start, end, new_handles, new_start, new_end);
                 
-                push(std::move(new_tokens),
-                     std::next(new_tokens.begin(), new_start),
-                     events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + lexed_token_count + new_start, lexed_tokens.size() + lexed_token_count + new_end));
+                push(ctx,
+                     std::move(new_handles),
+                     new_start,
+                     events::rescanned<handle_sequence>(encode(cause), encode(initial), new_start, new_end));
 
             } catch (std::logic_error const&) {
-                push(ContainerT(result), events::rescanned<ContainerT>(cause, initial, lexed_tokens.size() + lexed_token_count, lexed_tokens.size() + lexed_token_count + result.size()));
+                push(ctx, result, events::rescanned<handle_sequence>(encode(cause), encode(initial), 0, result.size()));
             }
 
-            handle_prompt(ctx, *(initial.begin()), preprocessing_event_type::RESCANNED);
+            handle_prompt(ctx, preprocessing_event_type::RESCANNED);
         }
         
         template <typename ContextT, typename ExceptionT>
@@ -718,97 +673,338 @@ namespace ppstep {
 
         template <class ContextT>
         void on_complete(ContextT& ctx) {
+            if (recording_active) {
+                recorder->complete(trace_point_of(ctx));
+            }
+            if (batch_mode) return;
             cli.prompt(ctx, "complete");
         }
         
         template <class ContextT>
         void on_start(ContextT& ctx) {
+            if (batch_mode) return;
             std::cout << "Preprocessing " << ctx.get_main_pos() << '.' << std::endl;
             cli.prompt(ctx, "started", false);
         }
 
-        void add_breakpoint(typename TokenT::string_type const& macro, preprocessing_event_type cond) {
-            switch (cond) {
-                case preprocessing_event_type::CALL: {
-                    expansion_breakpoints.insert(macro);
-                    break;
+        // `spec` is a macro name, optionally followed by `if` and a condition
+        void add_breakpoint(std::string const& spec, preprocessing_event_type cond) {
+            auto name_end = std::min(spec.find_first_of(" \t"), spec.size());
+            auto macro = spec.substr(0, name_end);
+            auto rest_start = spec.find_first_not_of(" \t", name_end);
+            auto rest = rest_start == std::string::npos ? std::string() : spec.substr(rest_start);
+
+            auto condition = breakpoint_condition();
+            if (!rest.empty()) {
+                if (rest.compare(0, 2, "if") != 0 || (rest.size() > 2 && !std::isspace(static_cast<unsigned char>(rest[2])))) {
+                    std::cout << "Expected \"if\" after the macro name, found \"" << rest << "\"." << std::endl;
+                    return;
                 }
-                case preprocessing_event_type::EXPANDED: {
-                    expanded_breakpoints.insert(macro);
-                    break;
+                try {
+                    auto source = std::string_view(rest).substr(2);
+                    source.remove_prefix(std::min(source.find_first_not_of(" \t"), source.size()));
+                    condition = breakpoint_condition::compile(source, state->symbols);
+                } catch (std::runtime_error const& e) {
+                    std::cout << "Invalid breakpoint condition: " << e.what() << std::endl;
+                    return;
                 }
             }
+            try {
+                breakpoints[static_cast<std::size_t>(cond)].add(macro, std::move(condition), state->symbols);
+            } catch (std::runtime_error const& e) {
+                std::cout << "Invalid breakpoint pattern: " << e.what() << std::endl;
+            }
         }
 
-        void remove_breakpoint(typename TokenT::string_type const& macro, preprocessing_event_type cond) {
-            switch (cond) {
-                case preprocessing_event_type::CALL: {
-                    expansion_breakpoints.erase(macro);
-                    break;
-                }
-                case preprocessing_event_type::EXPANDED: {
-                    expanded_breakpoints.erase(macro);
-                    break;
-                }
-            }
+        // Removes every breakpoint on the macro or pattern for that event, whatever its condition
+        void remove_breakpoint(std::string const& spec, preprocessing_event_type cond) {
+            auto macro = spec.substr(0, spec.find_first_of(" \t"));
+            breakpoints[static_cast<std::size_t>(cond)].remove(macro, state->symbols);
         }
         
-        void set_target(typename TokenT::string_type const& macro) {
-            target_macro = macro;
+        void set_target(std::string const& macro) {
+            target_symbol = state->symbols.intern(macro);
             target_found = false;
             mode = stepping_mode::UNTIL_BREAK;
             std::cout << "Target set: " << macro << " (running until found)" << std::endl;
         }
         
+        // Running to a target; no prompts until it shows up
+        bool fast_forwarding() const {
+            return target_symbol != no_symbol && !target_found;
+        }
+
+        // Called by the server on every call and lexed token. Until the target shows up
+        // the server skips the hooks altogether, keeping only its own expansion stacks
+        // balanced and the events counted. A recording needs every event, so it keeps
+        // the hooks running and only the prompts wait.
+        bool skips_to_target(TokenT const& token) {
+            if (!fast_forwarding() || reaches_target(token)) return false;
+            return !recording_active;
+        }
+
+        bool reaches_target(TokenT const& token) {
+            if (symbol_of(token) != target_symbol) return false;
+            target_found = true;
+            if (!recording_active) {
+                // Nothing skipped reached the token stack, so it no longer matches the input
+                reset_token_stack();
+                lex_buffer.clear();
+            }
+            return true;
+        }
+
         server_state<ContainerT> const& get_state() {
             return *state;
         }
 
+        // A replay that jumps catches up to its target with prompts off; history and the
+        // token stack still follow every event
+        void set_prompting(bool enable) {
+            prompting = enable;
+        }
+
+        // The events that follow do not continue the ones on the token stack
+        void discard_token_stack() {
+            reset_token_stack();
+            lex_buffer.clear();
+        }
+
+        // Batch mode runs the session headless: no prompts and no rendering state
+        void set_batch_mode(bool enable) {
+            batch_mode = enable;
+        }
+
+        bool is_batch_mode() const {
+            return batch_mode;
+        }
+
+        // Where headless sessions report errors; parallel runs give each client its own buffer
+        void set_diagnostic_stream(std::ostream& os) {
+            diagnostics = &os;
+        }
+
+        std::ostream& diagnostic_stream() {
+            return *diagnostics;
+        }
+
+        // Whether the hooks must hand over sanitized token sequences, or just event boundaries
+        bool needs_token_payloads() const {
+            return !batch_mode || recording_active;
+        }
+
+        // History past this many bytes of memory is spilled to a temporary file
+        void set_history_memory(std::size_t bytes) {
+            token_history.set_memory_budget(bytes);
+        }
+
+        // --debug prints events in the server instead of handing them over, but they still count
+        void count_event(preprocessing_event_type type) {
+            switch (type) {
+                case preprocessing_event_type::CALL: count_call(); break;
+                case preprocessing_event_type::EXPANDED: ++stats.expansions; break;
+                case preprocessing_event_type::RESCANNED: ++stats.rescans; break;
+                case preprocessing_event_type::LEXED: ++stats.lexed; break;
+            }
+        }
+
+        void count_file_load(bool cache_hit) {
+            ++(cache_hit ? stats.file_cache_hits : stats.file_cache_misses);
+        }
+
+        void count_token_load(bool cache_hit) {
+            ++(cache_hit ? stats.token_cache_hits : stats.token_cache_misses);
+        }
+
+        session_stats const& get_stats() const {
+            return stats;
+        }
+
         void set_mode(stepping_mode m) {
             mode = m;
         }
 
-        auto newest_history() {
-            return token_history.rbegin();
+        std::size_t history_size() const {
+            return token_history.size();
         }
-        
-        auto oldest_history() {
-            return token_history.rend();
+
+        // An earlier event turned back into tokens for rendering, counted back from the
+        // newest one
+        std::optional<historical_event<sequence_type>> event_at(std::size_t back) const {
+            if (back >= token_history.size()) return {};
+
+            auto index = token_history.size() - 1 - back;
+            auto decode = [this](handle_sequence const& handles) { return pool.template decode<sequence_type>(handles); };
+            return historical_event<sequence_type>(decode(token_history.tokens(index)), convert_event<sequence_type>(token_history.event(index), decode));
+        }
+
+        std::optional<historical_event<sequence_type>> newest_event() const {
+            return event_at(0);
+        }
+
+        // File, line and column of the main input when that event happened
+        std::string position_at(std::size_t back) const {
+            auto where = token_history.where(token_history.size() - 1 - back);
+            std::ostringstream os;
+            os << state->symbols.name(where.file) << ':' << where.line << ':' << where.column;
+            return os.str();
+        }
+
+        // The closest event older than `back` that a breakpoint would have stopped at
+        std::optional<std::size_t> find_breakpoint_before(std::size_t back) const {
+            for (auto i = back + 1; i < token_history.size(); ++i) {
+                if (breaks_at(i)) return i;
+            }
+            return {};
         }
 
     private:
-        using container_iterator = typename ContainerT::const_iterator;
-        
-        using range_container = std::tuple<ContainerT const*, container_iterator, container_iterator>;
+        using range_container = std::tuple<offset_container const*, std::size_t, std::size_t>;
 
         // REMOVED prepend_lexed() - major memory hog
 
-        void push(ContainerT&& tokens, preprocessing_event<ContainerT>&& event) {
-            push(std::move(tokens), std::begin(tokens), std::move(event));
+        // Probes the interned table in place; spellings never seen before map to no_symbol
+        symbol_id symbol_of(TokenT const& token) const {
+            return state->symbols.find_token(token);
         }
 
-        void push(ContainerT&& tokens, container_iterator&& head, preprocessing_event<ContainerT>&& event) {
-            // Store only the event tokens, not full history
-            token_history.push_back(historical_event<ContainerT>(tokens, std::move(event)));
-            trim_history_if_needed();
+        template <class ViewT>
+        static sequence_type materialize(ViewT const& view) {
+            return sequence_type(view.begin(), view.end());
+        }
 
-            if (head != tokens.end()) {
-                token_stack.emplace_back(std::move(tokens), std::move(head));
-            } else {
-                token_stack.emplace_back(std::move(tokens));
+        void count_call() {
+            ++stats.calls;
+            stats.max_depth = std::max(stats.max_depth, state->expanding.size());
+        }
+
+        template <class RangeT>
+        handle_sequence encode(RangeT const& tokens) {
+            return pool.encode(tokens);
+        }
+
+        template <class ContextT, class RangeT>
+        void push(ContextT& ctx, RangeT const& tokens, preprocessing_event<handle_sequence>&& event) {
+            push(ctx, handle_pieces(encode(tokens)), 0, std::move(event));
+        }
+
+        template <class ContextT>
+        void push(ContextT& ctx, handle_pieces&& handles, std::size_t head, preprocessing_event<handle_sequence>&& event) {
+            record(ctx, handles, std::move(event));
+            token_stack.emplace_back(std::move(handles), head);
+        }
+
+        // Every history entry remembers where the main input stood, so rewound states
+        // render with their own position rather than the current one
+        template <class ContextT>
+        void record(ContextT& ctx, handle_pieces const& handles, preprocessing_event<handle_sequence>&& event) {
+            auto const& pos = ctx.get_main_pos();
+            auto file = state->symbols.intern(std::string_view(pos.get_file().c_str(), pos.get_file().size()));
+            auto depth = state->expanding.size() + state->rescanning.size();
+            token_history.push(handles, std::move(event), history_position{file, static_cast<std::uint32_t>(pos.get_line()), static_cast<std::uint32_t>(pos.get_column()), static_cast<std::uint32_t>(depth)});
+        }
+
+        // Whether a breakpoint stops at the event `back` steps before the newest.
+        // Conditions see the event as history recorded it, so the live event and
+        // earlier ones are judged the same way. Only events of a macro that has a
+        // breakpoint, or the first event of each macro while patterns are set, pay for
+        // more than a bitset lookup.
+        bool breaks_at(std::size_t back) const {
+            auto index = token_history.size() - 1 - back;
+            auto [type, macro] = std::visit([this, index](auto const& e) -> std::pair<preprocessing_event_type, symbol_id> {
+                using event_type = std::decay_t<decltype(e)>;
+                auto first = [this](handle_sequence const& tokens) { return tokens.empty() ? no_symbol : pool.value_of(tokens.front()); };
+                if constexpr (std::is_same_v<event_type, events::call<handle_sequence>>) {
+                    return {preprocessing_event_type::CALL, first(e.tokens)};
+                } else if constexpr (std::is_same_v<event_type, events::expanded<handle_sequence>>) {
+                    return {preprocessing_event_type::EXPANDED, first(e.initial)};
+                } else if constexpr (std::is_same_v<event_type, events::rescanned<handle_sequence>>) {
+                    return {preprocessing_event_type::RESCANNED, first(e.cause)};
+                } else {
+                    if (breakpoints[static_cast<std::size_t>(preprocessing_event_type::LEXED)].empty()) return {preprocessing_event_type::LEXED, no_symbol};
+                    return {preprocessing_event_type::LEXED, first(token_history.tokens(index))};
+                }
+            }, token_history.event(index));
+
+            auto const& conditions = breakpoints[static_cast<std::size_t>(type)].of(macro, state->symbols);
+            if (conditions.empty()) return false;
+
+            bool needs_result = false, needs_arguments = false;
+            for (auto const* condition : conditions) {
+                if (condition->empty()) return true;
+                needs_result = needs_result || condition->uses_result();
+                needs_arguments = needs_arguments || condition->uses_arguments();
+            }
+
+            // Looking up the tokens can load another history segment, so the event is copied
+            auto event = token_history.event(index);
+            auto facts = breakpoint_facts();
+            facts.depth = token_history.where(index).depth;
+            auto [call, start, end] = std::visit([](auto const& e) -> std::tuple<handle_sequence, std::size_t, std::size_t> {
+                using event_type = std::decay_t<decltype(e)>;
+                if constexpr (std::is_same_v<event_type, events::call<handle_sequence>>) {
+                    return {e.tokens, 0, e.tokens.size()};
+                } else if constexpr (std::is_same_v<event_type, events::expanded<handle_sequence>>) {
+                    return {e.initial, e.start, e.end};
+                } else if constexpr (std::is_same_v<event_type, events::rescanned<handle_sequence>>) {
+                    return {e.cause, e.start, e.end};
+                } else {
+                    return {handle_sequence(), 0, 1};
+                }
+            }, event);
+
+            facts.size = end - start;
+            if (needs_arguments) facts.arguments = arguments_of(call);
+            if (needs_result) {
+                auto const& source = type == preprocessing_event_type::CALL ? call : token_history.tokens(index);
+                for (auto i = start; i < end && i < source.size(); ++i) {
+                    facts.result.push_back(pool.value_of(source[i]));
+                }
+            }
+
+            for (auto const* condition : conditions) {
+                if (condition->evaluate(facts)) return true;
+            }
+            return false;
+        }
+
+        // Arguments of a call as spellings, split at commas outside nested parentheses
+        std::vector<std::vector<symbol_id>> arguments_of(handle_sequence const& call) const {
+            auto arguments = std::vector<std::vector<symbol_id>>();
+            if (call.size() < 2 || pool.id_of(call[1]) != static_cast<std::uint32_t>(boost::wave::T_LEFTPAREN)) return arguments;
+
+            std::size_t nesting = 0;
+            auto current = std::vector<symbol_id>();
+            for (std::size_t i = 2; i < call.size(); ++i) {
+                auto id = pool.id_of(call[i]);
+                if (id == static_cast<std::uint32_t>(boost::wave::T_RIGHTPAREN)) {
+                    if (nesting == 0) break;
+                    --nesting;
+                } else if (id == static_cast<std::uint32_t>(boost::wave::T_LEFTPAREN)) {
+                    ++nesting;
+                } else if (id == static_cast<std::uint32_t>(boost::wave::T_COMMA) && nesting == 0) {
+                    arguments.push_back(std::move(current));
+                    current.clear();
+                    continue;
+                }
+                current.push_back(pool.value_of(call[i]));
             }
+            if (!arguments.empty() || !current.empty()) arguments.push_back(std::move(current));
+            return arguments;
         }
 
-        range_container match(ContainerT const& pattern) {
+        template <class PatternT>
+        range_container match(PatternT const& pattern) {
+            auto hashed = hash_pattern(pattern);
             while (!token_stack.empty()) {
                 auto const& top = token_stack.back();
 
-                auto sublist = top.find_pattern(pattern);
+                auto sublist = top.find_pattern(hashed, key_of());
 
                 if (sublist) {
                     auto [start, end] = *sublist;
 
-                    return std::make_tuple(&(top.tokens), start, end);
+                    return std::make_tuple(&top, start, end);
                 } else {
                     token_stack.pop_back();
                 }
@@ -819,28 +1015,42 @@ namespace ppstep {
             throw std::logic_error("could not find pattern \"" + ss.str() + "\" in token stack");
         }
         
-        std::optional<std::pair<std::size_t, std::size_t>> find_match_indices(offset_container<ContainerT> const& oc, ContainerT const& pattern) {
-            auto sublist = oc.find_pattern(pattern);
-            if (sublist) {
-                auto [start, end] = *sublist;
-
-                auto begin_to_start = std::distance(oc.tokens.begin(), start);
-                auto begin_to_end = begin_to_start + std::distance(start, end);
-                return {{begin_to_start, begin_to_end}};
-            } else {
-                return {};
-            }
+        template <class PatternT>
+        std::optional<std::pair<std::size_t, std::size_t>> find_match_indices(offset_container const& oc, PatternT const& pattern) {
+            return oc.find_pattern(hash_pattern(pattern), key_of());
         }
 
-        void splice_between(ContainerT const& tokens, ContainerT const& result, container_iterator start, container_iterator end,
-                                                       ContainerT& new_tokens, std::size_t& new_start, std::size_t& new_end) {
-            new_tokens.insert(new_tokens.end(), tokens.begin(), start);
-            new_start = new_tokens.size();
+        // Keys a pattern the same way the token stack is keyed. Equal keys mean equal
+        // tokens; a spelling that was never interned cannot occur on the stack, so it
+        // gets a key that nothing there has.
+        template <class PatternT>
+        sequence_index::pattern hash_pattern(PatternT const& pattern) const {
+            auto hashed = sequence_index::pattern();
+            for (auto const& token : pattern) {
+                if (!token.is_valid()) {
+                    hashed.push_back(pool.key_of(token_pool<TokenT>::invalid_ref));
+                    continue;
+                }
+                auto value = symbol_of(token);
+                hashed.push_back(value == no_symbol
+                    ? ~std::uint64_t(0)
+                    : token_key(static_cast<std::uint32_t>(boost::wave::token_id(token)), value));
+            }
+            return hashed;
+        }
 
-            new_tokens.insert(new_tokens.end(), result.begin(), result.end());
-            new_end = new_tokens.size();
+        auto key_of() const {
+            return [this](token_ref ref) { return pool.key_of(ref); };
+        }
 
-            new_tokens.insert(new_tokens.end(), end, tokens.end());
+        // Only the result is encoded; the pieces around it are shared with the matched sequence
+        template <class ResultT>
+        void splice_between(offset_container const& top, ResultT const& result, std::size_t start, std::size_t end,
+                            handle_pieces& new_handles, std::size_t& new_start, std::size_t& new_end) {
+            auto middle = encode(result);
+            new_start = start;
+            new_end = start + middle.size();
+            new_handles = top.handles.splice(start, end, std::move(middle));
         }
 
         void reset_token_stack() {
@@ -858,18 +1068,17 @@ namespace ppstep {
         }
 
         template <class ContextT>
-        void handle_prompt(ContextT& ctx, TokenT const& token, preprocessing_event_type type) {
+        void handle_prompt(ContextT& ctx, preprocessing_event_type type) {
             bool do_prompt = false;
 
+            if (!prompting) return;
+
             // Check target first
-            if (!target_macro.empty() && !target_found) {
-                if (token.get_value() == target_macro) {
-                    target_found = true;
-                    std::cout << "\n🎯 Target reached: " << target_macro << "\n";
-                    do_prompt = true;
-                } else {
-                    return;  // Skip everything until target
-                }
+            if (fast_forwarding()) return;
+            if (target_symbol != no_symbol) {
+                std::cout << "\n🎯 Target reached: " << state->symbols.name(target_symbol) << "\n";
+                target_symbol = no_symbol;
+                do_prompt = true;
             }
 
             // Check for errors first
@@ -883,20 +1092,8 @@ namespace ppstep {
                         break;
                     }
                     case stepping_mode::UNTIL_BREAK: {
-                        switch (type) {
-                            case preprocessing_event_type::CALL: {
-                                if (expansion_breakpoints.find(token.get_value()) != expansion_breakpoints.end()) {
-                                    do_prompt = true;
-                                }
-                                break;
-                            }
-                            case preprocessing_event_type::EXPANDED: {
-                                if (expanded_breakpoints.find(token.get_value()) != expanded_breakpoints.end()) {
-                                    do_prompt = true;
-                                }
-                                break;
-                            }
-                        }
+                        // Every prompting event has just been recorded as the newest one
+                        do_prompt = do_prompt || breaks_at(0);
                         break;
                     }
                 }
@@ -913,20 +1110,18 @@ namespace ppstep {
 
         server_state<ContainerT>* state;
         client_cli<TokenT, ContainerT> cli;
-        std::set<typename TokenT::string_type> expansion_breakpoints;
-        std::set<typename TokenT::string_type> expanded_breakpoints;
+        std::array<breakpoint_list, 4> breakpoints;  // by preprocessing_event_type
         stepping_mode mode;
-        typename TokenT::string_type target_macro;
+        symbol_id target_symbol;
         bool target_found;
 
-        std::list<offset_container<ContainerT>> token_stack;
-        std::deque<historical_event<ContainerT>> token_history;  // Changed to deque for efficient trimming
-        std::vector<TokenT> lexed_tokens;
+        std::list<offset_container> token_stack;
+        token_pool<TokenT> pool;
+        event_history<preprocessing_event<handle_sequence>, history_event_codec> token_history;
         std::vector<TokenT> lex_buffer;
-        std::size_t lexed_token_count;  // Track cumulative count when we trim
         
         // Recording state
-        std::ofstream record_file;
+        std::unique_ptr<trace_recorder> recorder;
         bool recording_active;
         std::string record_filename;
         
@@ -936,6 +1131,12 @@ namespace ppstep {
         std::string last_error_message;
         std::string last_error_file;
         int last_error_line;
+
+        // Headless session state
+        bool batch_mode;
+        session_stats stats;
+        std::ostream* diagnostics;
+        bool prompting;
     };
 }
 
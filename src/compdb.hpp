@@ -0,0 +1,122 @@
+#ifndef PPSTEP_COMPDB_HPP
+#define PPSTEP_COMPDB_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/filesystem/path.hpp>
+
+namespace ppstep {
+    // Preprocessor-relevant settings of one translation unit
+    struct compile_command {
+        std::string directory;
+        std::string file;
+        std::vector<std::string> includes;
+        std::vector<std::string> defines;
+        std::vector<std::string> undefines;
+    };
+
+    namespace detail {
+        inline std::string resolve_path(std::string const& directory, std::string const& path) {
+            auto p = boost::filesystem::path(path);
+            if (p.is_absolute() || directory.empty()) return path;
+            return (boost::filesystem::path(directory) / p).string();
+        }
+
+        // Picks -I/-isystem/-D/-U out of a compiler argument vector, in both the
+        // joined (-Ifoo) and separate (-I foo) spellings
+        inline void parse_compile_flags(std::vector<std::string> const& arguments, compile_command& command) {
+            auto take = [&](std::size_t& i, std::string const& flag, std::string& value) {
+                auto const& arg = arguments[i];
+                if (arg.compare(0, flag.size(), flag) != 0) return false;
+                if (arg.size() > flag.size()) {
+                    value = arg.substr(flag.size());
+                    return true;
+                }
+                if (i + 1 < arguments.size()) {
+                    value = arguments[++i];
+                    return true;
+                }
+                return false;
+            };
+
+            for (std::size_t i = 0; i < arguments.size(); ++i) {
+                std::string value;
+                if (take(i, "-isystem", value) || take(i, "-I", value)) {
+                    command.includes.push_back(resolve_path(command.directory, value));
+                } else if (take(i, "-D", value)) {
+                    command.defines.push_back(value);
+                } else if (take(i, "-U", value)) {
+                    command.undefines.push_back(value);
+                }
+            }
+        }
+    }
+
+    // Reads a clang-style compile_commands.json, accepting both "command" and "arguments" entries
+    inline std::vector<compile_command> load_compile_database(std::string const& filename) {
+        namespace pt = boost::property_tree;
+
+        pt::ptree root;
+        try {
+            pt::read_json(filename, root);
+        } catch (pt::json_parser_error const& e) {
+            throw std::runtime_error("could not read compile database " + filename + ": " + e.message());
+        }
+
+        auto commands = std::vector<compile_command>();
+        for (auto const& [key, entry] : root) {
+            compile_command command;
+            command.directory = entry.get<std::string>("directory", "");
+
+            auto file = entry.get_optional<std::string>("file");
+            if (!file) {
+                throw std::runtime_error("compile database entry without \"file\" in " + filename);
+            }
+            command.file = detail::resolve_path(command.directory, *file);
+
+            std::vector<std::string> arguments;
+            if (auto args = entry.get_child_optional("arguments")) {
+                for (auto const& [index, arg] : *args) {
+                    arguments.push_back(arg.get_value<std::string>());
+                }
+            } else if (auto line = entry.get_optional<std::string>("command")) {
+                arguments = boost::program_options::split_unix(*line);
+            }
+
+            detail::parse_compile_flags(arguments, command);
+            commands.push_back(std::move(command));
+        }
+
+        return commands;
+    }
+
+    // Adds `flags` to `command` as if they came after its own. Macros are defined before
+    // any are undefined, so a later -D drops the command's -U of the same macro, and an
+    // earlier definition of it, for the later one to win.
+    inline void append_flags(compile_command& command, compile_command const& flags) {
+        // The macro a -D or -U names, without its parameters or value
+        auto name_of = [](std::string const& flag) {
+            return std::string_view(flag).substr(0, flag.find_first_of("(="));
+        };
+        auto erase_named = [&name_of](std::vector<std::string>& list, std::string_view name) {
+            list.erase(std::remove_if(list.begin(), list.end(), [&](std::string const& flag) { return name_of(flag) == name; }), list.end());
+        };
+
+        command.includes.insert(command.includes.end(), flags.includes.begin(), flags.includes.end());
+        for (auto const& definition : flags.defines) {
+            erase_named(command.undefines, name_of(definition));
+            erase_named(command.defines, name_of(definition));
+        }
+        command.defines.insert(command.defines.end(), flags.defines.begin(), flags.defines.end());
+        command.undefines.insert(command.undefines.end(), flags.undefines.begin(), flags.undefines.end());
+    }
+}
+
+#endif // PPSTEP_COMPDB_HPP
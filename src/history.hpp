@@ -0,0 +1,370 @@
+#ifndef PPSTEP_HISTORY_HPP
+#define PPSTEP_HISTORY_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "symbol_table.hpp"
+#include "token_handle.hpp"
+
+namespace ppstep {
+    // How much history stays in memory before older steps are spilled to disk
+    constexpr std::size_t DEFAULT_HISTORY_MEMORY = std::size_t(16) << 20;
+
+    // Where the main input stood when an event happened, and how deeply nested it was
+    struct history_position {
+        symbol_id file;
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t depth;
+    };
+
+    namespace history_detail {
+        // Heap bytes behind a sequence, counting the allocator's own header
+        inline std::size_t heap_size(handle_sequence const& handles) {
+            return handles.capacity() ? handles.capacity() * sizeof(token_ref) + 16 : 0;
+        }
+
+        template <class T>
+        void put(std::string& out, T value) {
+            out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+        }
+
+        inline void put_handles(std::string& out, handle_sequence const& handles) {
+            put(out, static_cast<std::uint32_t>(handles.size()));
+            out.append(reinterpret_cast<char const*>(handles.data()), handles.size() * sizeof(token_ref));
+        }
+
+        template <class T>
+        T get(char const*& next, char const* last) {
+            T value;
+            if (static_cast<std::size_t>(last - next) < sizeof(value)) {
+                throw std::runtime_error("history segment is truncated or corrupt");
+            }
+            std::memcpy(&value, next, sizeof(value));
+            next += sizeof(value);
+            return value;
+        }
+
+        inline handle_sequence get_handles(char const*& next, char const* last) {
+            auto size = get<std::uint32_t>(next, last);
+            if (static_cast<std::size_t>(last - next) / sizeof(token_ref) < size) {
+                throw std::runtime_error("history segment is truncated or corrupt");
+            }
+            auto handles = handle_sequence(size);
+            std::memcpy(handles.data(), next, size * sizeof(token_ref));
+            next += size * sizeof(token_ref);
+            return handles;
+        }
+    }
+
+    // Event history stored as periodic snapshots plus per-event deltas. Consecutive
+    // events mostly differ by one splice, so each entry keeps only the tokens that
+    // changed against the previous entry's sequence; every so often an entry keeps its
+    // whole sequence instead. Sequences arrive as piece tables that share pieces with
+    // the previous one, so finding the change skips shared pieces without reading
+    // them. Rebuilding any entry starts at the nearest snapshot at or before it (a
+    // binary search) and replays the deltas in between, whose total size is capped by
+    // the snapshot policy.
+    //
+    // Once the entries held in memory outgrow the memory budget, the oldest ones are
+    // appended to an unlinked temporary file as a segment that starts with a snapshot,
+    // so it can be decoded on its own. Segments are mapped back in when an entry inside
+    // one is looked at. CodecT turns EventT into bytes and back, and estimates how much
+    // memory an event holds.
+    //
+    // The budget covers the entries only. The token pool and symbol table their
+    // references point into stay in memory; they grow with the distinct tokens of the
+    // input, positions included, rather than with the number of events.
+    template <class EventT, class CodecT>
+    struct event_history {
+        // A snapshot is taken once the deltas since the last one add up to a full
+        // sequence, or after this many events (or a sixteenth of the sequence length, if
+        // that is more), whichever comes first. Snapshots of long sequences are spread
+        // out so that they cost about as much as the deltas between them.
+        static constexpr std::size_t max_snapshot_distance = 64;
+
+        event_history()
+            : entries(), snapshots(), base(0), oldest(0), newest(), delta_size(0),
+              memory(0), memory_budget(DEFAULT_HISTORY_MEMORY), segments(), spill_fd(-1), spill_size(0), loaded() {}
+
+        event_history(event_history const&) = delete;
+
+        ~event_history() {
+            if (spill_fd >= 0) ::close(spill_fd);
+        }
+
+        void set_memory_budget(std::size_t bytes) {
+            memory_budget = bytes;
+        }
+
+        void push(handle_pieces const& tokens, EventT&& event, history_position where) {
+            auto index = base + entries.size();
+            bool snapshot = entries.empty()
+                || index - snapshots.back() >= std::max(max_snapshot_distance, tokens.size() / 16)
+                || delta_size >= tokens.size();
+
+            if (snapshot) {
+                entries.push_back({std::move(event), where, 0, 0, tokens.flatten()});
+                snapshots.push_back(index);
+                delta_size = 0;
+            } else {
+                auto front = newest.common_prefix(tokens);
+                auto back = newest.common_suffix(tokens, std::min(newest.size(), tokens.size()) - front);
+
+                auto changed = tokens.copy(front, tokens.size() - back);
+                delta_size += changed.size() + 1;
+                entries.push_back({std::move(event), where, static_cast<std::uint32_t>(front), static_cast<std::uint32_t>(back), std::move(changed)});
+            }
+            newest = tokens;
+
+            memory += footprint(entries.back());
+            if (memory > memory_budget) spill();
+        }
+
+        std::size_t size() const {
+            return base + entries.size() - oldest;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        // Entries are numbered from the oldest available one. References into spilled
+        // entries stay valid until the next lookup.
+        EventT const& event(std::size_t index) const {
+            return find(oldest + index).event;
+        }
+
+        history_position where(std::size_t index) const {
+            return find(oldest + index).where;
+        }
+
+        handle_pieces const& newest_tokens() const {
+            return newest;
+        }
+
+        handle_sequence tokens(std::size_t index) const {
+            auto absolute = oldest + index;
+            if (absolute + 1 == base + entries.size()) return newest.flatten();
+
+            if (absolute >= base) {
+                auto snapshot = *(std::upper_bound(snapshots.begin(), snapshots.end(), absolute) - 1);
+                return replay(entries, snapshot - base, absolute - base);
+            }
+
+            auto const& segment = load(absolute);
+            auto local = absolute - segment.first;
+            auto snapshot = *(std::upper_bound(segment.snapshots.begin(), segment.snapshots.end(), local) - 1);
+            return replay(segment.entries, snapshot, local);
+        }
+
+    private:
+        struct entry {
+            EventT event;
+            history_position where;
+            std::uint32_t keep_front;  // tokens shared with the previous entry, from each end
+            std::uint32_t keep_back;
+            handle_sequence tokens;    // the whole sequence for snapshots, the changed middle otherwise
+        };
+
+        // A run of spilled entries, stored at [offset, offset + bytes) in the spill file
+        struct segment {
+            std::size_t first;
+            std::size_t count;
+            std::uint64_t offset;
+            std::uint64_t bytes;
+        };
+
+        // The most recently mapped segment, decoded
+        struct loaded_segment {
+            std::size_t first = 0;
+            std::size_t count = 0;
+            std::vector<entry> entries;
+            std::vector<std::size_t> snapshots;  // indices into entries, ascending
+        };
+
+        // Deltas are spliced into a piece table, so each costs its own size rather than
+        // the sequence's
+        template <class EntriesT>
+        static handle_sequence replay(EntriesT const& entries, std::size_t snapshot, std::size_t index) {
+            auto sequence = handle_pieces(handle_sequence(entries[snapshot].tokens));
+            for (auto i = snapshot + 1; i <= index; ++i) {
+                auto const& entry = entries[i];
+                sequence = sequence.splice(entry.keep_front, sequence.size() - entry.keep_back, handle_sequence(entry.tokens));
+            }
+            return sequence.flatten();
+        }
+
+        static std::size_t footprint(entry const& e) {
+            return sizeof(entry) + history_detail::heap_size(e.tokens) + CodecT::footprint(e.event);
+        }
+
+        entry const& find(std::size_t absolute) const {
+            if (absolute >= base) return entries[absolute - base];
+            auto const& segment = load(absolute);
+            return segment.entries[absolute - segment.first];
+        }
+
+        bool is_snapshot(std::size_t absolute) const {
+            return std::binary_search(snapshots.begin(), snapshots.end(), absolute);
+        }
+
+        // Moves the oldest eighth of the budget out of memory. Small segments keep both
+        // the write buffer and the decoded segment cheap. The newest entry always stays.
+        void spill() {
+            auto target = memory_budget / 8 * 7;
+            std::size_t count = 0, freed = 0;
+            while (count + 1 < entries.size() && memory - freed > target) {
+                freed += footprint(entries[count]);
+                ++count;
+            }
+            if (count == 0) return;
+
+            // The first entry left in memory has to stand on its own
+            auto first = base + count;
+            if (!is_snapshot(first)) {
+                auto& entry = entries[count];
+                freed += footprint(entry);
+                entry.tokens = tokens(first - oldest);
+                entry.keep_front = entry.keep_back = 0;
+                memory += footprint(entry);
+                snapshots.insert(std::upper_bound(snapshots.begin(), snapshots.end(), first), first);
+            }
+
+            if (!write_segment(count, freed)) {
+                // Without a spill file history is bounded the old way, by dropping it
+                segments.clear();
+                loaded = loaded_segment();
+                oldest = first;
+            }
+
+            entries.erase(entries.begin(), entries.begin() + count);
+            snapshots.erase(snapshots.begin(), std::lower_bound(snapshots.begin(), snapshots.end(), first));
+            memory -= freed;
+            base = first;
+        }
+
+        // Segment layout, in native byte order, per entry:
+        //   u8 snapshot, u32 file, u32 line, u32 column, u32 depth, u32 keep_front,
+        //   u32 keep_back, handles, event
+        // where handles are a u32 count followed by that many token references.
+        bool write_segment(std::size_t count, std::size_t estimate) {
+            using namespace history_detail;
+
+            if (spill_fd < 0 && !open_spill_file()) return false;
+
+            auto bytes = std::string();
+            bytes.reserve(estimate);
+            for (std::size_t i = 0; i < count; ++i) {
+                auto const& e = entries[i];
+                put(bytes, static_cast<std::uint8_t>(is_snapshot(base + i)));
+                put(bytes, e.where.file);
+                put(bytes, e.where.line);
+                put(bytes, e.where.column);
+                put(bytes, e.where.depth);
+                put(bytes, e.keep_front);
+                put(bytes, e.keep_back);
+                put_handles(bytes, e.tokens);
+                CodecT::write(bytes, e.event);
+            }
+
+            for (std::size_t written = 0; written < bytes.size();) {
+                auto n = ::pwrite(spill_fd, bytes.data() + written, bytes.size() - written, static_cast<off_t>(spill_size + written));
+                if (n <= 0) return false;
+                written += static_cast<std::size_t>(n);
+            }
+
+            segments.push_back({base, count, spill_size, bytes.size()});
+            spill_size += bytes.size();
+            return true;
+        }
+
+        bool open_spill_file() {
+            std::error_code error;
+            auto directory = std::filesystem::temp_directory_path(error);
+            if (error) return false;
+
+            auto path = (directory / "ppstep-history-XXXXXX").string();
+            spill_fd = ::mkstemp(path.data());
+            if (spill_fd < 0) return false;
+            // Nobody else needs the file, so it disappears with the process
+            ::unlink(path.c_str());
+            return true;
+        }
+
+        loaded_segment const& load(std::size_t absolute) const {
+            using namespace history_detail;
+
+            if (absolute >= loaded.first && absolute < loaded.first + loaded.count) return loaded;
+
+            auto it = std::upper_bound(segments.begin(), segments.end(), absolute,
+                                       [](std::size_t index, segment const& s) { return index < s.first; }) - 1;
+
+            static auto const page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+            auto aligned = it->offset / page * page;
+            auto length = static_cast<std::size_t>(it->offset + it->bytes - aligned);
+            auto* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, spill_fd, static_cast<off_t>(aligned));
+            if (mapping == MAP_FAILED) {
+                throw std::runtime_error("could not map history segment");
+            }
+
+            auto result = loaded_segment();
+            result.first = it->first;
+            result.count = it->count;
+            result.entries.reserve(it->count);
+            try {
+                auto const* next = static_cast<char const*>(mapping) + (it->offset - aligned);
+                auto const* last = next + it->bytes;
+                for (std::size_t i = 0; i < it->count; ++i) {
+                    if (get<std::uint8_t>(next, last)) result.snapshots.push_back(i);
+                    auto where = history_position();
+                    where.file = get<symbol_id>(next, last);
+                    where.line = get<std::uint32_t>(next, last);
+                    where.column = get<std::uint32_t>(next, last);
+                    where.depth = get<std::uint32_t>(next, last);
+                    auto keep_front = get<std::uint32_t>(next, last);
+                    auto keep_back = get<std::uint32_t>(next, last);
+                    auto tokens = get_handles(next, last);
+                    auto event = CodecT::read(next, last);
+                    result.entries.push_back({std::move(event), where, keep_front, keep_back, std::move(tokens)});
+                }
+            } catch (...) {
+                ::munmap(mapping, length);
+                throw;
+            }
+            ::munmap(mapping, length);
+
+            loaded = std::move(result);
+            return loaded;
+        }
+
+        std::deque<entry> entries;
+        std::deque<std::size_t> snapshots;  // absolute indices, ascending
+        std::size_t base;                   // absolute index of entries.front()
+        std::size_t oldest;                 // absolute index of the oldest entry still available
+        handle_pieces newest;
+        std::size_t delta_size;
+
+        std::size_t memory;                 // estimated bytes held by entries
+        std::size_t memory_budget;
+        std::vector<segment> segments;      // spilled entries [oldest, base), in order
+        int spill_fd;
+        std::uint64_t spill_size;
+        mutable loaded_segment loaded;
+    };
+}
+
+#endif // PPSTEP_HISTORY_HPP
@@ -0,0 +1,256 @@
+#ifndef PPSTEP_MACRO_STATE_HPP
+#define PPSTEP_MACRO_STATE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "mapped_file.hpp"
+
+namespace ppstep {
+    // Snapshot of a context's macro table, in the spirit of a precompiled header: run
+    // ppstep once over a file that includes the common headers, save the table, and
+    // start later sessions from it instead of preprocessing those headers again.
+    //
+    // Layout, in native byte order:
+    //
+    //   magic, u32 version
+    //   u32 string count, then (u32 size, bytes) each   spellings and file names
+    //   u32 macro count, then per macro:
+    //     u32 name, u8 flags, position
+    //     u32 parameter count, tokens
+    //     u32 definition count, tokens
+    //
+    // A position is (u32 file, u32 line, u32 column); a token is (u32 id, u32 value,
+    // position). Strings are referred to by index.
+    namespace macro_state_detail {
+        constexpr char magic[8] = {'P', 'P', 'S', 'T', 'M', 'A', 'C', '\0'};
+        constexpr std::uint32_t version = 1;
+
+        constexpr std::uint8_t has_params_flag = 1;
+        constexpr std::uint8_t predefined_flag = 2;
+
+        // Smallest encodings, which bound the counts a file of a given size can hold
+        constexpr std::size_t string_size = sizeof(std::uint32_t);
+        constexpr std::size_t position_size = 3 * sizeof(std::uint32_t);
+        constexpr std::size_t token_size = 2 * sizeof(std::uint32_t) + position_size;
+        constexpr std::size_t macro_size = sizeof(std::uint32_t) + sizeof(std::uint8_t) + position_size + 2 * sizeof(std::uint32_t);
+
+        struct writer {
+            writer() : bytes(), indices(), strings() {}
+
+            template <class T>
+            void put(T value) {
+                bytes.append(reinterpret_cast<char const*>(&value), sizeof(value));
+            }
+
+            void put_string(std::string_view value) {
+                auto [it, inserted] = indices.try_emplace(std::string(value), static_cast<std::uint32_t>(strings.size()));
+                if (inserted) strings.push_back(&it->first);
+                put(it->second);
+            }
+
+            template <class PositionT>
+            void put_position(PositionT const& pos) {
+                put_string(std::string_view(pos.get_file().c_str(), pos.get_file().size()));
+                put(static_cast<std::uint32_t>(pos.get_line()));
+                put(static_cast<std::uint32_t>(pos.get_column()));
+            }
+
+            template <class TokenT>
+            void put_token(TokenT const& token) {
+                put(static_cast<std::uint32_t>(boost::wave::token_id(token)));
+                put_string(std::string_view(token.get_value().c_str(), token.get_value().size()));
+                put_position(token.get_position());
+            }
+
+            // The string table goes first, so it is only complete once all macros are written
+            void write(std::ostream& os) const {
+                os.write(magic, sizeof(magic));
+                auto table = std::string();
+                auto append = [&table](auto value) { table.append(reinterpret_cast<char const*>(&value), sizeof(value)); };
+                append(version);
+                append(static_cast<std::uint32_t>(strings.size()));
+                for (auto const* value : strings) {
+                    append(static_cast<std::uint32_t>(value->size()));
+                    table.append(*value);
+                }
+                os.write(table.data(), static_cast<std::streamsize>(table.size()));
+                os.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            }
+
+            std::string bytes;
+            std::unordered_map<std::string, std::uint32_t> indices;
+            std::vector<std::string const*> strings;  // in index order; node keys never move
+        };
+
+        struct reader {
+            reader(char const* first, char const* last, std::string const& filename) : next(first), last(last), filename(filename), strings() {}
+
+            template <class T>
+            T get() {
+                T value;
+                if (static_cast<std::size_t>(last - next) < sizeof(value)) corrupt();
+                std::memcpy(&value, next, sizeof(value));
+                next += sizeof(value);
+                return value;
+            }
+
+            // A count of items at least `item_size` bytes each, which must fit in what is left
+            std::uint32_t get_count(std::size_t item_size) {
+                auto count = get<std::uint32_t>();
+                if (count > static_cast<std::size_t>(last - next) / item_size) corrupt();
+                return count;
+            }
+
+            std::string_view get_raw_string() {
+                auto size = get<std::uint32_t>();
+                if (static_cast<std::size_t>(last - next) < size) corrupt();
+                auto value = std::string_view(next, size);
+                next += size;
+                return value;
+            }
+
+            std::string_view get_string() {
+                auto index = get<std::uint32_t>();
+                if (index >= strings.size()) corrupt();
+                return strings[index];
+            }
+
+            template <class PositionT>
+            PositionT get_position() {
+                using string_type = typename PositionT::string_type;
+                auto file = get_string();
+                auto line = get<std::uint32_t>();
+                auto column = get<std::uint32_t>();
+                return PositionT(string_type(file.data(), file.size()), line, column);
+            }
+
+            template <class TokenT>
+            TokenT get_token() {
+                using string_type = typename TokenT::string_type;
+                auto id = get<std::uint32_t>();
+                auto value = get_string();
+                auto pos = get_position<typename TokenT::position_type>();
+                return TokenT(static_cast<boost::wave::token_id>(id), string_type(value.data(), value.size()), pos);
+            }
+
+            [[noreturn]] void corrupt() const {
+                throw std::runtime_error("macro state " + filename + " is truncated or corrupt");
+            }
+
+            char const* next;
+            char const* last;
+            std::string const& filename;
+            std::vector<std::string_view> strings;
+        };
+    }
+
+    // Writes every macro currently defined in the context, predefined ones included
+    template <class ContextT>
+    void save_macro_state(ContextT const& ctx, std::string const& filename) {
+        using namespace macro_state_detail;
+
+        auto out = writer();
+        std::uint32_t count = 0;
+        auto counted = out.bytes.size();
+        out.put(count);
+
+        for (auto it = ctx.macro_names_begin(); it != ctx.macro_names_end(); ++it) {
+            bool has_params, is_predefined;
+            typename ContextT::position_type pos;
+            std::vector<typename ContextT::token_type> parameters;
+            typename ContextT::token_sequence_type definition;
+            if (!ctx.get_macro_definition(*it, has_params, is_predefined, pos, parameters, definition)) continue;
+
+            out.put_string(std::string_view(it->c_str(), it->size()));
+            out.put(static_cast<std::uint8_t>((has_params ? has_params_flag : 0) | (is_predefined ? predefined_flag : 0)));
+            out.put_position(pos);
+            out.put(static_cast<std::uint32_t>(parameters.size()));
+            for (auto const& token : parameters) {
+                out.put_token(token);
+            }
+            out.put(static_cast<std::uint32_t>(definition.size()));
+            for (auto const& token : definition) {
+                out.put_token(token);
+            }
+            ++count;
+        }
+        std::memcpy(out.bytes.data() + counted, &count, sizeof(count));
+
+        std::ofstream file(filename, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("could not open " + filename + " for writing");
+        }
+        out.write(file);
+        if (!file) {
+            throw std::runtime_error("could not write macro state to " + filename);
+        }
+    }
+
+    // Defines every saved macro that is not defined yet, so predefined macros and -D on
+    // the new command line take precedence over the snapshot; apply -U after loading it.
+    // Returns how many macros were restored.
+    template <class ContextT>
+    std::size_t load_macro_state(ContextT& ctx, std::string const& filename) {
+        using namespace macro_state_detail;
+        using token_type = typename ContextT::token_type;
+        using position_type = typename ContextT::position_type;
+        using string_type = typename token_type::string_type;
+
+        auto file = mapped_file();
+        if (!file.open(filename.c_str())) {
+            throw std::runtime_error("could not open macro state " + filename);
+        }
+
+        auto in = reader(file.begin(), file.end(), filename);
+        if (file.size() < sizeof(magic) || std::memcmp(file.begin(), magic, sizeof(magic)) != 0) {
+            throw std::runtime_error(filename + " is not a ppstep macro state");
+        }
+        in.next += sizeof(magic);
+        if (in.get<std::uint32_t>() != version) {
+            throw std::runtime_error("macro state " + filename + " was written by a different ppstep version");
+        }
+
+        auto string_count = in.get_count(string_size);
+        in.strings.reserve(string_count);
+        for (std::uint32_t i = 0; i < string_count; ++i) {
+            in.strings.push_back(in.get_raw_string());
+        }
+
+        std::size_t restored = 0;
+        auto macro_count = in.get_count(macro_size);
+        for (std::uint32_t i = 0; i < macro_count; ++i) {
+            auto name = in.get_string();
+            auto flags = in.get<std::uint8_t>();
+            auto pos = in.get_position<position_type>();
+
+            auto parameters = std::vector<token_type>(in.get_count(token_size));
+            for (auto& token : parameters) {
+                token = in.get_token<token_type>();
+            }
+            auto definition = typename ContextT::token_sequence_type();
+            for (auto size = in.get_count(token_size); size > 0; --size) {
+                definition.push_back(in.get_token<token_type>());
+            }
+
+            auto spelling = string_type(name.data(), name.size());
+            if (ctx.is_defined_macro(spelling)) continue;
+
+            auto macro = token_type(boost::wave::T_IDENTIFIER, spelling, pos);
+            if (ctx.add_macro_definition(macro, (flags & has_params_flag) != 0, parameters, definition, (flags & predefined_flag) != 0)) {
+                ++restored;
+            }
+        }
+        return restored;
+    }
+}
+
+#endif // PPSTEP_MACRO_STATE_HPP
@@ -0,0 +1,109 @@
+#ifndef PPSTEP_MAPPED_FILE_HPP
+#define PPSTEP_MAPPED_FILE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ppstep {
+    // Read-only view of a whole source file. Regular files are mapped and lexed in place;
+    // anything mmap cannot handle (stdin, pipes, process substitution, empty files) is
+    // read into a buffer instead, so callers never have to tell the two apart.
+    struct mapped_file {
+        mapped_file() : mapping(nullptr), length(0), buffer() {}
+
+        mapped_file(mapped_file const&) = delete;
+        mapped_file& operator=(mapped_file const&) = delete;
+
+        mapped_file(mapped_file&& other) noexcept : mapping(std::exchange(other.mapping, nullptr)), length(std::exchange(other.length, 0)), buffer(std::move(other.buffer)) {}
+
+        mapped_file& operator=(mapped_file&& other) noexcept {
+            if (this != &other) {
+                close();
+                mapping = std::exchange(other.mapping, nullptr);
+                length = std::exchange(other.length, 0);
+                buffer = std::move(other.buffer);
+            }
+            return *this;
+        }
+
+        ~mapped_file() {
+            close();
+        }
+
+        bool open(char const* path) {
+            close();
+
+            auto fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+
+            struct stat info;
+            if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                auto size = static_cast<std::size_t>(info.st_size);
+                auto data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    // The lexer reads front to back exactly once
+                    ::madvise(data, size, MADV_SEQUENTIAL);
+                    ::close(fd);
+                    mapping = data;
+                    length = size;
+                    return true;
+                }
+            }
+            ::close(fd);
+
+            std::ifstream instream(path, std::ios::binary);
+            if (!instream.is_open()) return false;
+            buffer.assign(std::istreambuf_iterator<char>(instream.rdbuf()), std::istreambuf_iterator<char>());
+            return true;
+        }
+
+        void close() {
+            if (mapping) ::munmap(mapping, length);
+            mapping = nullptr;
+            length = 0;
+            buffer.clear();
+        }
+
+        bool is_mapped() const {
+            return mapping != nullptr;
+        }
+
+        char const* begin() const {
+            return mapping ? static_cast<char const*>(mapping) : buffer.data();
+        }
+
+        char const* end() const {
+            return begin() + size();
+        }
+
+        std::size_t size() const {
+            return mapping ? length : buffer.size();
+        }
+
+        // Lets the kernel drop the mapped pages before `offset`, which keeps a front to
+        // back scan of a huge file from holding all of it; they are read back in if
+        // touched again
+        void release(std::size_t offset) {
+            if (!mapping) return;
+            auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            auto bytes = std::min(offset, length) / page * page;
+            if (bytes > 0) ::madvise(mapping, bytes, MADV_DONTNEED);
+        }
+
+    private:
+        void* mapping;
+        std::size_t length;
+        std::string buffer;
+    };
+}
+
+#endif // PPSTEP_MAPPED_FILE_HPP
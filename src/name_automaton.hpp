@@ -0,0 +1,353 @@
+#ifndef PPSTEP_NAME_AUTOMATON_HPP
+#define PPSTEP_NAME_AUTOMATON_HPP
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ppstep {
+    // Any number of glob and regex patterns over macro names, matched together in one
+    // pass over the name. Patterns are compiled into a single NFA (Thompson's
+    // construction); its DFA is built lazily, one state per set of NFA states the
+    // names seen so far actually reach, so a name only costs a table lookup per
+    // character once the states it visits exist.
+    //
+    // Globs use `*`, `?` and `[...]` (`[!...]` negates) and must match the whole name.
+    // Regexes support literals, `.`, `[...]` (`[^...]` negates), `( )`, `|`, `*`, `+`,
+    // `?` and `\` escapes; they match anywhere in the name unless anchored with a
+    // leading `^` or a trailing `$`.
+    struct name_automaton {
+        // Patterns are numbered in the order they were added. Throws std::runtime_error
+        // if the pattern does not parse; the automaton is left unchanged then.
+        std::size_t add_glob(std::string_view glob) {
+            auto saved = nodes.size();
+            try {
+                auto in = reader{glob, 0};
+                auto whole = nothing();
+                while (!in.done()) {
+                    char c = in.next();
+                    fragment part;
+                    if (c == '*') {
+                        part = star(any());
+                    } else if (c == '?') {
+                        part = any();
+                    } else if (c == '[') {
+                        part = chars(in.char_class('!'));
+                    } else {
+                        part = literal(c);
+                    }
+                    whole = concat(whole, part);
+                }
+                return finish(whole);
+            } catch (...) {
+                nodes.resize(saved);
+                throw;
+            }
+        }
+
+        std::size_t add_regex(std::string_view regex) {
+            auto saved = nodes.size();
+            try {
+                bool anchored_front = !regex.empty() && regex.front() == '^';
+                if (anchored_front) regex.remove_prefix(1);
+                bool anchored_back = !regex.empty() && regex.back() == '$' && (regex.size() < 2 || regex[regex.size() - 2] != '\\');
+                if (anchored_back) regex.remove_suffix(1);
+
+                auto in = reader{regex, 0};
+                auto whole = alternation(in);
+                if (!in.done()) in.fail("unexpected `" + std::string(1, in.peek()) + "`");
+
+                if (!anchored_front) whole = concat(star(any()), whole);
+                if (!anchored_back) whole = concat(whole, star(any()));
+                return finish(whole);
+            } catch (...) {
+                nodes.resize(saved);
+                throw;
+            }
+        }
+
+        void clear() {
+            nodes.clear();
+            starts.clear();
+            reset_dfa();
+        }
+
+        bool empty() const {
+            return starts.empty();
+        }
+
+        // Numbers of the patterns that match the whole name, ascending
+        std::vector<std::uint32_t> match(std::string_view name) const {
+            if (starts.empty()) return {};
+            if (states.empty()) start_state = intern(closure(starts));
+
+            auto state = start_state;
+            for (char ch : name) {
+                auto c = static_cast<unsigned char>(ch);
+                auto next = states[state].next[c];
+                if (next == unknown) {
+                    if (states.size() >= max_states) {
+                        // Start over rather than grow without bound on unusual names, from
+                        // the NFA nodes this name has reached so far
+                        auto members = states[state].members;
+                        reset_dfa();
+                        start_state = intern(closure(starts));
+                        state = intern(members);
+                    }
+                    auto target = step(states[state].members, c);
+                    next = target.empty() ? dead : intern(target);
+                    states[state].next[c] = next;
+                }
+                if (next == dead) return {};
+                state = next;
+            }
+            return states[state].accepts;
+        }
+
+    private:
+        static constexpr std::int32_t unknown = -2;
+        static constexpr std::int32_t dead = -1;
+        static constexpr std::size_t max_states = 4096;
+
+        // One NFA node: either consumes one of `chars` and moves to `on_char`, or moves
+        // without consuming to up to two `epsilon` nodes
+        struct node {
+            std::bitset<256> chars;
+            std::int32_t on_char = -1;
+            std::array<std::int32_t, 2> epsilon = {-1, -1};
+            std::int32_t accept = -1;
+        };
+
+        // A piece of NFA with one way in and one way out; `end` has no edges yet
+        struct fragment {
+            std::int32_t start;
+            std::int32_t end;
+        };
+
+        struct dfa_state {
+            std::vector<std::int32_t> members;  // NFA nodes, sorted
+            std::vector<std::uint32_t> accepts;
+            std::array<std::int32_t, 256> next;
+        };
+
+        struct reader {
+            std::string_view source;
+            std::size_t at;
+
+            bool done() const {
+                return at == source.size();
+            }
+
+            char peek() const {
+                return source[at];
+            }
+
+            char next() {
+                if (done()) fail("unexpected end of pattern");
+                return source[at++];
+            }
+
+            // Reads the rest of a `[...]` class, the `[` already taken
+            std::bitset<256> char_class(char negation) {
+                auto set = std::bitset<256>();
+                bool negated = !done() && peek() == negation;
+                if (negated) ++at;
+                bool first = true;
+                while (true) {
+                    char c = next();
+                    if (c == ']' && !first) break;
+                    first = false;
+                    if (c == '\\') c = next();
+                    if (!done() && peek() == '-' && at + 1 < source.size() && source[at + 1] != ']') {
+                        ++at;
+                        char last = next();
+                        if (last == '\\') last = next();
+                        if (static_cast<unsigned char>(last) < static_cast<unsigned char>(c)) fail("backwards range in `[...]`");
+                        for (auto i = static_cast<unsigned char>(c); i <= static_cast<unsigned char>(last); ++i) {
+                            set.set(i);
+                            if (i == 255) break;
+                        }
+                    } else {
+                        set.set(static_cast<unsigned char>(c));
+                    }
+                }
+                return negated ? ~set : set;
+            }
+
+            [[noreturn]] void fail(std::string const& what) const {
+                throw std::runtime_error(what + " at position " + std::to_string(at + 1) + " of \"" + std::string(source) + "\"");
+            }
+        };
+
+        fragment alternation(reader& in) {
+            auto whole = sequence(in);
+            while (!in.done() && in.peek() == '|') {
+                ++in.at;
+                auto other = sequence(in);
+                auto start = add_node(), end = add_node();
+                nodes[start].epsilon = {whole.start, other.start};
+                nodes[whole.end].epsilon[0] = end;
+                nodes[other.end].epsilon[0] = end;
+                whole = {start, end};
+            }
+            return whole;
+        }
+
+        fragment sequence(reader& in) {
+            auto whole = nothing();
+            while (!in.done() && in.peek() != '|' && in.peek() != ')') {
+                whole = concat(whole, repetition(in));
+            }
+            return whole;
+        }
+
+        fragment repetition(reader& in) {
+            auto part = atom(in);
+            while (!in.done()) {
+                if (in.peek() == '*') part = star(part);
+                else if (in.peek() == '+') part = plus(part);
+                else if (in.peek() == '?') part = maybe(part);
+                else break;
+                ++in.at;
+            }
+            return part;
+        }
+
+        fragment atom(reader& in) {
+            char c = in.next();
+            switch (c) {
+                case '(': {
+                    auto inner = alternation(in);
+                    if (in.done() || in.next() != ')') in.fail("expected `)`");
+                    return inner;
+                }
+                case '.': return any();
+                case '[': return chars(in.char_class('^'));
+                case '\\': return literal(in.next());
+                case '*': case '+': case '?': in.fail("nothing to repeat");
+                case '^': case '$': in.fail("anchors are only supported at the ends of a pattern");
+                default: return literal(c);
+            }
+        }
+
+        std::int32_t add_node() {
+            nodes.emplace_back();
+            return static_cast<std::int32_t>(nodes.size() - 1);
+        }
+
+        fragment chars(std::bitset<256> set) {
+            auto start = add_node(), end = add_node();
+            nodes[start].chars = set;
+            nodes[start].on_char = end;
+            return {start, end};
+        }
+
+        fragment literal(char c) {
+            auto set = std::bitset<256>();
+            set.set(static_cast<unsigned char>(c));
+            return chars(set);
+        }
+
+        fragment any() {
+            return chars(std::bitset<256>().set());
+        }
+
+        fragment nothing() {
+            auto node = add_node();
+            return {node, node};
+        }
+
+        fragment concat(fragment a, fragment b) {
+            nodes[a.end].epsilon[0] = b.start;
+            return {a.start, b.end};
+        }
+
+        fragment star(fragment a) {
+            auto start = add_node(), end = add_node();
+            nodes[start].epsilon = {a.start, end};
+            nodes[a.end].epsilon = {a.start, end};
+            return {start, end};
+        }
+
+        fragment plus(fragment a) {
+            auto end = add_node();
+            nodes[a.end].epsilon = {a.start, end};
+            return {a.start, end};
+        }
+
+        fragment maybe(fragment a) {
+            auto start = add_node(), end = add_node();
+            nodes[start].epsilon = {a.start, end};
+            nodes[a.end].epsilon[0] = end;
+            return {start, end};
+        }
+
+        std::size_t finish(fragment whole) {
+            nodes[whole.end].accept = static_cast<std::int32_t>(starts.size());
+            starts.push_back(whole.start);
+            reset_dfa();
+            return starts.size() - 1;
+        }
+
+        std::vector<std::int32_t> closure(std::vector<std::int32_t> const& seeds) const {
+            auto seen = std::vector<bool>(nodes.size());
+            auto pending = seeds;
+            auto members = std::vector<std::int32_t>();
+            while (!pending.empty()) {
+                auto id = pending.back();
+                pending.pop_back();
+                if (id < 0 || seen[id]) continue;
+                seen[id] = true;
+                members.push_back(id);
+                for (auto next : nodes[id].epsilon) pending.push_back(next);
+            }
+            std::sort(members.begin(), members.end());
+            return members;
+        }
+
+        std::vector<std::int32_t> step(std::vector<std::int32_t> const& members, unsigned char c) const {
+            auto moved = std::vector<std::int32_t>();
+            for (auto id : members) {
+                if (nodes[id].on_char >= 0 && nodes[id].chars.test(c)) moved.push_back(nodes[id].on_char);
+            }
+            return moved.empty() ? moved : closure(moved);
+        }
+
+        std::int32_t intern(std::vector<std::int32_t> const& members) const {
+            auto [it, inserted] = state_ids.try_emplace(members, static_cast<std::int32_t>(states.size()));
+            if (inserted) {
+                auto state = dfa_state{members, {}, {}};
+                state.next.fill(unknown);
+                for (auto id : members) {
+                    if (nodes[id].accept >= 0) state.accepts.push_back(static_cast<std::uint32_t>(nodes[id].accept));
+                }
+                std::sort(state.accepts.begin(), state.accepts.end());
+                states.push_back(std::move(state));
+            }
+            return it->second;
+        }
+
+        void reset_dfa() const {
+            states.clear();
+            state_ids.clear();
+            start_state = dead;
+        }
+
+        std::vector<node> nodes;
+        std::vector<std::int32_t> starts;  // start node of each pattern
+
+        // The lazily built DFA, thrown away whenever the patterns change
+        mutable std::vector<dfa_state> states;
+        mutable std::map<std::vector<std::int32_t>, std::int32_t> state_ids;
+        mutable std::int32_t start_state = dead;
+    };
+}
+
+#endif // PPSTEP_NAME_AUTOMATON_HPP
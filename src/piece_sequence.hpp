@@ -0,0 +1,273 @@
+#ifndef PPSTEP_PIECE_SEQUENCE_HPP
+#define PPSTEP_PIECE_SEQUENCE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace ppstep {
+    // Persistent piece table: a sequence made of slices of immutable, shared buffers.
+    // Replacing a range copies only the piece list and stores the new items in a buffer
+    // of their own, so the sequence before a splice and the one after it share every
+    // unchanged token. The token stack keeps one of these per level, and a macro library
+    // splices a few tokens at a time into sequences that can run to many thousands.
+    //
+    // Every splice adds up to two pieces. Once there are more than max_pieces, runs of
+    // short neighbouring pieces are merged into one buffer; long pieces stay shared.
+    template <class T>
+    struct piece_sequence {
+        using value_type = T;
+        using buffer_type = std::vector<T>;
+
+        static constexpr std::size_t max_pieces = 32;
+
+        struct piece {
+            std::shared_ptr<buffer_type const> buffer;
+            std::size_t offset;
+            std::size_t length;
+
+            T const* begin() const { return buffer->data() + offset; }
+            T const* end() const { return buffer->data() + offset + length; }
+        };
+
+        struct const_iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = T const*;
+            using reference = T const&;
+
+            const_iterator() : pieces(nullptr), index(0), item(nullptr) {}
+
+            const_iterator(std::vector<piece> const* pieces, std::size_t index, std::size_t offset) : pieces(pieces), index(index), item(nullptr) {
+                if (index < pieces->size()) item = (*pieces)[index].begin() + offset;
+            }
+
+            reference operator*() const { return *item; }
+            pointer operator->() const { return item; }
+
+            const_iterator& operator++() {
+                if (++item == (*pieces)[index].end()) {
+                    ++index;
+                    item = index < pieces->size() ? (*pieces)[index].begin() : nullptr;
+                }
+                return *this;
+            }
+
+            const_iterator operator++(int) {
+                auto copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            friend bool operator==(const_iterator const& a, const_iterator const& b) {
+                return a.index == b.index && a.item == b.item;
+            }
+
+            friend bool operator!=(const_iterator const& a, const_iterator const& b) {
+                return !(a == b);
+            }
+
+        private:
+            std::vector<piece> const* pieces;
+            std::size_t index;
+            T const* item;
+        };
+
+        piece_sequence() : pieces(), count(0) {}
+
+        explicit piece_sequence(buffer_type&& items) : pieces(), count(items.size()) {
+            if (!items.empty()) {
+                auto length = items.size();
+                pieces.push_back({std::make_shared<buffer_type const>(std::move(items)), 0, length});
+            }
+        }
+
+        std::size_t size() const {
+            return count;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        std::size_t piece_count() const {
+            return pieces.size();
+        }
+
+        const_iterator begin() const {
+            return const_iterator(&pieces, 0, 0);
+        }
+
+        const_iterator end() const {
+            return const_iterator(&pieces, pieces.size(), 0);
+        }
+
+        // Iterator to the item at `position`, found by walking the piece list
+        const_iterator at(std::size_t position) const {
+            for (std::size_t i = 0; i < pieces.size(); ++i) {
+                if (position < pieces[i].length) return const_iterator(&pieces, i, position);
+                position -= pieces[i].length;
+            }
+            return end();
+        }
+
+        // A copy with [first, last) replaced by items; both copies share everything else
+        piece_sequence splice(std::size_t first, std::size_t last, buffer_type&& items) const {
+            auto result = piece_sequence();
+            result.pieces.reserve(pieces.size() + 2);
+            result.append(*this, 0, first);
+            if (!items.empty()) {
+                auto length = items.size();
+                result.pieces.push_back({std::make_shared<buffer_type const>(std::move(items)), 0, length});
+                result.count += length;
+            }
+            result.append(*this, last, count);
+            if (result.pieces.size() > max_pieces) result.compact();
+            return result;
+        }
+
+        // The items in [first, last) as one buffer
+        buffer_type copy(std::size_t first, std::size_t last) const {
+            auto items = buffer_type();
+            items.reserve(last - first);
+            for_each_piece(first, last, [&items](T const* begin, T const* end) { items.insert(items.end(), begin, end); });
+            return items;
+        }
+
+        buffer_type flatten() const {
+            return copy(0, count);
+        }
+
+        // How many items two sequences share at the front. Runs both sequences take from
+        // the same place in the same buffer are skipped without comparing them.
+        std::size_t common_prefix(piece_sequence const& other) const {
+            std::size_t shared = 0;
+            std::size_t i = 0, j = 0;
+            T const *a = nullptr, *a_end = nullptr, *b = nullptr, *b_end = nullptr;
+            while (true) {
+                if (a == a_end) {
+                    if (i == pieces.size()) break;
+                    a = pieces[i].begin();
+                    a_end = pieces[i++].end();
+                }
+                if (b == b_end) {
+                    if (j == other.pieces.size()) break;
+                    b = other.pieces[j].begin();
+                    b_end = other.pieces[j++].end();
+                }
+                if (a == b) {
+                    auto run = std::min(a_end - a, b_end - b);
+                    a += run;
+                    b += run;
+                    shared += static_cast<std::size_t>(run);
+                } else if (*a == *b) {
+                    ++a;
+                    ++b;
+                    ++shared;
+                } else {
+                    break;
+                }
+            }
+            return shared;
+        }
+
+        // How many items two sequences share at the back, up to limit
+        std::size_t common_suffix(piece_sequence const& other, std::size_t limit) const {
+            std::size_t shared = 0;
+            std::size_t i = pieces.size(), j = other.pieces.size();
+            T const *a = nullptr, *a_begin = nullptr, *b = nullptr, *b_begin = nullptr;
+            while (shared < limit) {
+                if (a == a_begin) {
+                    if (i == 0) break;
+                    a_begin = pieces[--i].begin();
+                    a = pieces[i].end();
+                }
+                if (b == b_begin) {
+                    if (j == 0) break;
+                    b_begin = other.pieces[--j].begin();
+                    b = other.pieces[j].end();
+                }
+                if (a == b) {
+                    auto run = std::min<std::size_t>({static_cast<std::size_t>(a - a_begin), static_cast<std::size_t>(b - b_begin), limit - shared});
+                    a -= run;
+                    b -= run;
+                    shared += run;
+                } else if (*(a - 1) == *(b - 1)) {
+                    --a;
+                    --b;
+                    ++shared;
+                } else {
+                    break;
+                }
+            }
+            return shared;
+        }
+
+    private:
+        template <class F>
+        void for_each_piece(std::size_t first, std::size_t last, F&& f) const {
+            std::size_t position = 0;
+            for (auto const& p : pieces) {
+                if (position >= last) break;
+                auto from = std::max(first, position);
+                auto to = std::min(last, position + p.length);
+                if (from < to) f(p.begin() + (from - position), p.begin() + (to - position));
+                position += p.length;
+            }
+        }
+
+        // Appends the part of other's pieces that covers [first, last)
+        void append(piece_sequence const& other, std::size_t first, std::size_t last) {
+            last = std::min(last, other.count);
+            std::size_t position = 0;
+            for (auto const& p : other.pieces) {
+                if (position >= last) break;
+                auto from = std::max(first, position);
+                auto to = std::min(last, position + p.length);
+                if (from < to) {
+                    pieces.push_back({p.buffer, p.offset + (from - position), to - from});
+                    count += to - from;
+                }
+                position += p.length;
+            }
+        }
+
+        // Merges runs of short pieces, and everything if that is not enough
+        void compact() {
+            auto short_piece = std::max<std::size_t>(64, count / max_pieces);
+            auto merged = std::vector<piece>();
+            auto run = buffer_type();
+            auto flush = [&merged, &run] {
+                if (run.empty()) return;
+                auto length = run.size();
+                merged.push_back({std::make_shared<buffer_type const>(std::move(run)), 0, length});
+                run = buffer_type();
+            };
+            for (auto const& p : pieces) {
+                if (p.length < short_piece) {
+                    run.insert(run.end(), p.begin(), p.end());
+                } else {
+                    flush();
+                    merged.push_back(p);
+                }
+            }
+            flush();
+
+            if (merged.size() > max_pieces) {
+                auto items = flatten();
+                merged.clear();
+                merged.push_back({std::make_shared<buffer_type const>(std::move(items)), 0, count});
+            }
+            pieces = std::move(merged);
+        }
+
+        std::vector<piece> pieces;
+        std::size_t count;
+    };
+}
+
+#endif // PPSTEP_PIECE_SEQUENCE_HPP
@@ -3,8 +3,15 @@
 
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
 #include <list>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
 
 #include <boost/wave.hpp>
 #include <boost/wave/cpplexer/cpp_lex_token.hpp>
@@ -15,6 +22,11 @@
 
 #include "client.hpp"
 #include "server.hpp"
+#include "compdb.hpp"
+#include "profiler.hpp"
+#include "source_cache.hpp"
+#include "macro_state.hpp"
+#include "replay.hpp"
 
 
 namespace po = boost::program_options;
@@ -27,18 +39,12 @@ using lex_iterator_type = boost::wave::cpplexer::lex_iterator<token_type>;
 
 using context_type =
     boost::wave::context<
-        std::string::iterator,
+        char const*,
         lex_iterator_type,
-        boost::wave::iteration_context_policies::load_file_to_string,
+        ppstep::load_file_cached,
         ppstep::server<token_type, token_sequence_type>
     >;
 
-static std::string read_entire_file(std::istream&& instream) {
-    instream.unsetf(std::ios::skipws);
-
-    return std::string(std::istreambuf_iterator<char>(instream.rdbuf()), std::istreambuf_iterator<char>());
-}
-
 bool parse_args(int argc, char const** argv, po::variables_map& vm) {
     po::options_description desc("ppstep");
     desc.add_options()
@@ -51,7 +57,22 @@ bool parse_args(int argc, char const** argv, po::variables_map& vm) {
             "specify a macro to undefine")
         ("debug", "enable debug tracing")
         ("continue-on-error", "continue preprocessing after errors and collect all errors")
-        ("input-file", po::value<std::string>()->required(), "input file");
+        ("batch", "run headless without prompts, print summary statistics and exit with a status code")
+        ("trace", po::value<std::string>(), "record a trace of the whole session to a file")
+        ("trace-binary", "write --trace in the compact binary format")
+        ("convert-trace", po::value<std::string>(), "print a binary trace in the text trace format and exit")
+        ("replay", po::value<std::string>(), "step through a binary trace instead of preprocessing")
+        ("index-trace", po::value<std::string>(), "write the seekable index of a binary trace next to it and exit")
+        ("profile", po::value<std::string>(), "write per-macro expansion costs to a CSV file")
+        ("flamegraph", po::value<std::string>(), "write macro expansion stacks in folded format for flamegraph.pl")
+        ("save-macro-state", po::value<std::string>(), "write the macro table to a file once preprocessing completes")
+        ("load-macro-state", po::value<std::string>(), "start from a macro table written by --save-macro-state")
+        ("token-cache", po::value<std::string>(), "cache lexed include files in a directory and reuse them across runs")
+        ("history-memory", po::value<std::size_t>()->default_value(ppstep::DEFAULT_HISTORY_MEMORY >> 20),
+                "megabytes of step history kept in memory; older steps are spilled to a temporary file")
+        ("compdb", po::value<std::string>(), "run headless over every translation unit in a compile_commands.json")
+        ("jobs,j", po::value<unsigned>()->default_value(0), "number of worker threads for --compdb (default: one per core)")
+        ("input-file", po::value<std::string>(), "input file");
 
     po::positional_options_description p;
     p.add("input-file", -1);
@@ -65,31 +86,55 @@ bool parse_args(int argc, char const** argv, po::variables_map& vm) {
 
     try {
         po::notify(vm);
-        return true;
     } catch(std::exception const& e) {
         std::cerr << "error: " << e.what() << std::endl;
         std::cerr << desc << std::endl;
         return false;
     }
+
+    if (!vm.count("input-file") && !vm.count("compdb") && !vm.count("convert-trace") && !vm.count("replay") && !vm.count("index-trace")) {
+        std::cerr << "error: the option '--input-file' is required but missing" << std::endl;
+        std::cerr << desc << std::endl;
+        return false;
+    }
+
+    return true;
 }
 
-int main(int argc, char const** argv) {
-    po::variables_map args;
-    if (!parse_args(argc, argv, args))
-        return 1;
+struct session_options {
+    bool batch;
+    bool debug;
+    bool continue_on_error;
+    std::string trace_file;
+    bool binary_trace;
+    std::string trace_unit;
+    std::string log_tag;
+    std::string profile_file;
+    std::string flamegraph_file;
+    std::string save_macro_state;
+    std::string load_macro_state;
+    std::size_t history_memory;
+};
 
-    char const* input_file = args["input-file"].as<std::string>().c_str();
-    auto instring = read_entire_file(std::ifstream(input_file));
+struct unit_result {
+    ppstep::session_stats stats;
+    ppstep::profile_rows profile;
+    ppstep::folded_stacks stacks;
+    bool failed;
+};
 
-    auto server_state = ppstep::server_state<token_sequence_type>();
-    auto client = ppstep::client<token_type, token_sequence_type>(server_state);
-    bool continue_on_error = args.count("continue-on-error") > 0;
-    auto server = ppstep::server<token_type, token_sequence_type>(server_state, client, args.count("debug"), continue_on_error);
-    context_type ctx(instring.begin(), instring.end(), input_file, server);
+static ppstep::compile_command command_from_args(po::variables_map const& args) {
+    auto command = ppstep::compile_command();
+    command.file = args["input-file"].as<std::string>();
+    if (args.count("include")) command.includes = args["include"].as<std::vector<std::string>>();
+    if (args.count("define")) command.defines = args["define"].as<std::vector<std::string>>();
+    if (args.count("undefine")) command.undefines = args["undefine"].as<std::vector<std::string>>();
+    return command;
+}
 
-    static_assert(std::is_same_v<token_sequence_type, typename context_type::token_sequence_type>,
-                  "wave context token container type not same as expansion tracer token container type");
-    
+// The macro state snapshot, if any, goes in after -D and before -U, so the command line
+// wins over it both ways. Throws std::runtime_error if the snapshot cannot be loaded.
+static void configure_context(context_type& ctx, ppstep::compile_command const& command, std::string const& macro_state) {
     ctx.set_language(boost::wave::language_support(
         boost::wave::support_cpp2a
         | boost::wave::support_option_va_opt
@@ -99,27 +144,70 @@ int main(int argc, char const** argv) {
         | boost::wave::support_option_emit_pragma_directives
         | boost::wave::support_option_insert_whitespace));
     
-    if (args.count("include")) {
-        for (auto const& path : args["include"].as<std::vector<std::string>>()) {
-            ctx.add_include_path(path.c_str());
-            ctx.add_sysinclude_path(path.c_str());
-        }
+    for (auto const& path : command.includes) {
+        ctx.add_include_path(path.c_str());
+        ctx.add_sysinclude_path(path.c_str());
     }
     
-    if (args.count("define")) {
-        for (auto const& definition : args["define"].as<std::vector<std::string>>()) {
-            ctx.add_macro_definition(definition);
-        }
+    for (auto const& definition : command.defines) {
+        ctx.add_macro_definition(definition);
     }
+
+    if (!macro_state.empty()) ppstep::load_macro_state(ctx, macro_state);
     
-    if (args.count("undefine")) {
-        for (auto const& definition : args["undefine"].as<std::vector<std::string>>()) {
-            ctx.remove_macro_definition(definition, true);
-        }
+    for (auto const& definition : command.undefines) {
+        ctx.remove_macro_definition(definition, true);
+    }
+}
+
+// Runs one translation unit. Everything it touches is owned by the calling thread,
+// apart from the diagnostics stream it is handed.
+static unit_result run_unit(ppstep::compile_command const& command, session_options const& options, std::ostream& diagnostics) {
+    auto result = unit_result();
+    result.failed = false;
+
+    bool input_cached = false;
+    auto input = ppstep::source_cache::shared().acquire(command.file.c_str(), input_cached);
+    if (!input) {
+        diagnostics << command.file << ": error: could not open input file" << std::endl;
+        result.failed = true;
+        return result;
+    }
+
+    auto server_state = ppstep::server_state<token_sequence_type>();
+    auto client = ppstep::client<token_type, token_sequence_type>(server_state);
+    client.set_batch_mode(options.batch);
+    client.set_diagnostic_stream(diagnostics);
+    client.set_history_memory(options.history_memory);
+    client.count_file_load(input_cached);
+    // Interactive sessions always profile for the `profile` command; headless ones only on request
+    server_state.profiler.set_enabled(!options.batch || !options.profile_file.empty() || !options.flamegraph_file.empty());
+    auto server = ppstep::server<token_type, token_sequence_type>(server_state, client, options.debug, options.continue_on_error);
+    server.set_log_tag(options.log_tag);
+    context_type ctx(input->begin(), input->end(), command.file.c_str(), server);
+
+    static_assert(std::is_same_v<token_sequence_type, typename context_type::token_sequence_type>,
+                  "wave context token container type not same as expansion tracer token container type");
+
+    try {
+        configure_context(ctx, command, options.load_macro_state);
+    } catch (std::runtime_error const& e) {
+        diagnostics << "error: " << e.what() << std::endl;
+        result.failed = true;
+        return result;
     }
 
+    if (!options.trace_file.empty() && !client.start_recording(options.trace_file, options.binary_trace, options.trace_unit)) {
+        diagnostics << "error: could not open trace file " << options.trace_file << std::endl;
+        result.failed = true;
+        return result;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+
     auto first = ctx.begin();
     auto last = ctx.end();
+    bool completed = false;
     try {
         server.start(ctx);
         while (first != last) {
@@ -127,12 +215,259 @@ int main(int argc, char const** argv) {
             ++first;
         }
         server.complete(ctx);
+        completed = true;
     } catch (ppstep::session_terminate const& e) {
         ;
     } catch (boost::wave::cpp_exception const& e) {
-        std::cerr << e.what() << ": " << e.description() << std::endl;
+        diagnostics << e.what() << ": " << e.description() << std::endl;
+        result.failed = true;
     } catch (boost::wave::cpplexer::lexing_exception const& e) {
-        std::cerr << e.what() << ": " << e.description() << std::endl;
+        diagnostics << e.what() << ": " << e.description() << std::endl;
+        result.failed = true;
+    }
+
+    client.stop_recording();
+    // Compile database parts are indexed once they are merged
+    if (options.binary_trace && options.trace_unit.empty() && !options.trace_file.empty() && !ppstep::index_trace(options.trace_file)) {
+        diagnostics << "warning: could not write the index of " << options.trace_file << std::endl;
+    }
+
+    // A session quit early would leave a half-built macro table, so only complete runs are saved
+    if (completed && !options.save_macro_state.empty()) {
+        try {
+            ppstep::save_macro_state(ctx, options.save_macro_state);
+        } catch (std::runtime_error const& e) {
+            diagnostics << "error: " << e.what() << std::endl;
+            result.failed = true;
+        }
+    }
+
+    if (!options.profile_file.empty()) {
+        server_state.profiler.collect(server_state.symbols, result.profile);
+    }
+    if (!options.flamegraph_file.empty()) {
+        server_state.profiler.collect_stacks(server_state.symbols, result.stacks);
+    }
+    result.stats = client.get_stats();
+    result.stats.elapsed = std::chrono::steady_clock::now() - started;
+    return result;
+}
+
+// Writes whichever of the profile CSV and folded stacks were asked for
+static bool write_profiles(session_options const& options, ppstep::profile_rows const& rows, ppstep::folded_stacks const& stacks) {
+    bool ok = true;
+    auto write = [&ok](std::string const& filename, auto&& writer) {
+        if (filename.empty()) return;
+        std::ofstream out(filename, std::ios::out | std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "error: could not open " << filename << " for writing" << std::endl;
+            ok = false;
+            return;
+        }
+        writer(out);
+    };
+
+    write(options.profile_file, [&rows](std::ostream& out) { ppstep::write_profile_csv(out, rows); });
+    write(options.flamegraph_file, [&stacks](std::ostream& out) { ppstep::write_folded_stacks(out, stacks); });
+    return ok;
+}
+
+static bool append_file(std::ostream& out, std::string const& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) return false;
+    out << in.rdbuf();
+    return true;
+}
+
+// Preprocesses every entry of a compile database on a pool of workers. Each worker
+// owns its wave context, server state, server and client; diagnostics are buffered
+// per unit and traces go to per-unit files that are merged in database order.
+static int run_compile_database(po::variables_map const& args, session_options options) {
+    auto commands = std::vector<ppstep::compile_command>();
+    try {
+        commands = ppstep::load_compile_database(args["compdb"].as<std::string>());
+    } catch (std::runtime_error const& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Command line flags apply on top of every database entry
+    auto extra = ppstep::compile_command();
+    if (args.count("include")) extra.includes = args["include"].as<std::vector<std::string>>();
+    if (args.count("define")) extra.defines = args["define"].as<std::vector<std::string>>();
+    if (args.count("undefine")) extra.undefines = args["undefine"].as<std::vector<std::string>>();
+    for (auto& command : commands) {
+        ppstep::append_flags(command, extra);
+    }
+
+    auto jobs = args["jobs"].as<unsigned>();
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<unsigned>(jobs, std::max<std::size_t>(commands.size(), 1));
+
+    options.batch = true;
+    auto trace_file = options.trace_file;
+    auto part_name = [&trace_file](std::size_t index) { return trace_file + ".part" + std::to_string(index); };
+
+    auto results = std::vector<unit_result>(commands.size());
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> done(0);
+    std::mutex output_mutex;
+
+    auto started = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        for (std::size_t index; (index = next++) < commands.size();) {
+            auto unit_options = options;
+            unit_options.log_tag = std::to_string(index);
+            if (!trace_file.empty()) {
+                unit_options.trace_file = part_name(index);
+                unit_options.trace_unit = commands[index].file;
+            }
+
+            std::ostringstream diagnostics;
+            results[index] = run_unit(commands[index], unit_options, diagnostics);
+
+            std::lock_guard<std::mutex> lock(output_mutex);
+            auto const& result = results[index];
+            std::cout << '[' << ++done << '/' << commands.size() << "] " << commands[index].file
+                      << (result.failed || result.stats.errors > 0 ? ": FAILED" : ": ok")
+                      << " (" << result.stats.calls << " calls, " << result.stats.errors << " errors)" << '\n';
+            std::cerr << diagnostics.str();
+        }
+    };
+
+    auto workers = std::vector<std::thread>();
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    if (!trace_file.empty()) {
+        std::ofstream merged(trace_file, std::ios::out | std::ios::trunc | std::ios::binary);
+        for (std::size_t index = 0; index < commands.size(); ++index) {
+            // Binary parts carry their unit name in their own header
+            if (!options.binary_trace) merged << "### " << commands[index].file << '\n';
+            append_file(merged, part_name(index));
+            std::remove(part_name(index).c_str());
+        }
+        merged.close();
+        if (options.binary_trace && !ppstep::index_trace(trace_file)) {
+            std::cerr << "warning: could not write the index of " << trace_file << std::endl;
+        }
+    }
+
+    auto total = ppstep::session_stats();
+    auto profile = ppstep::profile_rows();
+    auto stacks = ppstep::folded_stacks();
+    std::size_t failed = 0;
+    for (auto const& result : results) {
+        total += result.stats;
+        for (auto const& [name, row] : result.profile) {
+            profile[name] += row;
+        }
+        for (auto const& [stack, ns] : result.stacks) {
+            stacks[stack] += ns;
+        }
+        if (result.failed || result.stats.errors > 0) ++failed;
+    }
+
+
+    auto wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Translation units: " << commands.size() << " (" << failed << " failed) on " << jobs << " threads in "
+              << std::fixed << std::setprecision(2) << wall << " ms" << '\n';
+    total.print(std::cout);
+
+    auto profile_written = write_profiles(options, profile, stacks);
+
+    return failed > 0 || !profile_written ? 2 : 0;
+}
+
+int main(int argc, char const** argv) {
+    po::variables_map args;
+    if (!parse_args(argc, argv, args))
+        return 1;
+
+    auto options = session_options();
+    options.batch = args.count("batch") > 0;
+    options.debug = args.count("debug") > 0;
+    options.continue_on_error = args.count("continue-on-error") > 0;
+    if (args.count("trace")) options.trace_file = args["trace"].as<std::string>();
+    options.binary_trace = args.count("trace-binary") > 0;
+    if (args.count("profile")) options.profile_file = args["profile"].as<std::string>();
+    if (args.count("flamegraph")) options.flamegraph_file = args["flamegraph"].as<std::string>();
+    if (args.count("save-macro-state")) options.save_macro_state = args["save-macro-state"].as<std::string>();
+    if (args.count("load-macro-state")) options.load_macro_state = args["load-macro-state"].as<std::string>();
+    options.history_memory = args["history-memory"].as<std::size_t>() << 20;
+
+    if (args.count("convert-trace")) {
+        auto filename = args["convert-trace"].as<std::string>();
+        try {
+            auto reader = ppstep::trace_reader();
+            if (!reader.open(filename.c_str())) {
+                std::cerr << "error: could not open " << filename << std::endl;
+                return 1;
+            }
+            ppstep::write_text_trace(reader, std::cout);
+        } catch (std::runtime_error const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            return 1;
+        }
+        return std::cout.good() ? 0 : 1;
+    }
+
+    if (args.count("index-trace")) {
+        auto filename = args["index-trace"].as<std::string>();
+        if (!ppstep::index_trace(filename)) {
+            std::cerr << "error: could not index " << filename << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (args.count("replay")) {
+        auto filename = args["replay"].as<std::string>();
+        try {
+            auto replay = ppstep::trace_replay<token_type, token_sequence_type>(options.history_memory);
+            if (!replay.open(filename)) {
+                std::cerr << "error: could not open " << filename << std::endl;
+                return 1;
+            }
+            replay.run();
+        } catch (std::runtime_error const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (args.count("token-cache")) {
+        auto directory = args["token-cache"].as<std::string>();
+        if (!ppstep::token_cache::shared().set_directory(directory)) {
+            std::cerr << "error: could not use " << directory << " as a token cache directory" << std::endl;
+            return 1;
+        }
+    }
+
+    if (args.count("compdb")) {
+        if (!options.save_macro_state.empty()) {
+            std::cerr << "error: --save-macro-state needs a single input file, not --compdb" << std::endl;
+            return 1;
+        }
+        return run_compile_database(args, options);
+    }
+
+    auto result = run_unit(command_from_args(args), options, std::cerr);
+
+    if (!write_profiles(options, result.profile, result.stacks)) {
+        result.failed = true;
+    }
+
+    if (options.batch) {
+        result.stats.print(std::cout);
+
+        return (result.failed || result.stats.errors > 0) ? 2 : 0;
     }
 
     return 0;
@@ -0,0 +1,277 @@
+#ifndef PPSTEP_PROFILER_HPP
+#define PPSTEP_PROFILER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "symbol_table.hpp"
+
+namespace ppstep {
+    struct macro_profile {
+        macro_profile() : calls(0), expansions(0), rescans(0), inclusive_ns(0), exclusive_ns(0), tokens_in(0), tokens_out(0), max_depth(0) {}
+
+        macro_profile& operator+=(macro_profile const& other) {
+            calls += other.calls;
+            expansions += other.expansions;
+            rescans += other.rescans;
+            inclusive_ns += other.inclusive_ns;
+            exclusive_ns += other.exclusive_ns;
+            tokens_in += other.tokens_in;
+            tokens_out += other.tokens_out;
+            max_depth = std::max(max_depth, other.max_depth);
+            return *this;
+        }
+
+        std::uint64_t calls;
+        std::uint64_t expansions;
+        std::uint64_t rescans;
+        std::uint64_t inclusive_ns;
+        std::uint64_t exclusive_ns;
+        std::uint64_t tokens_in;
+        std::uint64_t tokens_out;
+        std::size_t max_depth;
+    };
+
+    // Profiles keyed by spelling, so sessions with different symbol tables can be merged
+    using profile_rows = std::unordered_map<std::string, macro_profile>;
+
+    // Exclusive time per call path, as folded stacks ("A;B;C") for flamegraph.pl and speedscope
+    using folded_stacks = std::unordered_map<std::string, std::uint64_t>;
+
+    // Per-macro cost accounting fed by the server's expansion hooks. A frame opens when a
+    // macro is called and closes when its rescan finishes, so inclusive time covers
+    // argument expansion, substitution and rescanning; exclusive time subtracts the
+    // frames nested inside. A macro that is already on the stack (ID(ID(x))) only adds
+    // inclusive time for its outermost frame, so totals never double count. Exclusive
+    // time is also charged to the frame's node in a call tree, which keeps the full
+    // nesting for flamegraphs.
+    struct macro_profiler {
+        using clock = std::chrono::steady_clock;
+
+        macro_profiler() : enabled(false), frames(), profiles(), active(), nodes(1, call_node{no_symbol, 0, 0}), edges(), paused_ns(0) {}
+
+        // Time spent in ppstep's own hooks (the client, recording, heuristics) is not the
+        // macro's cost, so the server runs them under a pause
+        struct pause_guard {
+            explicit pause_guard(macro_profiler* profiler) : profiler(profiler), started() {
+                if (profiler) started = clock::now();
+            }
+
+            ~pause_guard() {
+                if (profiler) profiler->paused_ns += elapsed_ns(started);
+            }
+
+            pause_guard(pause_guard const&) = delete;
+            pause_guard& operator=(pause_guard const&) = delete;
+
+        private:
+            macro_profiler* profiler;
+            clock::time_point started;
+        };
+
+        void set_enabled(bool value) {
+            enabled = value;
+        }
+
+        bool is_enabled() const {
+            return enabled;
+        }
+
+        pause_guard pause() {
+            return pause_guard(enabled ? this : nullptr);
+        }
+
+        void enter(symbol_id symbol, std::size_t tokens_in) {
+            if (!enabled || symbol == no_symbol) return;
+            if (symbol >= profiles.size()) {
+                profiles.resize(symbol + 1);
+                active.resize(symbol + 1, 0);
+            }
+
+            auto& profile = profiles[symbol];
+            ++profile.calls;
+            profile.tokens_in += tokens_in;
+            profile.max_depth = std::max(profile.max_depth, frames.size() + 1);
+            ++active[symbol];
+
+            auto parent = frames.empty() ? 0 : frames.back().node;
+            auto [edge, inserted] = edges.try_emplace((std::uint64_t(parent) << 32) | symbol, static_cast<std::uint32_t>(nodes.size()));
+            if (inserted) nodes.push_back({symbol, parent, 0});
+
+            frames.push_back({symbol, edge->second, clock::now(), paused_ns, 0});
+        }
+
+        void expanded(std::size_t tokens_out) {
+            if (!enabled || frames.empty()) return;
+            auto& profile = profiles[frames.back().symbol];
+            ++profile.expansions;
+            profile.tokens_out += tokens_out;
+        }
+
+        void rescanned() {
+            if (!enabled || frames.empty()) return;
+            auto frame = frames.back();
+            frames.pop_back();
+
+            auto elapsed = elapsed_ns(frame.start) - (paused_ns - frame.paused_at_start);
+            auto& profile = profiles[frame.symbol];
+            ++profile.rescans;
+            auto exclusive = elapsed > frame.children_ns ? elapsed - frame.children_ns : 0;
+            profile.exclusive_ns += exclusive;
+            nodes[frame.node].self_ns += exclusive;
+            if (--active[frame.symbol] == 0) {
+                profile.inclusive_ns += elapsed;
+            }
+
+            if (!frames.empty()) {
+                frames.back().children_ns += elapsed;
+            }
+        }
+
+        std::size_t depth() const {
+            return frames.size();
+        }
+
+        void collect(symbol_table const& symbols, profile_rows& rows) const {
+            for (symbol_id symbol = 0; symbol < profiles.size(); ++symbol) {
+                if (profiles[symbol].calls == 0) continue;
+                rows[std::string(symbols.name(symbol))] += profiles[symbol];
+            }
+        }
+
+        void collect_stacks(symbol_table const& symbols, folded_stacks& stacks) const {
+            auto path = std::vector<symbol_id>();
+            for (std::uint32_t index = 1; index < nodes.size(); ++index) {
+                if (nodes[index].self_ns == 0) continue;
+
+                path.clear();
+                for (auto node = index; node != 0; node = nodes[node].parent) {
+                    path.push_back(nodes[node].symbol);
+                }
+
+                auto folded = std::string();
+                for (auto it = path.rbegin(); it != path.rend(); ++it) {
+                    if (!folded.empty()) folded += ';';
+                    folded += symbols.name(*it);
+                }
+                stacks[folded] += nodes[index].self_ns;
+            }
+        }
+
+        void clear() {
+            frames.clear();
+            profiles.clear();
+            active.clear();
+            nodes.resize(1);
+            nodes.front().self_ns = 0;
+            edges.clear();
+            paused_ns = 0;
+        }
+
+    private:
+        bool enabled;
+
+        struct frame {
+            symbol_id symbol;
+            std::uint32_t node;
+            clock::time_point start;
+            std::uint64_t paused_at_start;
+            std::uint64_t children_ns;
+        };
+
+        struct call_node {
+            symbol_id symbol;
+            std::uint32_t parent;
+            std::uint64_t self_ns;
+        };
+
+        static std::uint64_t elapsed_ns(clock::time_point since) {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count());
+        }
+
+        std::vector<frame> frames;
+        std::vector<macro_profile> profiles;  // indexed by symbol_id
+        std::vector<std::uint32_t> active;    // frames currently open per symbol
+        std::vector<call_node> nodes;         // node 0 is the root outside any macro
+        std::unordered_map<std::uint64_t, std::uint32_t> edges;  // (parent, symbol) -> child
+        std::uint64_t paused_ns;
+    };
+
+    inline std::vector<std::pair<std::string, macro_profile>> sorted_profiles(profile_rows const& rows) {
+        auto sorted = std::vector<std::pair<std::string, macro_profile>>(rows.begin(), rows.end());
+        std::sort(sorted.begin(), sorted.end(), [](auto const& a, auto const& b) {
+            if (a.second.inclusive_ns != b.second.inclusive_ns) return a.second.inclusive_ns > b.second.inclusive_ns;
+            return a.first < b.first;
+        });
+        return sorted;
+    }
+
+    inline void write_profile_csv(std::ostream& os, profile_rows const& rows) {
+        os << "macro,calls,expansions,rescans,inclusive_ns,exclusive_ns,tokens_in,tokens_out,max_depth\n";
+        for (auto const& [name, profile] : sorted_profiles(rows)) {
+            os << name << ','
+               << profile.calls << ','
+               << profile.expansions << ','
+               << profile.rescans << ','
+               << profile.inclusive_ns << ','
+               << profile.exclusive_ns << ','
+               << profile.tokens_in << ','
+               << profile.tokens_out << ','
+               << profile.max_depth << '\n';
+        }
+        os.flush();
+    }
+
+    inline void write_folded_stacks(std::ostream& os, folded_stacks const& stacks) {
+        auto sorted = std::vector<std::pair<std::string, std::uint64_t>>(stacks.begin(), stacks.end());
+        std::sort(sorted.begin(), sorted.end());
+        for (auto const& [stack, ns] : sorted) {
+            os << stack << ' ' << ns << '\n';
+        }
+        os.flush();
+    }
+
+    inline void print_profile(std::ostream& os, profile_rows const& rows, std::size_t limit) {
+        auto sorted = sorted_profiles(rows);
+        if (sorted.empty()) {
+            os << "No macro expansions profiled yet" << std::endl;
+            return;
+        }
+
+        auto ms = [](std::uint64_t ns) { return static_cast<double>(ns) / 1e6; };
+
+        os << std::left << std::setw(32) << "macro" << std::right
+           << std::setw(10) << "calls"
+           << std::setw(12) << "incl ms"
+           << std::setw(12) << "excl ms"
+           << std::setw(10) << "tok in"
+           << std::setw(10) << "tok out"
+           << std::setw(7) << "depth" << '\n';
+
+        auto shown = std::min(limit, sorted.size());
+        for (std::size_t i = 0; i < shown; ++i) {
+            auto const& [name, profile] = sorted[i];
+            auto label = name.size() > 31 ? name.substr(0, 28) + "..." : name;
+            os << std::left << std::setw(32) << label << std::right
+               << std::setw(10) << profile.calls
+               << std::setw(12) << std::fixed << std::setprecision(3) << ms(profile.inclusive_ns)
+               << std::setw(12) << ms(profile.exclusive_ns)
+               << std::setw(10) << profile.tokens_in
+               << std::setw(10) << profile.tokens_out
+               << std::setw(7) << profile.max_depth << '\n';
+        }
+
+        if (shown < sorted.size()) {
+            os << "... " << (sorted.size() - shown) << " more macros" << '\n';
+        }
+        os << std::flush;
+    }
+}
+
+#endif // PPSTEP_PROFILER_HPP
@@ -0,0 +1,374 @@
+#ifndef PPSTEP_REPLAY_HPP
+#define PPSTEP_REPLAY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/wave/token_ids.hpp>
+
+#include "client.hpp"
+#include "server.hpp"
+#include "trace.hpp"
+#include "trace_index.hpp"
+#include "token_view.hpp"
+#include "replay_context.hpp"
+
+namespace ppstep {
+    // Steps through a binary trace with the interactive client and no preprocessor.
+    // Events are read straight out of the mapped trace and handed to the client's hooks
+    // the way the server would have, so stepping, breakpoints, history and rendering
+    // all behave as in a live session. The server's expansion stacks are rebuilt from
+    // the events for `bt` and `ft`. Every translation unit of a compile database trace
+    // is replayed as a session of its own. `goto` and `find` jump through the trace's
+    // index: the replay restarts at the checkpoint before the target and catches up to
+    // it without prompting.
+    template <class TokenT, class ContainerT>
+    struct trace_replay {
+        using string_type = typename TokenT::string_type;
+        using position_type = typename TokenT::position_type;
+
+        explicit trace_replay(std::size_t history_memory)
+            : history_memory(history_memory), reader(), navigator(), record(), frame(), event(0), damage(), kind_tokens(), lists(3), arguments() {}
+
+        // False if the file cannot be opened; throws if it is not a binary trace
+        bool open(std::string const& path) {
+            if (!reader.open(path.c_str())) return false;
+            navigator = std::make_unique<trace_navigator>(path, reader);
+            return true;
+        }
+
+        // Returns once the last unit is complete or the session quits. A unit that
+        // turns out to be cut short or corrupt still ends at its `complete` prompt, with
+        // everything before the damage in history, and is the last one replayed unless
+        // the prompt jumps back into the trace.
+        void run() {
+            try {
+                auto arrival = std::optional<std::uint64_t>();
+                while (arrival || reader.next_unit()) {
+                    arrival = run_unit(arrival);
+                    if (!arrival && !damage.empty()) return;
+                }
+            } catch (session_terminate const&) {
+                ;
+            }
+        }
+
+    private:
+        // Replays the unit the reader is at, or the one holding `arrival` from that
+        // event on. Returns the event to go on from when the prompt jumps to another unit.
+        std::optional<std::uint64_t> run_unit(std::optional<std::uint64_t> arrival) {
+            // Token kinds are numbered per unit
+            kind_tokens.clear();
+            auto checkpoint = std::optional<index_checkpoint>();
+            if (arrival) checkpoint = seek(*arrival);
+
+            auto name = reader.unit().name;
+            auto prefix = name.empty() ? std::string() : boost::filesystem::path(std::string(name)).filename().string();
+            auto state = server_state<ContainerT>();
+            auto cl = client<TokenT, ContainerT>(state, prefix);
+            cl.set_history_memory(history_memory);
+            auto ctx = replay_context(*navigator);
+
+            // The first record is read ahead for the start position
+            bool ahead = false;
+            if (checkpoint) {
+                if (!name.empty()) std::cout << "Replaying " << name << '.' << std::endl;
+                resume(*checkpoint, *arrival, ctx, state, cl);
+            } else {
+                // Wave starts out in front of the first line of the file the first event names
+                navigator->set_next(event, reader.unit().offset);
+                ctx.set_main_pos(name, 0, 1);
+                ahead = read();
+                if (ahead && record.type != trace_format::tag::error) ctx.set_main_pos(reader.string(record.file), 0, 1);
+                cl.on_start(ctx);
+            }
+
+            while (true) {
+                if (auto target = navigator->take_jump()) {
+                    auto const& index = *navigator->index();
+                    if (index.unit(*index.unit_of(*target)).offset != reader.unit().offset) return target;
+                    resume(seek(*target), *target, ctx, state, cl);
+                    ahead = false;
+                    continue;
+                }
+                if (ahead || read()) {
+                    ahead = false;
+                    play(ctx, state, cl);
+                    continue;
+                }
+
+                if (auto end = reader.position()) locate(ctx, *end);
+                if (!damage.empty()) std::cout << "Replay stopped: " << damage << std::endl;
+                cl.on_complete(ctx);
+                if (!navigator->jumping()) return {};
+            }
+        }
+
+        // Hands the record just read to the client as event number `event`
+        void play(replay_context& ctx, server_state<ContainerT>& state, client<TokenT, ContainerT>& cl) {
+            navigator->set_next(++event, reader.unit().offset);
+            locate(ctx, record);
+            dispatch(ctx, state, cl);
+        }
+
+        // Moves the reader to the checkpoint at or before `target`, in whichever unit it is
+        index_checkpoint seek(std::uint64_t target) {
+            auto const& index = *navigator->index();
+            auto unit = index.unit(*index.unit_of(target));
+            auto checkpoint = index.checkpoint_before(unit, target);
+
+            auto unit_kinds = std::vector<trace_kind>();
+            unit_kinds.reserve(checkpoint.kinds);
+            for (std::uint32_t i = 0; i < checkpoint.kinds; ++i) {
+                unit_kinds.push_back(index.kind(unit, i));
+            }
+            auto unit_strings = std::vector<std::string_view>();
+            unit_strings.reserve(checkpoint.strings);
+            for (std::uint32_t i = 0; i < checkpoint.strings; ++i) {
+                unit_strings.push_back(index.string(unit, i));
+            }
+            auto position = std::optional<trace_record>();
+            if (checkpoint.positioned) {
+                position.emplace();
+                position->file = checkpoint.file;
+                position->line = checkpoint.line;
+                position->column = checkpoint.column;
+            }
+            reader.seek(unit.offset, checkpoint.offset, std::move(unit_kinds), std::move(unit_strings), position);
+            event = checkpoint.event;
+            damage.clear();
+            return checkpoint;
+        }
+
+        // Puts the server's stacks back the way they were at the checkpoint the reader
+        // was just moved to, then catches up to `target` quietly
+        void resume(index_checkpoint const& checkpoint, std::uint64_t target, replay_context& ctx, server_state<ContainerT>& state,
+                    client<TokenT, ContainerT>& cl) {
+            using trace_format::tag;
+
+            auto const& index = *navigator->index();
+            state.expanding.clear();
+            state.rescanning.clear();
+            state.tokens.reset();
+            // Frames were opened in trace order, which is also the order of their tokens
+            // in the arena
+            std::uint64_t calls = 0;
+            std::uint64_t expansions = checkpoint.expanding;
+            auto const frames = expansions + checkpoint.rescanning;
+            while (calls < checkpoint.expanding || expansions < frames) {
+                auto from_call = expansions == frames
+                    || (calls < checkpoint.expanding && index.frame(checkpoint, calls) < index.frame(checkpoint, expansions));
+                auto& i = from_call ? calls : expansions;
+                reader.read_at(static_cast<std::size_t>(index.frame(checkpoint, i++)), frame);
+
+                fill(frame.lists[0], lists[0]);
+                auto start = state.tokens.mark();
+                state.tokens.append(lists[0].begin(), lists[0].end());
+                auto opened = state.tokens.since(start);
+                if (frame.type == tag::expanded) {
+                    fill(frame.lists[1], lists[1]);
+                    auto kept = state.tokens.mark();
+                    state.tokens.append(lists[1].begin(), lists[1].end());
+                    state.rescanning.emplace_back(opened, state.tokens.since(kept));
+                } else {
+                    state.expanding.push_back(opened);
+                }
+            }
+
+            if (checkpoint.positioned) ctx.set_main_pos(reader.string(checkpoint.file), checkpoint.line, checkpoint.column);
+            navigator->set_next(event, reader.unit().offset);
+            cl.discard_token_stack();
+            cl.set_prompting(false);
+            while (event < target && read()) {
+                // Nobody asked to see errors on the way
+                if (record.type == tag::error) {
+                    navigator->set_next(++event, reader.unit().offset);
+                    continue;
+                }
+                play(ctx, state, cl);
+            }
+            cl.set_prompting(true);
+        }
+
+        // The next record of the unit; a damaged trace just ends there, with the damage noted
+        bool read() {
+            try {
+                return reader.next(record);
+            } catch (std::runtime_error const& e) {
+                damage = e.what();
+                return false;
+            }
+        }
+
+        // Errors carry their own file and line rather than the main position
+        void locate(replay_context& ctx, trace_record const& at) {
+            if (at.type == trace_format::tag::error) return;
+            ctx.set_main_pos(reader.string(at.file), at.line, at.column);
+        }
+
+        // Mirrors what the server does around each hook, including running to a target
+        void dispatch(replay_context& ctx, server_state<ContainerT>& state, client<TokenT, ContainerT>& cl) {
+            using trace_format::tag;
+
+            if (record.type != tag::error) {
+                // Calls are recorded with their own frame already pushed
+                auto calls = record.type == tag::call || record.type == tag::object_call;
+                settle(state, record.depth - (calls && record.depth > 0 ? 1 : 0));
+            }
+
+            switch (record.type) {
+                case tag::lexed: {
+                    auto const& token = token_of(record.lists[0][0]);
+                    if (is_insignificant_token(token)) return;
+                    if (cl.skips_to_target(token)) {
+                        cl.count_event(preprocessing_event_type::LEXED);
+                        return;
+                    }
+                    cl.on_lexed(ctx, token);
+                    return;
+                }
+                case tag::object_call: {
+                    auto const& macro = token_of(record.lists[0][0]);
+                    if (cl.skips_to_target(macro)) {
+                        skip_expansion(state, cl);
+                        return;
+                    }
+                    state.expanding.push_back(state.tokens.store(macro));
+                    cl.on_expand_object(ctx, macro);
+                    return;
+                }
+                case tag::call: {
+                    auto const& call = tokens(0);
+                    if (call.empty()) return;
+                    if (cl.skips_to_target(call.front())) {
+                        skip_expansion(state, cl);
+                        return;
+                    }
+                    auto start = state.tokens.mark();
+                    state.tokens.append(call.begin(), call.end());
+                    state.expanding.push_back(state.tokens.since(start));
+                    // Only a recording session looks at the arguments
+                    arguments.resize(cl.is_recording() ? record.lists.size() - 1 : 0);
+                    for (std::size_t i = 0; i < arguments.size(); ++i) {
+                        fill(record.lists[i + 1], arguments[i]);
+                    }
+                    cl.on_expand_function(ctx, call.front(), arguments, call);
+                    return;
+                }
+                case tag::expanded: {
+                    auto const& initial = tokens(0);
+                    auto const& result = tokens(1);
+                    // A trace started inside an expansion has not seen its call
+                    if (state.expanding.empty()) {
+                        auto start = state.tokens.mark();
+                        state.tokens.append(initial.begin(), initial.end());
+                        state.expanding.push_back(state.tokens.since(start));
+                    }
+                    if (state.expanding.back().size == 0) {
+                        state.rescanning.emplace_back(state.expanding.back(), state.expanding.back());
+                        state.expanding.pop_back();
+                        cl.count_event(preprocessing_event_type::EXPANDED);
+                        return;
+                    }
+                    cl.on_expanded(ctx, initial, result);
+
+                    auto cause = state.expanding.back();
+                    state.expanding.pop_back();
+                    auto kept = state.tokens.mark();
+                    state.tokens.append(result.begin(), result.end());
+                    state.rescanning.emplace_back(cause, state.tokens.since(kept));
+                    return;
+                }
+                case tag::rescanned: {
+                    if (!state.rescanning.empty() && state.rescanning.back().first.size == 0) {
+                        cl.count_event(preprocessing_event_type::RESCANNED);
+                        pop_rescan(state);
+                        return;
+                    }
+                    cl.on_rescanned(ctx, tokens(0), tokens(1), tokens(2));
+                    if (!state.rescanning.empty()) pop_rescan(state);
+                    return;
+                }
+                case tag::error: {
+                    // Expansions skipped on the way to a target are never checked for undefined macros
+                    if (!state.expanding.empty() && state.expanding.back().size == 0) return;
+                    cl.on_error(std::string(reader.string(record.message)), std::string(reader.string(record.file)), static_cast<int>(record.line));
+                    return;
+                }
+                default:
+                    return;
+            }
+        }
+
+        // Rescans that left nothing behind are not recorded, but the server still popped
+        // their frames; every event records how deep the stacks were, which says how
+        // many such frames to drop
+        static void settle(server_state<ContainerT>& state, std::size_t depth) {
+            while (state.expanding.size() + state.rescanning.size() > depth && !state.rescanning.empty()) {
+                pop_rescan(state);
+            }
+        }
+
+        // Same empty frame the server pushes for calls skipped on the way to a target
+        static void skip_expansion(server_state<ContainerT>& state, client<TokenT, ContainerT>& cl) {
+            state.expanding.push_back(state.tokens.since(state.tokens.mark()));
+            cl.count_event(preprocessing_event_type::CALL);
+        }
+
+        static void pop_rescan(server_state<ContainerT>& state) {
+            auto cause = state.rescanning.back().first;
+            state.rescanning.pop_back();
+            if (state.expanding.empty() && state.rescanning.empty()) {
+                state.tokens.reset();
+            } else {
+                state.tokens.rewind(cause);
+            }
+        }
+
+        // The Wave token a kind stands for, made the first time it is used. Positions
+        // are not recorded, so the tokens have none.
+        TokenT const& token_of(std::uint32_t kind) {
+            while (kind_tokens.size() <= kind) {
+                auto const& k = reader.kind(static_cast<std::uint32_t>(kind_tokens.size()));
+                kind_tokens.emplace_back(static_cast<boost::wave::token_id>(k.id), string_type(k.spelling.data(), k.spelling.size()), position_type());
+            }
+            return kind_tokens[kind];
+        }
+
+        // A token list of the current record as the server would have handed it to the
+        // client: whitespace that normalized records kept is dropped again
+        std::vector<TokenT> const& tokens(std::size_t list) {
+            fill(record.lists[list], lists[list]);
+            return lists[list];
+        }
+
+        void fill(std::vector<std::uint32_t> const& kinds, std::vector<TokenT>& out) {
+            out.clear();
+            for (auto kind : kinds) {
+                auto const& token = token_of(kind);
+                if (!is_insignificant_token(token)) out.push_back(token);
+            }
+        }
+
+        std::size_t history_memory;
+        trace_reader reader;
+        std::unique_ptr<trace_navigator> navigator;
+        trace_record record;
+        trace_record frame;  // scratch for the records that opened frames, when resuming
+        std::uint64_t event;  // number of the next event to read
+        std::string damage;
+        std::vector<TokenT> kind_tokens;
+        std::vector<std::vector<TokenT>> lists;      // one per token list a record can have besides arguments
+        std::vector<std::vector<TokenT>> arguments;  // scratch for recorded calls
+    };
+}
+
+#endif // PPSTEP_REPLAY_HPP
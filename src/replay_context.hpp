@@ -0,0 +1,146 @@
+#ifndef PPSTEP_REPLAY_CONTEXT_HPP
+#define PPSTEP_REPLAY_CONTEXT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <unistd.h>
+
+#include "trace_index.hpp"
+
+namespace ppstep {
+    // Where the prompt of a replay can jump to. Targets are looked up in the trace's
+    // index, which is built the first time one is needed; the replay makes the jump
+    // once the prompt returns.
+    struct trace_navigator {
+        trace_navigator(std::string trace_path, trace_reader const& reader)
+            : trace_path(std::move(trace_path)), reader(&reader), loaded(), tried(false), next(0), unit_offset(0), jump() {}
+
+        // The event the replay reads next, in the unit whose header is at `unit_offset`
+        void set_next(std::uint64_t event, std::uint64_t offset) {
+            next = event;
+            unit_offset = offset;
+        }
+
+        std::uint64_t next_event() const {
+            return next;
+        }
+
+        // Null if the trace has no usable index and none can be built. Traces in a
+        // directory that cannot be written to are indexed into a temporary file.
+        trace_index const* index() {
+            if (!tried) {
+                tried = true;
+                loaded = std::make_unique<trace_index>();
+                auto path = trace_index_path(trace_path);
+                if (!loaded->open(path, *reader)) {
+                    std::cout << "Indexing " << trace_path << "..." << std::endl;
+                    if (!index_trace(trace_path) || !loaded->open(path, *reader)) {
+                        auto temporary = (std::filesystem::temp_directory_path() / ("ppstep-" + std::to_string(::getpid()) + ".idx")).string();
+                        auto usable = index_trace(trace_path, temporary) && loaded->open(temporary, *reader);
+                        // Mapped already, so nothing else needs the file
+                        std::remove(temporary.c_str());
+                        if (!usable) loaded.reset();
+                    }
+                }
+            }
+            return loaded.get();
+        }
+
+        // The unit being replayed, once there is an index
+        std::optional<index_unit> unit() {
+            auto const* found = index();
+            if (!found) return {};
+            auto i = found->unit_at(unit_offset);
+            if (!i) return {};
+            return found->unit(*i);
+        }
+
+        void jump_to(std::uint64_t event) {
+            jump = event;
+        }
+
+        bool jumping() const {
+            return jump.has_value();
+        }
+
+        std::optional<std::uint64_t> take_jump() {
+            auto target = jump;
+            jump.reset();
+            return target;
+        }
+
+    private:
+        std::string trace_path;
+        trace_reader const* reader;
+        std::unique_ptr<trace_index> loaded;
+        bool tried;
+        std::uint64_t next;
+        std::uint64_t unit_offset;
+        std::optional<std::uint64_t> jump;
+    };
+
+    // Main position of a replayed trace, shaped like Wave's file_position as far as the
+    // client and the prompt use it
+    struct replay_position {
+        replay_position() : file(), line(0), column(0) {}
+
+        std::string const& get_file() const {
+            return file;
+        }
+
+        std::size_t get_line() const {
+            return line;
+        }
+
+        std::size_t get_column() const {
+            return column;
+        }
+
+        std::string file;
+        std::size_t line;
+        std::size_t column;
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, replay_position const& pos) {
+        return os << pos.file << ':' << pos.line << ':' << pos.column;
+    }
+
+    // Stands in for the Wave context while a trace is replayed. Events only need the
+    // main position; commands that would run the preprocessor are refused by the prompt,
+    // and the navigator answers the ones that move around the trace.
+    struct replay_context {
+        using position_type = replay_position;
+
+        explicit replay_context(trace_navigator& navigator) : pos(), nav(&navigator) {}
+
+        trace_navigator& navigator() const {
+            return *nav;
+        }
+
+        position_type const& get_main_pos() const {
+            return pos;
+        }
+
+        void set_main_pos(std::string_view file, std::size_t line, std::size_t column) {
+            if (file != pos.file) pos.file.assign(file.data(), file.size());
+            pos.line = line;
+            pos.column = column;
+        }
+
+    private:
+        position_type pos;
+        trace_navigator* nav;
+    };
+}
+
+#endif // PPSTEP_REPLAY_CONTEXT_HPP
@@ -0,0 +1,85 @@
+#ifndef PPSTEP_SEQUENCE_INDEX_HPP
+#define PPSTEP_SEQUENCE_INDEX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace ppstep {
+    // Search index over the token keys of one sequence: Rabin-Karp prefix hashes, so the
+    // hash of any window comes out of two prefix hashes in constant time, and a sorted
+    // list of where each key occurs. Finding a pattern looks up where its first token
+    // occurs at or after the starting point and checks each candidate window by hash;
+    // the tokens themselves are only compared where the hashes agree. Arithmetic wraps
+    // modulo 2^64, and collisions only cost a comparison.
+    struct sequence_index {
+        static constexpr std::uint64_t multiplier = 0x100000001b3ull;
+
+        // The keys and hash of one pattern, along with multiplier^size to line windows up with it
+        struct pattern {
+            std::vector<std::uint64_t> keys;
+            std::uint64_t hash = 0;
+            std::uint64_t power = 1;
+            std::uint64_t first = 0;
+            std::size_t size = 0;
+
+            void push_back(std::uint64_t key) {
+                if (size == 0) first = key;
+                keys.push_back(key);
+                hash = hash * multiplier + mix(key);
+                power *= multiplier;
+                ++size;
+            }
+        };
+
+        // Indexes key_of(item) for every item of the range
+        template <class RangeT, class KeyOfT>
+        sequence_index(RangeT const& items, KeyOfT&& key_of) : prefix(), postings() {
+            prefix.reserve(items.size() + 1);
+            postings.reserve(items.size());
+            prefix.push_back(0);
+            for (auto const& item : items) {
+                auto key = key_of(item);
+                postings.emplace_back(key, static_cast<std::uint32_t>(prefix.size() - 1));
+                prefix.push_back(prefix.back() * multiplier + mix(key));
+            }
+            std::sort(postings.begin(), postings.end());
+        }
+
+        std::size_t size() const {
+            return prefix.size() - 1;
+        }
+
+        // First position at or after `from` whose window hashes like the pattern and
+        // passes `equal`
+        template <class EqualT>
+        std::optional<std::size_t> find(pattern const& p, std::size_t from, EqualT&& equal) const {
+            if (p.size == 0) return from <= size() ? std::optional<std::size_t>(from) : std::nullopt;
+
+            auto it = std::lower_bound(postings.begin(), postings.end(), std::make_pair(p.first, static_cast<std::uint32_t>(from)));
+            for (; it != postings.end() && it->first == p.first; ++it) {
+                std::size_t at = it->second;
+                if (at + p.size > size()) break;
+                if (prefix[at + p.size] - prefix[at] * p.power == p.hash && equal(at)) return at;
+            }
+            return {};
+        }
+
+    private:
+        // Spreads the ID and spelling bits of a key over the whole word
+        static std::uint64_t mix(std::uint64_t key) {
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdull;
+            key ^= key >> 33;
+            return key;
+        }
+
+        std::vector<std::uint64_t> prefix;                          // prefix[i] hashes the first i keys
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> postings;  // (key, position), sorted
+    };
+}
+
+#endif // PPSTEP_SEQUENCE_INDEX_HPP
@@ -5,22 +5,39 @@
 #include <string>
 #include <fstream>
 #include <chrono>
+#include <ctime>
 #include <iomanip>
 #include <sstream>
-#include <unordered_set>
 #include <algorithm>
 
 #include "server_fwd.hpp"
 #include "client.hpp"
+#include "token_view.hpp"
+#include "symbol_table.hpp"
+#include "profiler.hpp"
+#include "token_arena.hpp"
 
 namespace ppstep {
     template <class ContainerT>
     struct server_state {
-        server_state() : expanding(), rescanning(), disable_printing(false) {}
+        using token_type = typename ContainerT::value_type;
 
-        std::vector<ContainerT> expanding;
-        std::vector<std::pair<ContainerT, ContainerT>> rescanning;
+        server_state() : tokens(), expanding(), rescanning(), disable_printing(false), symbols(), profiler() {}
+
+        token_range<token_type> range(token_span span) const {
+            return tokens.range(span);
+        }
+
+        // The expansion stacks only hold spans; their tokens live in the arena
+        token_arena<token_type> tokens;
+        std::vector<token_span> expanding;
+        std::vector<std::pair<token_span, token_span>> rescanning;  // (cause, expanded result)
         bool disable_printing;
+
+        // Identifier spellings shared by the server and client of one session
+        symbol_table symbols;
+
+        macro_profiler profiler;
     };
 
     template <typename TokenT, typename ContainerT>
@@ -28,26 +45,25 @@ namespace ppstep {
         using base_type = boost::wave::context_policies::eat_whitespace<TokenT>;
 
         server(server_state<ContainerT>& state, client<TokenT, ContainerT>& sink, bool debug = false, bool continue_on_error = false)
-            : state(&state), sink(&sink), debug(debug), continue_on_error(continue_on_error), evaluating_conditional(false), fatal_error_occurred(false), main_input_file(), defined_macros() {}
+            : state(&state), sink(&sink), debug(debug), continue_on_error(continue_on_error), evaluating_conditional(false), fatal_error_occurred(false), expanding_va_opt(false), main_input_file(), defined_macros() {}
 
         ~server() {}
 
         inline bool should_skip_token(TokenT const& token) {
-            return IS_CATEGORY(token, boost::wave::WhiteSpaceTokenType)
-                    || IS_CATEGORY(token, boost::wave::EOFTokenType)
-                    || (boost::wave::token_id(token) == boost::wave::T_PLACEMARKER)
-                    || !token.is_valid();
+            return is_insignificant_token(token);
         }
 
-        inline ContainerT sanitize(ContainerT const& tokens) {
-            auto acc = ContainerT();
-            for (auto const& token : tokens) {
-                if (should_skip_token(token)) continue;
-                acc.push_back(token);
-            }
-            return acc;
+        // Headless sessions that are not recording only count events
+        inline bool wants_payloads() const {
+            return debug || sink->needs_token_payloads();
+        }
+
+        // Interactive --debug only prints the event stream; batch runs still need errors for the summary
+        inline bool reports_errors() const {
+            return sink && (!debug || sink->is_batch_mode());
         }
 
+
         template <typename ContextT, typename IteratorT>
         bool expanding_function_like_macro(
                 ContextT& ctx,
@@ -56,26 +72,47 @@ namespace ppstep {
                 TokenT const& macrocall, std::vector<ContainerT> const& arguments,
                 IteratorT const& seqstart, IteratorT const& seqend) {
             if (evaluating_conditional || (fatal_error_occurred && !continue_on_error) || state->disable_printing) return false;
-
-            auto sanitized_arguments = std::vector<ContainerT>();
-            for (auto const& arg_container : arguments) {
-                sanitized_arguments.push_back(sanitize(arg_container));
+            // Wave reports a __VA_OPT__ as a call and an expansion with nothing in between,
+            // but never rescans it, so its frame is closed in expanded_macro
+            expanding_va_opt = token_spelling(macrodef) == "__VA_OPT__";
+            if (sink->skips_to_target(macrocall)) {
+                skip_expansion();
+                return false;
             }
 
-            auto full_call = ContainerT(seqstart, seqend);
-            full_call.push_front(macrocall);
-            full_call.push_back(*seqend);
-            full_call = sanitize(full_call);
-            
-            if (!debug) {
-                sink->on_expand_function(ctx, macrodef, sanitized_arguments, full_call);
-            } else {
-                std::cout << "F: ";
-                print_token_container(std::cout, full_call) << std::endl;
+            auto call_view = sanitized_view<IteratorT>(seqstart, seqend, &macrocall);
+            std::size_t call_size = 0;
+            {
+                auto paused = state->profiler.pause();
+
+                if (!wants_payloads()) {
+                    // Nobody will look at the tokens, so only keep the call name for the expansion stack
+                    state->expanding.push_back(state->tokens.store(macrocall));
+                    sink->on_expand_function(ctx, macrodef, sanitized_arguments<ContainerT>(), sanitized(state->range(state->expanding.back())));
+                    if (state->profiler.is_enabled()) call_size = call_view.size() + !should_skip_token(*seqend);
+                } else {
+                    // The call is copied exactly once, already sanitized, because it outlives this hook
+                    // on the expansion stack; everything handed to the client is a view
+                    auto start = state->tokens.mark();
+                    state->tokens.append(call_view.begin(), call_view.end());
+                    if (!should_skip_token(*seqend)) state->tokens.push_back(*seqend);
+                    state->expanding.push_back(state->tokens.since(start));
+
+                    auto call = state->range(state->expanding.back());
+                    call_size = call.size();
+                    if (!debug) {
+                        sink->on_expand_function(ctx, macrodef, sanitized_arguments<ContainerT>(arguments), sanitized(call));
+                    } else {
+                        sink->count_event(preprocessing_event_type::CALL);
+                        std::cout << "F: ";
+                        print_token_container(std::cout, call) << std::endl;
+                    }
+                }
             }
 
-            state->expanding.push_back(full_call);
-
+            // The frame opens after the hook's own work so only Wave's time is charged to the macro.
+            // A __VA_OPT__ is part of the macro it appears in, which keeps its time.
+            if (!expanding_va_opt) state->profiler.enter(state->symbols.intern_token(macrocall), call_size);
             return false;
         }
 
@@ -84,15 +121,25 @@ namespace ppstep {
                 ContextT& ctx, TokenT const& macrodef,
                 ContainerT const& definition, TokenT const& macrocall) {
             if (evaluating_conditional || (fatal_error_occurred && !continue_on_error) || state->disable_printing) return false;
-            
-            if (!debug) {
-                sink->on_expand_object(ctx, macrocall);
-            } else {
-                std::cout << "O: ";
-                print_token(std::cout, macrocall) << std::endl;
+            if (sink->skips_to_target(macrocall)) {
+                skip_expansion();
+                return false;
+            }
+
+            {
+                auto paused = state->profiler.pause();
+                state->expanding.push_back(state->tokens.store(macrocall));
+
+                if (!debug) {
+                    sink->on_expand_object(ctx, macrocall);
+                } else {
+                    sink->count_event(preprocessing_event_type::CALL);
+                    std::cout << "O: ";
+                    print_token(std::cout, macrocall) << std::endl;
+                }
             }
 
-            state->expanding.push_back({macrocall});
+            state->profiler.enter(state->symbols.intern_token(macrocall), 1);
             return false;
         }
 
@@ -101,44 +148,56 @@ namespace ppstep {
             if (evaluating_conditional || (fatal_error_occurred && !continue_on_error) || state->disable_printing) return;
 
             if (state->expanding.empty()) {
-                std::cerr << "⚠️  Warning: expanded_macro called with empty expanding stack" << std::endl;
+                sink->diagnostic_stream() << "⚠️  Warning: expanded_macro called with empty expanding stack" << std::endl;
                 return;
             }
 
-            auto const& initial = *(state->expanding.rbegin());
+            auto va_opt = expanding_va_opt;
+            expanding_va_opt = false;
 
-            // Get the macro name being expanded (first token in initial)
-            std::string expanding_macro_name;
-            if (!initial.empty()) {
-                expanding_macro_name = initial.front().get_value().c_str();
+            if (state->expanding.back().size == 0) {
+                // Skipped while fast-forwarding: move it to the rescan stack and nothing else
+                if (!va_opt) state->rescanning.emplace_back(state->expanding.back(), state->expanding.back());
+                state->expanding.pop_back();
+                sink->count_event(preprocessing_event_type::EXPANDED);
+                return;
             }
 
+            auto paused = state->profiler.pause();
+            if (state->profiler.is_enabled() && !va_opt) state->profiler.expanded(sanitized(result).size());
+
+            auto initial = state->range(state->expanding.back());
+
+            // Get the macro being expanded (first token in initial)
+            auto expanding_macro = initial.empty() ? no_symbol : state->symbols.intern_token(initial.front());
+
             // Check for unexpanded macros in the result
-            std::vector<std::string> unexpanded;
+            std::vector<symbol_id> unexpanded;
             for (auto const& tok : result) {
-                if (is_unexpanded_macro(tok)) {
-                    std::string name = tok.get_value().c_str();
-                    // Skip the macro being expanded itself (it's expected to be consumed)
-                    if (name == expanding_macro_name) {
-                        continue;
-                    }
-                    // Avoid duplicates in the same expansion
-                    if (std::find(unexpanded.begin(), unexpanded.end(), name) == unexpanded.end()) {
-                        unexpanded.push_back(name);
-                    }
+                auto symbol = unexpanded_macro_symbol(tok);
+                // Skip the macro being expanded itself (it's expected to be consumed)
+                if (symbol == no_symbol || symbol == expanding_macro) {
+                    continue;
+                }
+                // Avoid duplicates in the same expansion
+                if (std::find(unexpanded.begin(), unexpanded.end(), symbol) == unexpanded.end()) {
+                    unexpanded.push_back(symbol);
                 }
             }
 
             // Report unexpanded macros as errors
-            if (!unexpanded.empty() && !debug && sink) {
-                for (auto const& name : unexpanded) {
+            if (!unexpanded.empty() && reports_errors()) {
+                auto expanding_macro_name = std::string(state->symbols.name(expanding_macro));
+
+                for (auto symbol : unexpanded) {
+                    auto name = state->symbols.name(symbol);
+
                     // Try to get position from the first token in result
                     std::string file = "<unknown>";
                     int line = 0;
 
                     for (auto const& tok : result) {
-                        std::string tok_value = tok.get_value().c_str();
-                        if (tok_value == name) {
+                        if (token_spelling(tok) == name) {
                             try {
                                 auto pos = tok.get_position();
                                 file = pos.get_file().c_str();
@@ -148,23 +207,36 @@ namespace ppstep {
                         }
                     }
 
-                    std::string error_msg = "Undefined sub-macro '" + name + "' found in expansion of '" +
+                    std::string error_msg = "Undefined sub-macro '" + std::string(name) + "' found in expansion of '" +
                                           expanding_macro_name + "' (macro not defined or misspelled)";
                     sink->on_error(error_msg, file, line);
                 }
             }
 
             if (!debug) {
-                sink->on_expanded(ctx, sanitize(initial), sanitize(result));
+                sink->on_expanded(ctx, sanitized(initial), sanitized(result));
             } else {
+                sink->count_event(preprocessing_event_type::EXPANDED);
                 std::cout << "E: ";
-                print_token_container(std::cout, sanitize(initial)) << " -> ";
-                print_token_container(std::cout, sanitize(result)) << std::endl;
+                print_token_container(std::cout, initial) << " -> ";
+                print_token_container(std::cout, sanitized(result)) << std::endl;
             }
 
-            state->rescanning.push_back({initial, result});
-
+            // The call moves over to the rescan stack; the result is only kept when someone will read it.
+            // Appending may move the arena, so this happens after the last use of `initial`.
+            auto cause = state->expanding.back();
             state->expanding.pop_back();
+            if (va_opt) {
+                // Nothing was stored after the __VA_OPT__ frame, so it is still the top of the arena
+                state->tokens.rewind(cause);
+                return;
+            }
+            auto kept = state->tokens.mark();
+            if (wants_payloads()) {
+                auto view = sanitized(result);
+                state->tokens.append(view.begin(), view.end());
+            }
+            state->rescanning.emplace_back(cause, state->tokens.since(kept));
         }
 
         template <typename ContextT>
@@ -172,21 +244,39 @@ namespace ppstep {
             if (evaluating_conditional || (fatal_error_occurred && !continue_on_error) || state->disable_printing) return;
 
             if (state->rescanning.empty()) {
-                std::cerr << "⚠️  Warning: rescanned_macro called with empty rescanning stack" << std::endl;
+                sink->diagnostic_stream() << "⚠️  Warning: rescanned_macro called with empty rescanning stack" << std::endl;
+                return;
+            }
+
+            auto [cause, initial] = state->rescanning.back();
+            if (cause.size == 0) {
+                // Skipped while fast-forwarding; the profiler never saw it either
+                sink->count_event(preprocessing_event_type::RESCANNED);
+                state->rescanning.pop_back();
+                if (state->expanding.empty() && state->rescanning.empty()) state->tokens.reset();
                 return;
             }
 
-            auto const& [cause, initial] = *(state->rescanning.rbegin());
+            // Close the frame before doing any work of our own
+            state->profiler.rescanned();
+            auto paused = state->profiler.pause();
 
             if (!debug) {
-                sink->on_rescanned(ctx, sanitize(cause), sanitize(initial), sanitize(result));
+                sink->on_rescanned(ctx, sanitized(state->range(cause)), sanitized(state->range(initial)), sanitized(result));
             } else {
+                sink->count_event(preprocessing_event_type::RESCANNED);
                 std::cout << "R: ";
-                print_token_container(std::cout, sanitize(initial)) << " -> ";
-                print_token_container(std::cout, sanitize(result)) << std::endl;
+                print_token_container(std::cout, state->range(initial)) << " -> ";
+                print_token_container(std::cout, sanitized(result)) << std::endl;
             }
 
+            // Everything stored after the call belonged to expansions nested inside it
             state->rescanning.pop_back();
+            if (state->expanding.empty() && state->rescanning.empty()) {
+                state->tokens.reset();
+            } else {
+                state->tokens.rewind(cause);
+            }
         }
         
         template <typename ContextT>
@@ -219,30 +309,65 @@ namespace ppstep {
         template <typename ContextT, typename ParametersT, typename DefinitionT>
         void defined_macro(ContextT const& ctx, TokenT const& macro_name, bool is_functionlike, ParametersT const& parameters,
                            DefinitionT const& definition, bool is_predefined) {
-            std::string name = macro_name.get_value().c_str();
-            defined_macros.insert(name);
+            defined_macros.insert(state->symbols.intern_token(macro_name));
         }
 
         template <typename ContextT>
         void undefined_macro(ContextT const& ctx, TokenT const& macro_name) {
-            std::string name = macro_name.get_value().c_str();
-            defined_macros.erase(name);
+            defined_macros.erase(state->symbols.find_token(macro_name));
+        }
+
+        // Called by the load_file_cached input policy for every included file
+        void loaded_file(bool cache_hit) {
+            sink->count_file_load(cache_hit);
+        }
+
+        // Called for every include when a token cache is configured
+        void replayed_tokens(bool cache_hit) {
+            sink->count_token_load(cache_hit);
+        }
+
+        // While running to a target, a call only gets an empty frame so that the
+        // expanded and rescanned hooks further up stay balanced. Real frames always
+        // hold at least the macro name, so an empty one marks a skipped call. Skipped
+        // events are still counted for the session summary.
+        void skip_expansion() {
+            state->expanding.push_back(state->tokens.since(state->tokens.mark()));
+            sink->count_event(preprocessing_event_type::CALL);
         }
 
         // Check if a token looks like it should be a macro but isn't defined
         inline bool is_unexpanded_macro(TokenT const& token) {
+            return unexpanded_macro_symbol(token) != no_symbol;
+        }
+
+        // Symbol of an identifier that looks like an undefined macro, or no_symbol. The
+        // naming heuristic only ever runs once per spelling.
+        inline symbol_id unexpanded_macro_symbol(TokenT const& token) {
             // Must be an identifier
             if (!IS_CATEGORY(token, boost::wave::IdentifierTokenType)) {
-                return false;
+                return no_symbol;
             }
 
-            std::string value = token.get_value().c_str();
+            auto value = token_spelling(token);
+            if (value.empty()) {
+                return no_symbol;
+            }
 
-            // Empty or already defined
-            if (value.empty() || defined_macros.count(value) > 0) {
-                return false;
+            auto symbol = state->symbols.intern(value);
+            if (defined_macros.contains(symbol)) {
+                return no_symbol;
+            }
+
+            if (!classified_names.contains(symbol)) {
+                classified_names.insert(symbol);
+                if (looks_like_macro_name(value)) macro_like_names.insert(symbol);
             }
 
+            return macro_like_names.contains(symbol) ? symbol : no_symbol;
+        }
+
+        static bool looks_like_macro_name(std::string_view value) {
             // Check for macro-like naming patterns:
             // 1. All uppercase with underscores (MACRO_NAME, NOTHING_)
             // 2. Ends with underscore (common macro pattern)
@@ -254,11 +379,11 @@ namespace ppstep {
             int alpha_count = 0;
 
             for (char c : value) {
-                if (std::isupper(c)) {
+                if (std::isupper(static_cast<unsigned char>(c))) {
                     has_upper = true;
                     upper_count++;
                 }
-                if (std::isalpha(c)) {
+                if (std::isalpha(static_cast<unsigned char>(c))) {
                     alpha_count++;
                 }
                 if (c == '_') {
@@ -289,32 +414,51 @@ namespace ppstep {
         void lexed_token(ContextT& ctx, TokenT const& result) {
             if (should_skip_token(result)) return;
             if ((fatal_error_occurred && !continue_on_error) || state->disable_printing) return;
+            if (sink->skips_to_target(result)) {
+                sink->count_event(preprocessing_event_type::LEXED);
+                return;
+            }
 
             if (!debug) {
                 sink->on_lexed(ctx, result);
             } else {
+                sink->count_event(preprocessing_event_type::LEXED);
                 std::cout << "L: ";
                 print_token(std::cout, result) << std::endl;
             }
         }
         
+        // Set by compile database runs to keep the error logs of their units apart
+        void set_log_tag(std::string tag) {
+            log_tag = std::move(tag);
+        }
+
         template <typename ContextT, typename ExceptionT>
         void dump_error_to_log(ContextT& ctx, ExceptionT const& e) {
             auto now = std::chrono::system_clock::now();
             auto time_t = std::chrono::system_clock::to_time_t(now);
+            std::tm local_time{};
+            localtime_r(&time_t, &local_time);
             std::stringstream log_filename;
-            log_filename << "ppstep_error_" << std::put_time(std::localtime(&time_t), "%Y%m%d_%H%M%S") << ".log";
+            // Name the log after the input, with a hash of its full path so same-named files
+            // in different directories differ, and the unit index when a compile database
+            // runs the same file more than once
+            auto stem = main_input_file.substr(main_input_file.find_last_of("/\\") + 1);
+            auto path_hash = static_cast<std::uint32_t>(hash_bytes(main_input_file.data(), main_input_file.size()));
+            log_filename << "ppstep_error_" << stem << '_' << std::hex << std::setw(8) << std::setfill('0') << path_hash << std::dec;
+            if (!log_tag.empty()) log_filename << '_' << log_tag;
+            log_filename << '_' << std::put_time(&local_time, "%Y%m%d_%H%M%S") << ".log";
             
             std::ofstream log(log_filename.str());
             if (!log.is_open()) {
-                std::cerr << "ERROR: Could not create log file: " << log_filename.str() << std::endl;
+                sink->diagnostic_stream() << "ERROR: Could not create log file: " << log_filename.str() << std::endl;
                 return;
             }
             
             log << "========================================" << std::endl;
             log << "PPSTEP PREPROCESSING ERROR LOG" << std::endl;
             log << "========================================" << std::endl;
-            log << "Timestamp: " << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S") << std::endl;
+            log << "Timestamp: " << std::put_time(&local_time, "%Y-%m-%d %H:%M:%S") << std::endl;
             log << std::endl;
             
             std::string error_msg = "<unknown>";
@@ -349,7 +493,7 @@ namespace ppstep {
             
             log.close();
             
-            std::cerr << "Full error context written to: " << log_filename.str() << std::endl;
+            sink->diagnostic_stream() << "Full error context written to: " << log_filename.str() << std::endl;
         }
         
         template <typename ContextT, typename ExceptionT>
@@ -390,10 +534,16 @@ namespace ppstep {
 
             // Always record the error in the trace (if recording is active)
             // This captures errors from all files, not just the main input file
-            if (!debug && sink) {
+            if (reports_errors()) {
                 sink->on_error(error_msg, error_file, error_line);
             }
 
+            // start() runs before Wave has set the main position, so it may not know the input yet
+            if (main_input_file.empty()) {
+                auto const& file = ctx.get_main_pos().get_file();
+                main_input_file = std::string(file.begin(), file.end());
+            }
+
             // Only create separate error log files for main input file errors
             if (main_input_file.empty() || error_file != main_input_file) {
                 return false;
@@ -426,7 +576,7 @@ namespace ppstep {
             if (debug) return;
             
             if (state->disable_printing && !continue_on_error) {
-                std::cerr << "\n⚠️  Preprocessing stopped due to error - output may be incomplete" << std::endl;
+                sink->diagnostic_stream() << "\n⚠️  Preprocessing stopped due to error - output may be incomplete" << std::endl;
                 return;
             }
 
@@ -441,8 +591,12 @@ namespace ppstep {
         unsigned int conditional_nesting;
         bool evaluating_conditional;
         bool fatal_error_occurred;
+        bool expanding_va_opt;
         std::string main_input_file;
-        std::unordered_set<std::string> defined_macros;
+        std::string log_tag;
+        symbol_set defined_macros;
+        symbol_set classified_names;
+        symbol_set macro_like_names;
     };
 }
 
@@ -0,0 +1,168 @@
+#ifndef PPSTEP_SOURCE_CACHE_HPP
+#define PPSTEP_SOURCE_CACHE_HPP
+
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#include <boost/wave/cpp_exceptions.hpp>
+#include <boost/wave/language_support.hpp>
+
+#include "mapped_file.hpp"
+#include "symbol_table.hpp"
+#include "token_cache.hpp"
+
+namespace ppstep {
+    // Process-wide cache of source file contents, shared by every session and worker
+    // thread. Entries are keyed by canonical path and checked against the file's mtime
+    // and size on every lookup, so an edited header is simply loaded again.
+    struct source_cache {
+        using content_type = std::shared_ptr<mapped_file const>;
+
+        static source_cache& shared() {
+            static source_cache cache;
+            return cache;
+        }
+
+        // Returns nullptr if the file cannot be read. Pipes and other special files are
+        // read every time and never cached. Given `hash`, also hashes the contents, once
+        // per cached version of the file.
+        content_type acquire(char const* path, bool& hit, std::uint64_t* hash = nullptr) {
+            hit = false;
+
+            struct stat info;
+            if (::stat(path, &info) != 0) return nullptr;
+            if (!S_ISREG(info.st_mode)) {
+                auto content = load(path);
+                if (content && hash) *hash = hash_bytes(content->begin(), content->size());
+                return content;
+            }
+
+            auto key = canonical(path);
+            auto stamp = file_stamp{modified_ns(info), static_cast<std::uint64_t>(info.st_size)};
+            auto content = content_type();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = entries.find(key);
+                if (it != entries.end() && it->second.stamp == stamp) {
+                    hit = true;
+                    if (!hash) return it->second.content;
+                    if (it->second.hashed) {
+                        *hash = it->second.hash;
+                        return it->second.content;
+                    }
+                    content = it->second.content;
+                }
+            }
+
+            // Loaded and hashed outside the lock; if two threads race on the same file both
+            // copies are valid
+            if (!content) content = load(path);
+            if (!content) return nullptr;
+            auto fresh = entry{stamp, content, 0, hash != nullptr};
+            if (hash) *hash = fresh.hash = hash_bytes(content->begin(), content->size());
+
+            std::lock_guard<std::mutex> lock(mutex);
+            entries[key] = fresh;
+            return content;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+        }
+
+    private:
+        struct file_stamp {
+            std::uint64_t modified_ns;
+            std::uint64_t size;
+
+            friend bool operator==(file_stamp const& a, file_stamp const& b) {
+                return a.modified_ns == b.modified_ns && a.size == b.size;
+            }
+        };
+
+        struct entry {
+            file_stamp stamp;
+            content_type content;
+            std::uint64_t hash;  // of the contents, once `hashed`
+            bool hashed;
+        };
+
+        static content_type load(char const* path) {
+            auto file = std::make_shared<mapped_file>();
+            if (!file->open(path)) return nullptr;
+            return file;
+        }
+
+        static std::string canonical(char const* path) {
+            char resolved[PATH_MAX];
+            return ::realpath(path, resolved) ? std::string(resolved) : std::string(path);
+        }
+
+        static std::uint64_t modified_ns(struct stat const& info) {
+#if defined(__APPLE__)
+            auto const& modified = info.st_mtimespec;
+#else
+            auto const& modified = info.st_mtim;
+#endif
+            return static_cast<std::uint64_t>(modified.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(modified.tv_nsec);
+        }
+
+        std::mutex mutex;
+        std::unordered_map<std::string, entry> entries;
+    };
+
+    // Wave input policy that lexes included files straight out of the shared source
+    // cache, or replays their tokens from the token cache when one is configured. The
+    // context's hooks are told about every load, so sessions can report cache hits and
+    // misses.
+    struct load_file_cached {
+        template <class IterContextT>
+        class inner {
+        public:
+            template <class PositionT>
+            static void init_iterators(IterContextT& iter_ctx, PositionT const& act_pos, boost::wave::language_support language) {
+                using iterator_type = typename IterContextT::iterator_type;
+
+                auto& tokens = token_cache::shared();
+                bool hit = false;
+                std::uint64_t hash = 0;
+                iter_ctx.source = source_cache::shared().acquire(iter_ctx.filename.c_str(), hit, tokens.is_enabled() ? &hash : nullptr);
+                if (!iter_ctx.source) {
+                    BOOST_WAVE_THROW_CTX(iter_ctx.ctx, boost::wave::preprocess_exception,
+                        bad_include_file, iter_ctx.filename.c_str(), act_pos);
+                    return;
+                }
+                iter_ctx.ctx.get_hooks().loaded_file(hit);
+
+                if (tokens.is_enabled()) {
+                    auto key = token_cache_key::of(*iter_ctx.source, hash, language);
+                    if (auto blob = tokens.find(key)) {
+                        auto input = token_replay_input{std::move(*blob)};
+                        iter_ctx.first = iterator_type(input, input, PositionT(iter_ctx.filename), language);
+                        iter_ctx.ctx.get_hooks().replayed_tokens(true);
+                    } else {
+                        auto input = token_recording_input{iter_ctx.source->begin(), iter_ctx.source->end(), key};
+                        iter_ctx.first = iterator_type(input, input, PositionT(iter_ctx.filename), language);
+                        iter_ctx.ctx.get_hooks().replayed_tokens(false);
+                    }
+                } else {
+                    iter_ctx.first = iterator_type(iter_ctx.source->begin(), iter_ctx.source->end(), PositionT(iter_ctx.filename), language);
+                }
+                iter_ctx.last = iterator_type();
+            }
+
+        private:
+            source_cache::content_type source;
+        };
+    };
+}
+
+#endif // PPSTEP_SOURCE_CACHE_HPP
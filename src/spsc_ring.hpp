@@ -0,0 +1,76 @@
+#ifndef PPSTEP_SPSC_RING_HPP
+#define PPSTEP_SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace ppstep {
+    // Bounded single-producer, single-consumer queue over reusable slots. The producer
+    // fills the slot try_claim hands out and publishes it; the consumer reads front()
+    // and pops it. Slots are never destroyed, so whatever storage a slot has grown stays
+    // around for the next item. Each side caches the other's index and only reloads it
+    // when the ring looks full or empty, so the indices' cache lines bounce only then.
+    template <class T>
+    struct spsc_ring {
+        explicit spsc_ring(std::size_t capacity) : slots(round_up(capacity)), mask(slots.size() - 1), head(0), tail_seen(0), tail(0), head_seen(0) {}
+
+        spsc_ring(spsc_ring const&) = delete;
+        spsc_ring& operator=(spsc_ring const&) = delete;
+
+        // Producer: the next free slot, or nullptr while the ring is full
+        T* try_claim() {
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t - head_seen == slots.size()) {
+                head_seen = head.load(std::memory_order_acquire);
+                if (t - head_seen == slots.size()) return nullptr;
+            }
+            return &slots[t & mask];
+        }
+
+        // Producer: hands the claimed slot over. Sequentially consistent, so a consumer
+        // that announces it is going to sleep and then looks again cannot miss it.
+        void publish() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+        }
+
+        // Consumer: the oldest published slot, or nullptr while the ring is empty
+        T* front() {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h == tail_seen) {
+                tail_seen = tail.load(std::memory_order_seq_cst);
+                if (h == tail_seen) return nullptr;
+            }
+            return &slots[h & mask];
+        }
+
+        // Consumer: releases the slot front() returned
+        void pop() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        std::size_t capacity() const {
+            return slots.size();
+        }
+
+    private:
+        static std::size_t round_up(std::size_t n) {
+            std::size_t size = 1;
+            while (size < n) size <<= 1;
+            return size;
+        }
+
+        std::vector<T> slots;
+        std::size_t mask;
+
+        // Consumer side
+        alignas(64) std::atomic<std::size_t> head;
+        std::size_t tail_seen;
+
+        // Producer side
+        alignas(64) std::atomic<std::size_t> tail;
+        std::size_t head_seen;
+    };
+}
+
+#endif // PPSTEP_SPSC_RING_HPP
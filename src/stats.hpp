@@ -0,0 +1,62 @@
+#ifndef PPSTEP_STATS_HPP
+#define PPSTEP_STATS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <algorithm>
+
+namespace ppstep {
+    // Aggregate counters for one preprocessing session, reported by batch runs
+    struct session_stats {
+        session_stats() : lexed(0), calls(0), expansions(0), rescans(0), errors(0), max_depth(0), file_cache_hits(0), file_cache_misses(0), token_cache_hits(0), token_cache_misses(0), elapsed() {}
+
+        session_stats& operator+=(session_stats const& other) {
+            lexed += other.lexed;
+            calls += other.calls;
+            expansions += other.expansions;
+            rescans += other.rescans;
+            errors += other.errors;
+            max_depth = std::max(max_depth, other.max_depth);
+            file_cache_hits += other.file_cache_hits;
+            file_cache_misses += other.file_cache_misses;
+            token_cache_hits += other.token_cache_hits;
+            token_cache_misses += other.token_cache_misses;
+            elapsed += other.elapsed;
+            return *this;
+        }
+
+        void print(std::ostream& os) const {
+            auto ms = std::chrono::duration<double, std::milli>(elapsed).count();
+
+            os << "=== PPSTEP SUMMARY ===" << '\n';
+            os << "Lexed tokens: " << lexed << '\n';
+            os << "Macro calls:  " << calls << '\n';
+            os << "Expansions:   " << expansions << '\n';
+            os << "Rescans:      " << rescans << '\n';
+            os << "Max depth:    " << max_depth << '\n';
+            os << "Errors:       " << errors << '\n';
+            os << "File cache:   " << file_cache_hits << " hits, " << file_cache_misses << " misses" << '\n';
+            if (token_cache_hits + token_cache_misses > 0) {
+                os << "Token cache:  " << token_cache_hits << " hits, " << token_cache_misses << " misses" << '\n';
+            }
+            os << "Elapsed:      " << std::fixed << std::setprecision(2) << ms << " ms" << '\n';
+            os << "======================" << std::endl;
+        }
+
+        std::size_t lexed;
+        std::size_t calls;
+        std::size_t expansions;
+        std::size_t rescans;
+        std::size_t errors;
+        std::size_t max_depth;
+        std::size_t file_cache_hits;
+        std::size_t file_cache_misses;
+        std::size_t token_cache_hits;
+        std::size_t token_cache_misses;
+        std::chrono::steady_clock::duration elapsed;
+    };
+}
+
+#endif // PPSTEP_STATS_HPP
@@ -0,0 +1,142 @@
+#ifndef PPSTEP_SYMBOL_TABLE_HPP
+#define PPSTEP_SYMBOL_TABLE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ppstep {
+    using symbol_id = std::uint32_t;
+
+    constexpr symbol_id no_symbol = ~symbol_id(0);
+
+    inline std::uint64_t hash_bytes(char const* data, std::size_t size) {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (std::size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // Wave token values are flex_strings; view them in place instead of converting
+    template <class TokenT>
+    inline std::string_view token_spelling(TokenT const& token) {
+        auto const& value = token.get_value();
+        return std::string_view(value.c_str(), value.size());
+    }
+
+    // Maps identifier spellings to dense integer IDs. The table is open-addressed over
+    // the raw bytes, so probing with a token's value never allocates; only the first
+    // intern of a spelling copies it.
+    struct symbol_table {
+        symbol_table() : slots(64, no_symbol), names(), hashes() {}
+
+        symbol_id intern(std::string_view name) {
+            auto hash = hash_bytes(name.data(), name.size());
+            auto slot = probe(name, hash);
+            if (slots[slot] != no_symbol) return slots[slot];
+
+            auto id = static_cast<symbol_id>(names.size());
+            names.emplace_back(name);
+            hashes.push_back(hash);
+            slots[slot] = id;
+
+            if (names.size() * 2 > slots.size()) grow();
+            return id;
+        }
+
+        symbol_id find(std::string_view name) const {
+            return slots[probe(name, hash_bytes(name.data(), name.size()))];
+        }
+
+        template <class TokenT>
+        symbol_id intern_token(TokenT const& token) {
+            return intern(token_spelling(token));
+        }
+
+        template <class TokenT>
+        symbol_id find_token(TokenT const& token) const {
+            return find(token_spelling(token));
+        }
+
+        std::string_view name(symbol_id id) const {
+            return id < names.size() ? std::string_view(names[id]) : std::string_view();
+        }
+
+        std::size_t size() const {
+            return names.size();
+        }
+
+    private:
+        std::size_t probe(std::string_view name, std::uint64_t hash) const {
+            auto mask = slots.size() - 1;
+            for (auto slot = static_cast<std::size_t>(hash) & mask;; slot = (slot + 1) & mask) {
+                auto id = slots[slot];
+                if (id == no_symbol || (hashes[id] == hash && names[id] == name)) return slot;
+            }
+        }
+
+        void grow() {
+            auto resized = std::vector<symbol_id>(slots.size() * 2, no_symbol);
+            auto mask = resized.size() - 1;
+            for (symbol_id id = 0; id < names.size(); ++id) {
+                auto slot = static_cast<std::size_t>(hashes[id]) & mask;
+                while (resized[slot] != no_symbol) slot = (slot + 1) & mask;
+                resized[slot] = id;
+            }
+            slots = std::move(resized);
+        }
+
+        std::vector<symbol_id> slots;
+        std::deque<std::string> names;  // deque keeps spellings at stable addresses
+        std::vector<std::uint64_t> hashes;
+    };
+
+    // Dense bitset over symbol IDs
+    struct symbol_set {
+        symbol_set() : words(), count(0) {}
+
+        void insert(symbol_id id) {
+            if (id == no_symbol) return;
+            auto word = id / 64;
+            if (word >= words.size()) words.resize(word + 1, 0);
+            auto bit = std::uint64_t(1) << (id % 64);
+            if (!(words[word] & bit)) ++count;
+            words[word] |= bit;
+        }
+
+        void erase(symbol_id id) {
+            if (!contains(id)) return;
+            words[id / 64] &= ~(std::uint64_t(1) << (id % 64));
+            --count;
+        }
+
+        bool contains(symbol_id id) const {
+            auto word = id / 64;
+            return id != no_symbol && word < words.size() && (words[word] >> (id % 64)) & 1;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        std::size_t size() const {
+            return count;
+        }
+
+        void clear() {
+            words.clear();
+            count = 0;
+        }
+
+    private:
+        std::vector<std::uint64_t> words;
+        std::size_t count;
+    };
+}
+
+#endif // PPSTEP_SYMBOL_TABLE_HPP
@@ -0,0 +1,105 @@
+#ifndef PPSTEP_TOKEN_ARENA_HPP
+#define PPSTEP_TOKEN_ARENA_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace ppstep {
+    // A run of tokens inside a token_arena. Spans are plain offsets, so they stay valid
+    // when the arena grows.
+    struct token_span {
+        std::uint32_t first;
+        std::uint32_t size;
+    };
+
+    // Contiguous tokens of one span. Only valid until the arena is next appended to.
+    template <class TokenT>
+    struct token_range {
+        using value_type = TokenT;
+        using const_iterator = TokenT const*;
+
+        TokenT const* begin() const {
+            return first;
+        }
+
+        TokenT const* end() const {
+            return last;
+        }
+
+        std::size_t size() const {
+            return static_cast<std::size_t>(last - first);
+        }
+
+        bool empty() const {
+            return first == last;
+        }
+
+        TokenT const& front() const {
+            return *first;
+        }
+
+        TokenT const* first;
+        TokenT const* last;
+    };
+
+    // Bump storage for the tokens on the server's expansion stacks. Tokens are appended
+    // at the end and released by rewinding to the start of a span, which drops it along
+    // with everything appended after it. Expansions nest strictly, so by the time a
+    // frame is popped every frame pushed after it is already gone, and the storage
+    // behaves like a stack that never frees memory back to the allocator.
+    template <class TokenT>
+    struct token_arena {
+        token_arena() : tokens() {}
+
+        std::uint32_t mark() const {
+            return static_cast<std::uint32_t>(tokens.size());
+        }
+
+        void push_back(TokenT const& token) {
+            tokens.push_back(token);
+        }
+
+        template <class IteratorT>
+        void append(IteratorT first, IteratorT last) {
+            tokens.insert(tokens.end(), first, last);
+        }
+
+        // Everything appended since the mark
+        token_span since(std::uint32_t mark) const {
+            return {mark, static_cast<std::uint32_t>(tokens.size()) - mark};
+        }
+
+        token_span store(TokenT const& token) {
+            auto start = mark();
+            push_back(token);
+            return since(start);
+        }
+
+        // Clamped to what the arena holds, so a span that was rewound away reads as empty
+        token_range<TokenT> range(token_span span) const {
+            auto first = std::min<std::size_t>(span.first, tokens.size());
+            auto last = std::min<std::size_t>(first + span.size, tokens.size());
+            return {tokens.data() + first, tokens.data() + last};
+        }
+
+        void rewind(token_span span) {
+            if (span.first < tokens.size()) tokens.erase(tokens.begin() + span.first, tokens.end());
+        }
+
+        // Capacity is kept, so a session only allocates while its deepest expansion grows
+        void reset() {
+            tokens.clear();
+        }
+
+        std::size_t size() const {
+            return tokens.size();
+        }
+
+    private:
+        std::vector<TokenT> tokens;
+    };
+}
+
+#endif // PPSTEP_TOKEN_ARENA_HPP
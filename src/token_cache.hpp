@@ -0,0 +1,402 @@
+#ifndef PPSTEP_TOKEN_CACHE_HPP
+#define PPSTEP_TOKEN_CACHE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/wave/language_support.hpp>
+#include <boost/wave/token_ids.hpp>
+#include <boost/wave/cpplexer/cpp_lex_interface.hpp>
+#include <boost/wave/cpplexer/cpp_lex_interface_generator.hpp>
+#include <boost/wave/cpplexer/detect_include_guards.hpp>
+
+#include "mapped_file.hpp"
+#include "symbol_table.hpp"
+
+namespace ppstep {
+    // Identifies one lexed token stream: the exact bytes of a file, lexed with one set of
+    // language flags
+    struct token_cache_key {
+        std::uint64_t content_hash;
+        std::uint64_t content_size;
+        std::uint32_t language;
+
+        static token_cache_key of(mapped_file const& content, boost::wave::language_support language) {
+            return of(content, hash_bytes(content.begin(), content.size()), language);
+        }
+
+        // For contents whose hash is already known, as the source cache keeps it
+        static token_cache_key of(mapped_file const& content, std::uint64_t content_hash, boost::wave::language_support language) {
+            return {content_hash, content.size(), static_cast<std::uint32_t>(language)};
+        }
+
+        friend bool operator<(token_cache_key const& a, token_cache_key const& b) {
+            return std::tie(a.content_hash, a.content_size, a.language) < std::tie(b.content_hash, b.content_size, b.language);
+        }
+
+        std::string file_name() const {
+            std::ostringstream name;
+            name << std::hex << std::setfill('0') << std::setw(16) << content_hash << '-' << std::setw(8) << language << ".tok";
+            return name.str();
+        }
+    };
+
+    // Cache file layout, in native byte order:
+    //
+    //   token_cache_header
+    //   string_count x (u32 size, bytes)   distinct token spellings
+    //   token_count x token_record         the stream, up to and including T_EOF
+    //
+    // File names are not stored; a replayed stream takes the name of whichever file it
+    // was loaded for.
+    struct token_cache_header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t language;
+        std::uint64_t content_hash;
+        std::uint64_t content_size;
+        std::uint32_t string_count;
+        std::uint32_t token_count;
+    };
+
+    struct token_record {
+        std::uint32_t id;
+        std::uint32_t value;
+        std::uint32_t line;
+        std::uint32_t column;
+    };
+
+    constexpr char token_cache_magic[8] = {'P', 'P', 'S', 'T', 'T', 'O', 'K', '\0'};
+    constexpr std::uint32_t token_cache_version = 1;
+
+    // Token IDs the re2c lexer produces; anything else would send Wave past the end of
+    // its tables
+    inline bool is_lexed_token_id(std::uint32_t id) {
+        using namespace boost::wave;
+        auto base = static_cast<std::uint32_t>(BASEID_FROM_TOKEN(id));
+        return (base >= T_FIRST_TOKEN && base < T_LAST_TOKEN) || id == T_UNKNOWN_UNIVERSALCHAR;
+    }
+
+    // A validated cache file. Records are read with memcpy since they follow a string
+    // table of arbitrary length. A file that does not hold up is treated as a miss and
+    // lexed again.
+    struct token_blob {
+        static std::optional<token_blob> parse(std::shared_ptr<mapped_file const> file, token_cache_key const& key) {
+            auto data = file->begin();
+            auto size = file->size();
+
+            token_cache_header header;
+            if (size < sizeof(header)) return {};
+            std::memcpy(&header, data, sizeof(header));
+            if (std::memcmp(header.magic, token_cache_magic, sizeof(header.magic)) != 0
+                || header.version != token_cache_version
+                || header.language != key.language
+                || header.content_hash != key.content_hash
+                || header.content_size != key.content_size) return {};
+
+            // Each string takes at least its length, so the count is checked before reserving
+            auto offset = sizeof(header);
+            if ((size - offset) / sizeof(std::uint32_t) < header.string_count) return {};
+            auto blob = token_blob();
+            blob.strings.reserve(header.string_count);
+            for (std::uint32_t i = 0; i < header.string_count; ++i) {
+                std::uint32_t length;
+                if (size - offset < sizeof(length)) return {};
+                std::memcpy(&length, data + offset, sizeof(length));
+                offset += sizeof(length);
+                if (size - offset < length) return {};
+                blob.strings.emplace_back(data + offset, length);
+                offset += length;
+            }
+
+            if ((size - offset) / sizeof(token_record) < header.token_count) return {};
+            blob.records = data + offset;
+            blob.token_count = header.token_count;
+            for (std::size_t i = 0; i < blob.token_count; ++i) {
+                auto record = blob.record(i);
+                if (record.value >= header.string_count || !is_lexed_token_id(record.id)) return {};
+            }
+            blob.file = std::move(file);
+            return blob;
+        }
+
+        token_record record(std::size_t index) const {
+            token_record record;
+            std::memcpy(&record, records + index * sizeof(token_record), sizeof(record));
+            return record;
+        }
+
+        std::shared_ptr<mapped_file const> file;
+        std::vector<std::string_view> strings;
+        char const* records;
+        std::size_t token_count;
+    };
+
+    // Builds a cache file from a token stream as it is lexed
+    template <class TokenT>
+    struct token_blob_writer {
+        token_blob_writer() : strings(), spellings(), records() {}
+
+        void add(TokenT const& token) {
+            auto const& pos = token.get_position();
+            auto [it, inserted] = strings.try_emplace(std::string(token_spelling(token)), static_cast<std::uint32_t>(spellings.size()));
+            if (inserted) spellings.push_back(&it->first);
+            records.push_back({
+                static_cast<std::uint32_t>(boost::wave::token_id(token)),
+                it->second,
+                static_cast<std::uint32_t>(pos.get_line()),
+                static_cast<std::uint32_t>(pos.get_column())});
+        }
+
+        std::string finish(token_cache_key const& key) const {
+            auto header = token_cache_header();
+            std::memcpy(header.magic, token_cache_magic, sizeof(header.magic));
+            header.version = token_cache_version;
+            header.language = key.language;
+            header.content_hash = key.content_hash;
+            header.content_size = key.content_size;
+            header.string_count = static_cast<std::uint32_t>(spellings.size());
+            header.token_count = static_cast<std::uint32_t>(records.size());
+
+            auto blob = std::string();
+            blob.append(reinterpret_cast<char const*>(&header), sizeof(header));
+            for (auto const* spelling : spellings) {
+                auto length = static_cast<std::uint32_t>(spelling->size());
+                blob.append(reinterpret_cast<char const*>(&length), sizeof(length));
+                blob.append(*spelling);
+            }
+            blob.append(reinterpret_cast<char const*>(records.data()), records.size() * sizeof(token_record));
+            return blob;
+        }
+
+    private:
+        std::unordered_map<std::string, std::uint32_t> strings;
+        std::vector<std::string const*> spellings;  // in index order; node keys never move
+        std::vector<token_record> records;
+    };
+
+    // Process-wide store of lexed include files, persisted in a directory across runs.
+    // Files are only ever written whole and renamed into place, so concurrent runs
+    // sharing a directory see either a complete file or none. Wave tokens are not
+    // thread-safe to share, so only the raw bytes are cached in memory and every
+    // session decodes its own tokens.
+    struct token_cache {
+        static token_cache& shared() {
+            static token_cache cache;
+            return cache;
+        }
+
+        bool set_directory(std::string const& path) {
+            std::error_code error;
+            std::filesystem::create_directories(path, error);
+            if (error || !std::filesystem::is_directory(path)) return false;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            directory = path;
+            return true;
+        }
+
+        bool is_enabled() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return !directory.empty();
+        }
+
+        std::optional<token_blob> find(token_cache_key const& key) {
+            auto path = std::string();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = loaded.find(key);
+                if (it != loaded.end()) return it->second;
+                path = path_of(key);
+            }
+
+            auto file = std::make_shared<mapped_file>();
+            if (!file->open(path.c_str())) return {};
+            auto blob = token_blob::parse(file, key);
+            if (!blob) return {};
+
+            std::lock_guard<std::mutex> lock(mutex);
+            loaded.emplace(key, *blob);
+            return blob;
+        }
+
+        void store(token_cache_key const& key, std::string const& blob) {
+            auto path = std::string();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (directory.empty()) return;
+                path = path_of(key);
+            }
+
+            std::ostringstream temporary;
+            temporary << path << ".tmp." << ::getpid() << '.' << std::hash<std::thread::id>()(std::this_thread::get_id());
+            {
+                std::ofstream out(temporary.str(), std::ios::binary | std::ios::trunc);
+                if (!out.is_open()) return;
+                out.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+                if (!out) {
+                    out.close();
+                    std::remove(temporary.str().c_str());
+                    return;
+                }
+            }
+            if (std::rename(temporary.str().c_str(), path.c_str()) != 0) {
+                std::remove(temporary.str().c_str());
+            }
+        }
+
+    private:
+        token_cache() : mutex(), directory(), loaded() {}
+
+        std::string path_of(token_cache_key const& key) const {
+            return (std::filesystem::path(directory) / key.file_name()).string();
+        }
+
+        mutable std::mutex mutex;
+        std::string directory;
+        std::map<token_cache_key, token_blob> loaded;
+    };
+
+    // Inputs for new_lexer_gen below. Wave builds its lexers from an iterator pair, so
+    // these stand in for the pair and select the lexer to build.
+    struct token_replay_input {
+        token_blob blob;
+    };
+
+    struct token_recording_input {
+        char const* first;
+        char const* last;
+        token_cache_key key;
+    };
+
+    // Feeds a cached stream to Wave in place of the re2c lexer
+    template <class TokenT>
+    struct token_replay_lexer : boost::wave::cpplexer::lex_input_interface<TokenT> {
+        using position_type = typename TokenT::position_type;
+        using string_type = typename TokenT::string_type;
+
+        token_replay_lexer(token_blob const& blob, position_type const& pos) : blob(blob), values(), filename(pos.get_file()), next(0), line_offset(0) {
+            values.reserve(blob.strings.size());
+            for (auto spelling : blob.strings) {
+                values.emplace_back(spelling.data(), spelling.size());
+            }
+        }
+
+        TokenT& get(TokenT& result) override {
+            if (next == blob.token_count) return result = TokenT();  // T_EOI
+
+            auto record = blob.record(next++);
+            auto line = static_cast<std::ptrdiff_t>(record.line) + line_offset;
+            result = TokenT(static_cast<boost::wave::token_id>(record.id), values[record.value],
+                            position_type(filename, static_cast<std::size_t>(line), record.column));
+#if BOOST_WAVE_SUPPORT_PRAGMA_ONCE != 0
+            return guards.detect_guard(result);
+#else
+            return result;
+#endif
+        }
+
+        // A #line directive renumbers everything after the current token, like the
+        // re2c lexer does
+        void set_position(position_type const& pos) override {
+            filename = pos.get_file();
+            if (next < blob.token_count) {
+                line_offset = static_cast<std::ptrdiff_t>(pos.get_line()) - static_cast<std::ptrdiff_t>(blob.record(next).line);
+            }
+        }
+
+#if BOOST_WAVE_SUPPORT_PRAGMA_ONCE != 0
+        bool has_include_guards(std::string& guard_name) const override {
+            return guards.detected(guard_name);
+        }
+#endif
+
+    private:
+        token_blob blob;
+        std::vector<string_type> values;  // decoded once; tokens share them
+        string_type filename;
+        std::size_t next;
+        std::ptrdiff_t line_offset;
+#if BOOST_WAVE_SUPPORT_PRAGMA_ONCE != 0
+        boost::wave::cpplexer::include_guards<TokenT> guards;
+#endif
+    };
+
+    // Runs the re2c lexer and stores its stream once it reaches T_EOF. Streams that
+    // were renumbered by #line, or cut short by a lexing error, are not stored.
+    template <class TokenT>
+    struct token_recording_lexer : boost::wave::cpplexer::lex_input_interface<TokenT> {
+        using position_type = typename TokenT::position_type;
+
+        token_recording_lexer(token_recording_input const& input, position_type const& pos, boost::wave::language_support language)
+            : lexer(boost::wave::cpplexer::new_lexer_gen<char const*, position_type, TokenT>::new_lexer(input.first, input.last, pos, language)),
+              key(input.key), writer(), recording(true) {}
+
+        TokenT& get(TokenT& result) override {
+            lexer->get(result);
+            if (recording) {
+                writer.add(result);
+                if (boost::wave::token_id(result) == boost::wave::T_EOF) {
+                    recording = false;
+                    token_cache::shared().store(key, writer.finish(key));
+                }
+            }
+            return result;
+        }
+
+        void set_position(position_type const& pos) override {
+            recording = false;
+            lexer->set_position(pos);
+        }
+
+#if BOOST_WAVE_SUPPORT_PRAGMA_ONCE != 0
+        bool has_include_guards(std::string& guard_name) const override {
+            return lexer->has_include_guards(guard_name);
+        }
+#endif
+
+    private:
+        std::unique_ptr<boost::wave::cpplexer::lex_input_interface<TokenT>> lexer;
+        token_cache_key key;
+        token_blob_writer<TokenT> writer;
+        bool recording;
+    };
+}
+
+namespace boost { namespace wave { namespace cpplexer {
+    template <class PositionT, class TokenT>
+    struct new_lexer_gen<ppstep::token_replay_input, PositionT, TokenT> {
+        static lex_input_interface<TokenT>* new_lexer(ppstep::token_replay_input const& first, ppstep::token_replay_input const&,
+                                                      PositionT const& pos, boost::wave::language_support) {
+            return new ppstep::token_replay_lexer<TokenT>(first.blob, pos);
+        }
+    };
+
+    template <class PositionT, class TokenT>
+    struct new_lexer_gen<ppstep::token_recording_input, PositionT, TokenT> {
+        static lex_input_interface<TokenT>* new_lexer(ppstep::token_recording_input const& first, ppstep::token_recording_input const&,
+                                                      PositionT const& pos, boost::wave::language_support language) {
+            return new ppstep::token_recording_lexer<TokenT>(first, pos, language);
+        }
+    };
+}}}
+
+#endif // PPSTEP_TOKEN_CACHE_HPP
@@ -0,0 +1,168 @@
+#ifndef PPSTEP_TOKEN_HANDLE_HPP
+#define PPSTEP_TOKEN_HANDLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "piece_sequence.hpp"
+#include "symbol_table.hpp"
+
+namespace ppstep {
+    // Everything that identifies a token, in 16 bytes: interned spelling and file name,
+    // the token ID and a packed position
+    struct token_handle {
+        symbol_id value;
+        symbol_id file;
+        std::uint32_t id;     // boost::wave::token_id
+        std::uint32_t position;
+
+        static constexpr std::uint32_t column_bits = 12;
+        static constexpr std::uint32_t max_column = (1u << column_bits) - 1;
+        static constexpr std::uint32_t max_line = (1u << (32 - column_bits)) - 1;
+
+        // Lines and columns beyond the packed range saturate; they are only ever displayed
+        static std::uint32_t pack(std::size_t line, std::size_t column) {
+            auto l = static_cast<std::uint32_t>(std::min<std::size_t>(line, max_line));
+            auto c = static_cast<std::uint32_t>(std::min<std::size_t>(column, max_column));
+            return (l << column_bits) | c;
+        }
+
+        std::size_t line() const {
+            return position >> column_bits;
+        }
+
+        std::size_t column() const {
+            return position & max_column;
+        }
+
+        friend bool operator==(token_handle const& a, token_handle const& b) {
+            return a.value == b.value && a.file == b.file && a.id == b.id && a.position == b.position;
+        }
+    };
+
+    static_assert(sizeof(token_handle) <= 16, "token handles must stay compact");
+
+    // What Wave compares tokens by: ID and spelling, but not position
+    inline std::uint64_t token_key(std::uint32_t id, symbol_id value) {
+        return (static_cast<std::uint64_t>(id) << 32) | value;
+    }
+
+    struct token_handle_hash {
+        std::size_t operator()(token_handle const& handle) const {
+            std::uint64_t words[2];
+            std::memcpy(words, &handle, sizeof(words));
+            return static_cast<std::size_t>((words[0] * 0x9e3779b97f4a7c15ull) ^ (words[1] + (words[0] >> 29)));
+        }
+    };
+
+    // History stores each token as a 4-byte reference to a pooled handle. A macro
+    // library produces the same tokens over and over, so the pool stays small while
+    // the history holds many copies of every sequence.
+    using token_ref = std::uint32_t;
+    using handle_sequence = std::vector<token_ref>;
+    // Token stack sequences share their unchanged handles between levels
+    using handle_pieces = piece_sequence<token_ref>;
+
+    // Interns tokens of one session as handles and turns them back into Wave tokens
+    template <class TokenT>
+    struct token_pool {
+        using string_type = typename TokenT::string_type;
+        using position_type = typename TokenT::position_type;
+
+        static constexpr token_ref invalid_ref = 0;
+
+        explicit token_pool(symbol_table& symbols) : symbols(&symbols), handles(1, token_handle{no_symbol, no_symbol, boost::wave::T_UNKNOWN, 0}), refs(), last_file(), last_file_id(no_symbol) {}
+
+        token_ref encode(TokenT const& token) {
+            if (!token.is_valid()) return invalid_ref;
+
+            auto const& pos = token.get_position();
+            auto handle = token_handle{
+                symbols->intern_token(token),
+                file_id(pos.get_file()),
+                static_cast<std::uint32_t>(boost::wave::token_id(token)),
+                token_handle::pack(pos.get_line(), pos.get_column())
+            };
+
+            auto [it, inserted] = refs.try_emplace(handle, static_cast<token_ref>(handles.size()));
+            if (inserted) handles.push_back(handle);
+            return it->second;
+        }
+
+        template <class RangeT>
+        handle_sequence encode(RangeT const& tokens) {
+            auto encoded = handle_sequence();
+            encoded.reserve(static_cast<std::size_t>(std::distance(std::begin(tokens), std::end(tokens))));
+            for (auto const& token : tokens) {
+                encoded.push_back(encode(token));
+            }
+            return encoded;
+        }
+
+        TokenT decode(token_ref ref) const {
+            if (ref == invalid_ref) return TokenT();
+
+            auto const& handle = handles[ref];
+            auto value = symbols->name(handle.value);
+            auto file = symbols->name(handle.file);
+            return TokenT(
+                static_cast<boost::wave::token_id>(handle.id),
+                string_type(value.data(), value.size()),
+                position_type(string_type(file.data(), file.size()), handle.line(), handle.column()));
+        }
+
+        template <class SequenceT>
+        SequenceT decode(handle_sequence const& encoded) const {
+            auto tokens = SequenceT();
+            for (auto ref : encoded) {
+                tokens.push_back(decode(ref));
+            }
+            return tokens;
+        }
+
+        symbol_id value_of(token_ref ref) const {
+            return handles[ref].value;
+        }
+
+        std::uint32_t id_of(token_ref ref) const {
+            return handles[ref].id;
+        }
+
+        std::uint64_t key_of(token_ref ref) const {
+            return token_key(handles[ref].id, handles[ref].value);
+        }
+
+        std::size_t size() const {
+            return handles.size() - 1;
+        }
+
+    private:
+        // Positions copied from one another share their file string, so runs of tokens
+        // from the same file skip hashing the path. The pool keeps a copy of the last
+        // file string, which pins its buffer: no other file name can take its address.
+        symbol_id file_id(string_type const& file) {
+            if (last_file_id == no_symbol || file.c_str() != last_file.c_str()) {
+                if (last_file_id == no_symbol || file != last_file) {
+                    last_file_id = symbols->intern(std::string_view(file.c_str(), file.size()));
+                }
+                last_file = file;
+            }
+            return last_file_id;
+        }
+
+        symbol_table* symbols;
+        std::vector<token_handle> handles;  // handles[0] stands for invalid tokens
+        std::unordered_map<token_handle, token_ref, token_handle_hash> refs;
+        string_type last_file;
+        symbol_id last_file_id;
+    };
+}
+
+#endif // PPSTEP_TOKEN_HANDLE_HPP
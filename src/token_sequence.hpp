@@ -0,0 +1,201 @@
+#ifndef PPSTEP_TOKEN_SEQUENCE_HPP
+#define PPSTEP_TOKEN_SEQUENCE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ppstep {
+    // Contiguous token sequence that keeps up to N tokens inline. The client renders and
+    // pattern-matches its history with random access (std::next to an offset, std::search
+    // for a call), which a linked list turns into pointer chasing.
+    //
+    // Wave's own token_sequence_type stays a std::list: the preprocessor splices queues
+    // into each other and keeps iterators across those splices, which no contiguous
+    // container can offer.
+    template <class T, std::size_t N = 16>
+    struct small_token_sequence {
+        using value_type = T;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using reference = T&;
+        using const_reference = T const&;
+        using pointer = T*;
+        using const_pointer = T const*;
+        using iterator = T*;
+        using const_iterator = T const*;
+
+        small_token_sequence() : first(inline_data()), count(0), capacity_(N) {}
+
+        template <class IteratorT, class = typename std::iterator_traits<IteratorT>::iterator_category>
+        small_token_sequence(IteratorT begin, IteratorT end) : small_token_sequence() {
+            insert(this->end(), begin, end);
+        }
+
+        small_token_sequence(std::initializer_list<T> tokens) : small_token_sequence(tokens.begin(), tokens.end()) {}
+
+        small_token_sequence(small_token_sequence const& other) : small_token_sequence(other.begin(), other.end()) {}
+
+        small_token_sequence(small_token_sequence&& other) noexcept : small_token_sequence() {
+            take(std::move(other));
+        }
+
+        small_token_sequence& operator=(small_token_sequence const& other) {
+            if (this != &other) {
+                clear();
+                insert(end(), other.begin(), other.end());
+            }
+            return *this;
+        }
+
+        small_token_sequence& operator=(small_token_sequence&& other) noexcept {
+            if (this != &other) {
+                clear();
+                release();
+                take(std::move(other));
+            }
+            return *this;
+        }
+
+        ~small_token_sequence() {
+            clear();
+            release();
+        }
+
+        iterator begin() { return first; }
+        iterator end() { return first + count; }
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return first + count; }
+        const_iterator cbegin() const { return first; }
+        const_iterator cend() const { return first + count; }
+
+        size_type size() const { return count; }
+        size_type capacity() const { return capacity_; }
+        bool empty() const { return count == 0; }
+
+        T& operator[](size_type i) { return first[i]; }
+        T const& operator[](size_type i) const { return first[i]; }
+        T& front() { return first[0]; }
+        T const& front() const { return first[0]; }
+        T& back() { return first[count - 1]; }
+        T const& back() const { return first[count - 1]; }
+
+        void reserve(size_type wanted) {
+            if (wanted <= capacity_) return;
+
+            auto grown = std::max(wanted, capacity_ * 2);
+            auto storage = static_cast<T*>(::operator new(grown * sizeof(T)));
+            std::uninitialized_move(first, first + count, storage);
+            std::destroy(first, first + count);
+            release();
+
+            first = storage;
+            capacity_ = grown;
+        }
+
+        void push_back(T const& token) {
+            emplace_back(token);
+        }
+
+        void push_back(T&& token) {
+            emplace_back(std::move(token));
+        }
+
+        template <class... ArgsT>
+        T& emplace_back(ArgsT&&... args) {
+            if (count == capacity_) {
+                // The argument may live in this sequence, so construct it before growing
+                T token(std::forward<ArgsT>(args)...);
+                reserve(count + 1);
+                new (first + count) T(std::move(token));
+            } else {
+                new (first + count) T(std::forward<ArgsT>(args)...);
+            }
+            return first[count++];
+        }
+
+        void pop_back() {
+            first[--count].~T();
+        }
+
+        template <class IteratorT>
+        iterator insert(const_iterator pos, IteratorT begin, IteratorT end) {
+            auto index = static_cast<size_type>(pos - first);
+            auto old_size = count;
+            if constexpr (std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<IteratorT>::iterator_category>) {
+                reserve(count + static_cast<size_type>(std::distance(begin, end)));
+            }
+            for (; begin != end; ++begin) {
+                emplace_back(*begin);
+            }
+            std::rotate(first + index, first + old_size, first + count);
+            return first + index;
+        }
+
+        iterator erase(const_iterator from, const_iterator to) {
+            auto index = static_cast<size_type>(from - first);
+            auto removed = static_cast<size_type>(to - from);
+            std::move(first + index + removed, first + count, first + index);
+            std::destroy(first + count - removed, first + count);
+            count -= removed;
+            return first + index;
+        }
+
+        void clear() {
+            std::destroy(first, first + count);
+            count = 0;
+        }
+
+        friend bool operator==(small_token_sequence const& a, small_token_sequence const& b) {
+            return std::equal(a.begin(), a.end(), b.begin(), b.end());
+        }
+
+        friend bool operator!=(small_token_sequence const& a, small_token_sequence const& b) {
+            return !(a == b);
+        }
+
+    private:
+        T* inline_data() {
+            return reinterpret_cast<T*>(storage);
+        }
+
+        bool is_inline() const {
+            return first == reinterpret_cast<T const*>(storage);
+        }
+
+        // Frees heap storage and falls back to the inline buffer; elements must be destroyed
+        void release() {
+            if (!is_inline()) ::operator delete(first);
+            first = inline_data();
+            capacity_ = N;
+        }
+
+        // Steals a heap buffer outright, moves inline elements one by one
+        void take(small_token_sequence&& other) {
+            if (other.is_inline()) {
+                std::uninitialized_move(other.first, other.first + other.count, first);
+                count = other.count;
+                other.clear();
+            } else {
+                first = other.first;
+                count = other.count;
+                capacity_ = other.capacity_;
+                other.first = other.inline_data();
+                other.count = 0;
+                other.capacity_ = N;
+            }
+        }
+
+        T* first;
+        size_type count;
+        size_type capacity_;
+        alignas(T) unsigned char storage[N * sizeof(T)];
+    };
+}
+
+#endif // PPSTEP_TOKEN_SEQUENCE_HPP
@@ -0,0 +1,144 @@
+#ifndef PPSTEP_TOKEN_VIEW_HPP
+#define PPSTEP_TOKEN_VIEW_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+#include <boost/wave/token_ids.hpp>
+
+namespace ppstep {
+    // Tokens that never show up in rendered or recorded output
+    template <class TokenT>
+    inline bool is_insignificant_token(TokenT const& token) {
+        return IS_CATEGORY(token, boost::wave::WhiteSpaceTokenType)
+                || IS_CATEGORY(token, boost::wave::EOFTokenType)
+                || (boost::wave::token_id(token) == boost::wave::T_PLACEMARKER)
+                || !token.is_valid();
+    }
+
+    // Non-owning view over a token range that lazily skips insignificant tokens.
+    // An optional head token is yielded before the range, which lets a macro call
+    // (name + parenthesized arguments) be viewed without splicing it into a container.
+    // Views only live as long as the hook that created them.
+    template <class IteratorT>
+    struct sanitized_view {
+        using token_type = typename std::iterator_traits<IteratorT>::value_type;
+
+        struct iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = token_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = token_type const*;
+            using reference = token_type const&;
+
+            iterator() : head(nullptr), it(), last() {}
+
+            iterator(token_type const* head, IteratorT it, IteratorT last) : head(head), it(it), last(last) {
+                if (this->head && is_insignificant_token(*this->head)) this->head = nullptr;
+                skip();
+            }
+
+            reference operator*() const {
+                return head ? *head : *it;
+            }
+
+            pointer operator->() const {
+                return &**this;
+            }
+
+            iterator& operator++() {
+                if (head) {
+                    head = nullptr;
+                } else {
+                    ++it;
+                }
+                skip();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                auto old = *this;
+                ++*this;
+                return old;
+            }
+
+            bool operator==(iterator const& other) const {
+                return head == other.head && it == other.it;
+            }
+
+            bool operator!=(iterator const& other) const {
+                return !(*this == other);
+            }
+
+        private:
+            void skip() {
+                if (head) return;
+                while (it != last && is_insignificant_token(*it)) ++it;
+            }
+
+            token_type const* head;
+            IteratorT it, last;
+        };
+
+        using const_iterator = iterator;
+
+        sanitized_view(IteratorT first, IteratorT last, token_type const* head = nullptr) : first(first), last(last), head(head) {}
+
+        iterator begin() const {
+            return iterator(head, first, last);
+        }
+
+        iterator end() const {
+            return iterator(nullptr, last, last);
+        }
+
+        bool empty() const {
+            return begin() == end();
+        }
+
+        std::size_t size() const {
+            return static_cast<std::size_t>(std::distance(begin(), end()));
+        }
+
+        token_type const& front() const {
+            return *begin();
+        }
+
+    private:
+        IteratorT first, last;
+        token_type const* head;
+    };
+
+    template <class ContainerT>
+    sanitized_view<typename ContainerT::const_iterator> sanitized(ContainerT const& tokens) {
+        return {tokens.begin(), tokens.end()};
+    }
+
+    // Indexable view of macro arguments, each sanitized lazily on access
+    template <class ContainerT>
+    struct sanitized_arguments {
+        using view_type = sanitized_view<typename ContainerT::const_iterator>;
+
+        explicit sanitized_arguments(std::vector<ContainerT> const& arguments) : arguments(&arguments) {}
+
+        sanitized_arguments() : arguments(nullptr) {}
+
+        std::size_t size() const {
+            return arguments ? arguments->size() : 0;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        view_type operator[](std::size_t i) const {
+            return sanitized((*arguments)[i]);
+        }
+
+    private:
+        std::vector<ContainerT> const* arguments;
+    };
+}
+
+#endif // PPSTEP_TOKEN_VIEW_HPP
@@ -0,0 +1,873 @@
+#ifndef PPSTEP_TRACE_HPP
+#define PPSTEP_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "mapped_file.hpp"
+#include "spsc_ring.hpp"
+#include "symbol_table.hpp"
+#include "token_handle.hpp"
+
+namespace ppstep {
+    // Binary recording format, written by `record --binary` and `--trace-binary`.
+    //
+    //   unit    := magic version started name record* end
+    //   record  := tag payload, integers as LEB128 varints
+    //
+    // Token spellings, files and messages are defined once, the first time they are
+    // used, and referred to by number after that: a `token` record defines the next
+    // token kind (Wave token ID and spelling), a `string` record the next string. A
+    // `position` record precedes any event whose main position differs from the last
+    // one, and the end of a unit whose input ran to completion. Events carry the
+    // expansion depth and lists of token kinds. A file may hold several units back to
+    // back, as --compdb writes them; each starts its tables over.
+    namespace trace_format {
+        constexpr char magic[8] = {'P', 'P', 'S', 'T', 'R', 'A', 'C', 'E'};
+        constexpr std::uint64_t version = 1;
+
+        enum class tag : std::uint8_t {
+            end = 0,
+            token = 1,        // id, spelling
+            string = 2,       // bytes
+            position = 3,     // file string, line, column
+            lexed = 4,        // depth, token
+            call = 5,         // depth, call tokens, argument count, argument tokens...
+            object_call = 6,  // depth, macro token
+            expanded = 7,     // depth, initial tokens, result tokens
+            rescanned = 8,    // depth, cause tokens, initial tokens, result tokens
+            error = 9,        // file string, line, message string
+        };
+
+        // Set on call, expanded and rescanned records whose tokens kept their whitespace
+        // and are printed normalized rather than one by one
+        constexpr std::uint8_t normalized = 0x80;
+
+        inline void put_varint(std::string& out, std::uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        inline void put_bytes(std::string& out, std::string_view bytes) {
+            put_varint(out, bytes.size());
+            out.append(bytes.data(), bytes.size());
+        }
+
+        inline std::uint64_t get_varint(char const*& next, char const* last) {
+            std::uint64_t value = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                if (next == last) throw std::runtime_error("trace is truncated or corrupt");
+                auto byte = static_cast<unsigned char>(*next++);
+                value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            throw std::runtime_error("trace is truncated or corrupt");
+        }
+
+        inline std::string_view get_bytes(char const*& next, char const* last) {
+            auto size = get_varint(next, last);
+            if (static_cast<std::uint64_t>(last - next) < size) throw std::runtime_error("trace is truncated or corrupt");
+            auto bytes = std::string_view(next, static_cast<std::size_t>(size));
+            next += size;
+            return bytes;
+        }
+
+        inline bool is_trace(char const* data, std::size_t size) {
+            return size >= sizeof(magic) && std::memcmp(data, magic, sizeof(magic)) == 0;
+        }
+    }
+
+    // Where an event happened: the main position and how many macros were being
+    // expanded or rescanned
+    struct trace_point {
+        std::string_view file;
+        std::size_t line;
+        std::size_t column;
+        std::size_t depth;
+    };
+
+    // Collapses whitespace runs into single spaces, with none before closing
+    // punctuation or after opening brackets
+    template <class RangeT, class SpellingT, class IsSpaceT>
+    void write_tokens_normalized(std::ostream& os, RangeT const& tokens, SpellingT&& spelling, IsSpaceT&& is_space) {
+        bool prev_was_whitespace = false;
+        bool need_space = false;
+
+        for (auto const& tok : tokens) {
+            if (is_space(tok)) {
+                if (!prev_was_whitespace && need_space) prev_was_whitespace = true;
+                continue;
+            }
+
+            std::string_view val = spelling(tok);
+            if ((prev_was_whitespace || need_space) && !val.empty() && need_space) {
+                char first_char = val.front();
+                if (first_char != ',' && first_char != ';' && first_char != ')' && first_char != ']' && first_char != '}') {
+                    os << ' ';
+                }
+            }
+            os << val;
+
+            if (!val.empty()) {
+                char last_char = val.back();
+                need_space = (last_char != '(' && last_char != '[' && last_char != '{');
+            } else {
+                need_space = false;
+            }
+            prev_was_whitespace = false;
+        }
+    }
+
+    // One token kind of a trace: what the token lists refer to
+    struct trace_kind {
+        std::uint32_t id;  // boost::wave::token_id
+        std::string_view spelling;
+    };
+
+    // Header of one unit of a trace
+    struct trace_unit {
+        std::size_t offset = 0;  // of the header in the file
+        std::uint64_t version = 0;
+        std::time_t started = 0;
+        std::string_view name;  // translation unit, set for compile database parts
+    };
+
+    // One event of a trace. `lists` holds the token lists in the order the format
+    // stores them: the token for lexed tokens and object-like calls, the call and then
+    // each argument for function-like calls, initial and result for expansions, and
+    // cause, initial and result for rescans. Errors use `file`, `line` and `message`.
+    struct trace_record {
+        trace_format::tag type = trace_format::tag::end;
+        bool normalized = false;
+        std::uint32_t depth = 0;
+        std::uint32_t file = 0;
+        std::uint32_t line = 0;
+        std::uint32_t column = 0;
+        std::uint32_t message = 0;
+        std::size_t offset = 0;  // of the record in the file
+        std::vector<std::vector<std::uint32_t>> lists;
+    };
+
+    // Streams the records of a binary trace straight out of the mapped file; spellings
+    // and strings are views into the mapping. Throws std::runtime_error on bad input.
+    struct trace_reader {
+        trace_reader() : file(), next_byte(nullptr), last_byte(nullptr), current(), kinds(), strings(), file_string(0), line(0), column(0), positioned(false), in_unit(false) {}
+
+        bool open(char const* path) {
+            if (!file.open(path)) return false;
+            next_byte = file.begin();
+            last_byte = file.end();
+            if (!trace_format::is_trace(next_byte, file.size())) throw std::runtime_error(std::string(path) + " is not a binary ppstep trace");
+            return true;
+        }
+
+        // Moves on to the next unit; false once the file is exhausted
+        bool next_unit() {
+            while (in_unit) {
+                auto record = trace_record();
+                next(record);
+            }
+            if (next_byte == last_byte) return false;
+            if (!trace_format::is_trace(next_byte, static_cast<std::size_t>(last_byte - next_byte))) throw std::runtime_error("trace is truncated or corrupt");
+            current = trace_unit();
+            current.offset = static_cast<std::size_t>(next_byte - file.begin());
+            next_byte += sizeof(trace_format::magic);
+
+            current.version = trace_format::get_varint(next_byte, last_byte);
+            if (current.version != trace_format::version) throw std::runtime_error("unsupported trace version " + std::to_string(current.version));
+            current.started = static_cast<std::time_t>(trace_format::get_varint(next_byte, last_byte));
+            current.name = trace_format::get_bytes(next_byte, last_byte);
+
+            kinds.clear();
+            strings.clear();
+            file_string = line = column = 0;
+            positioned = false;
+            in_unit = true;
+            return true;
+        }
+
+        trace_unit const& unit() const {
+            return current;
+        }
+
+        // Reads the next event of the current unit; false at its end. A trace cut off
+        // between records, as a crashed session leaves it, just ends early.
+        bool next(trace_record& record) {
+            using trace_format::get_varint;
+            using trace_format::tag;
+
+            while (in_unit) {
+                if (next_byte == last_byte) {
+                    in_unit = false;
+                    return false;
+                }
+
+                record.offset = static_cast<std::size_t>(next_byte - file.begin());
+                auto byte = static_cast<std::uint8_t>(*next_byte++);
+                auto type = static_cast<tag>(byte & ~trace_format::normalized);
+                switch (type) {
+                    case tag::end:
+                        in_unit = false;
+                        return false;
+                    case tag::token: {
+                        auto id = static_cast<std::uint32_t>(get_varint(next_byte, last_byte));
+                        kinds.push_back(trace_kind{id, trace_format::get_bytes(next_byte, last_byte)});
+                        continue;
+                    }
+                    case tag::string:
+                        strings.push_back(trace_format::get_bytes(next_byte, last_byte));
+                        continue;
+                    case tag::position:
+                        file_string = get_number(strings.size());
+                        line = static_cast<std::uint32_t>(get_varint(next_byte, last_byte));
+                        column = static_cast<std::uint32_t>(get_varint(next_byte, last_byte));
+                        positioned = true;
+                        continue;
+                    case tag::error:
+                        record.type = type;
+                        record.normalized = false;
+                        record.depth = 0;
+                        record.file = get_number(strings.size());
+                        record.line = static_cast<std::uint32_t>(get_varint(next_byte, last_byte));
+                        record.column = 0;
+                        record.message = get_number(strings.size());
+                        record.lists.clear();
+                        return true;
+                    case tag::lexed:
+                    case tag::call:
+                    case tag::object_call:
+                    case tag::expanded:
+                    case tag::rescanned:
+                        break;
+                    default:
+                        throw std::runtime_error("trace is truncated or corrupt");
+                }
+
+                record.type = type;
+                record.normalized = (byte & trace_format::normalized) != 0;
+                record.depth = static_cast<std::uint32_t>(get_varint(next_byte, last_byte));
+                record.file = file_string;
+                record.line = line;
+                record.column = column;
+
+                std::size_t lists = 0;
+                switch (type) {
+                    case tag::lexed:
+                    case tag::object_call:
+                        resize(record, 1, 0);
+                        record.lists[0].push_back(get_number(kinds.size()));
+                        return true;
+                    case tag::call: {
+                        resize(record, 1, 0);
+                        get_tokens(record.lists[0]);
+                        auto arguments = get_varint(next_byte, last_byte);
+                        // Each argument takes at least the byte of its token count
+                        if (arguments > static_cast<std::uint64_t>(last_byte - next_byte)) throw std::runtime_error("trace is truncated or corrupt");
+                        lists = 1 + static_cast<std::size_t>(arguments);
+                        break;
+                    }
+                    case tag::expanded:
+                        lists = 2;
+                        break;
+                    default:
+                        lists = 3;
+                        break;
+                }
+                auto first = type == tag::call ? std::size_t(1) : std::size_t(0);
+                resize(record, lists, first);
+                for (auto i = first; i < lists; ++i) {
+                    get_tokens(record.lists[i]);
+                }
+                return true;
+            }
+            return false;
+        }
+
+        trace_kind const& kind(std::uint32_t index) const {
+            return kinds[index];
+        }
+
+        std::size_t kind_count() const {
+            return kinds.size();
+        }
+
+        std::size_t string_count() const {
+            return strings.size();
+        }
+
+        // The main position as of the last record read, if the unit has one yet; at the
+        // end of a complete unit, where its input ended
+        std::optional<trace_record> position() const {
+            if (!positioned) return {};
+            auto record = trace_record();
+            record.file = file_string;
+            record.line = line;
+            record.column = column;
+            return record;
+        }
+
+        std::string_view string(std::uint32_t index) const {
+            return strings[index];
+        }
+
+        // The whole mapped trace
+        char const* data() const {
+            return file.begin();
+        }
+
+        std::size_t size() const {
+            return file.size();
+        }
+
+        // Carries on at the record at `offset` of the unit whose header is at `unit_offset`,
+        // given the kinds, strings and main position defined before that record, as a
+        // trace_index keeps them
+        void seek(std::size_t unit_offset, std::size_t offset, std::vector<trace_kind> unit_kinds, std::vector<std::string_view> unit_strings,
+                  std::optional<trace_record> const& position) {
+            in_unit = false;
+            next_byte = file.begin() + std::min(unit_offset, file.size());
+            if (!next_unit()) throw std::runtime_error("trace is truncated or corrupt");
+            if (offset > file.size()) throw std::runtime_error("trace is truncated or corrupt");
+            next_byte = file.begin() + offset;
+            kinds = std::move(unit_kinds);
+            strings = std::move(unit_strings);
+            positioned = position.has_value();
+            if (position) {
+                file_string = position->file;
+                line = position->line;
+                column = position->column;
+            }
+        }
+
+        // Reads the event at `offset` of the current unit without moving on from where
+        // the reader is
+        void read_at(std::size_t offset, trace_record& record) {
+            auto resume = next_byte;
+            auto saved = std::make_tuple(file_string, line, column, positioned, in_unit);
+            next_byte = file.begin() + std::min(offset, file.size());
+            in_unit = true;
+            auto found = next(record);
+            next_byte = resume;
+            std::tie(file_string, line, column, positioned, in_unit) = saved;
+            if (!found) throw std::runtime_error("trace is truncated or corrupt");
+        }
+
+        // Gives back the part of the mapping already read. Kinds and strings defined
+        // there stay valid, they are just paged in again when used.
+        void release_read() {
+            file.release(static_cast<std::size_t>(next_byte - file.begin()));
+        }
+
+    private:
+        // Empties lists [first, lists), keeping the inner vectors' storage from record to record
+        static void resize(trace_record& record, std::size_t lists, std::size_t first) {
+            if (record.lists.size() < lists) record.lists.resize(lists);
+            for (auto i = first; i < lists; ++i) record.lists[i].clear();
+            record.lists.resize(lists);
+        }
+
+        // A reference to an already defined kind or string
+        std::uint32_t get_number(std::size_t defined) {
+            auto number = trace_format::get_varint(next_byte, last_byte);
+            if (number >= defined) throw std::runtime_error("trace is truncated or corrupt");
+            return static_cast<std::uint32_t>(number);
+        }
+
+        void get_tokens(std::vector<std::uint32_t>& tokens) {
+            auto count = trace_format::get_varint(next_byte, last_byte);
+            if (count > static_cast<std::uint64_t>(last_byte - next_byte)) throw std::runtime_error("trace is truncated or corrupt");
+            tokens.reserve(static_cast<std::size_t>(count));
+            for (std::uint64_t i = 0; i < count; ++i) {
+                tokens.push_back(get_number(kinds.size()));
+            }
+        }
+
+        mapped_file file;
+        char const* next_byte;
+        char const* last_byte;
+        trace_unit current;
+        std::vector<trace_kind> kinds;
+        std::vector<std::string_view> strings;
+        std::uint32_t file_string;
+        std::uint32_t line;
+        std::uint32_t column;
+        bool positioned;
+        bool in_unit;
+    };
+
+    // The token kind naming the macro of a call record: the first one that is neither
+    // whitespace nor a placemarker
+    inline std::optional<std::uint32_t> called_macro(trace_reader const& reader, trace_record const& record) {
+        for (auto kind : record.lists[0]) {
+            auto id = static_cast<boost::wave::token_id>(reader.kind(kind).id);
+            if (!IS_CATEGORY(id, boost::wave::WhiteSpaceTokenType) && id != boost::wave::T_PLACEMARKER) return kind;
+        }
+        return {};
+    }
+
+    inline void write_text_header(std::ostream& out, std::time_t started) {
+        out << "=== PPSTEP TRACE ===\n";
+        // Same layout as ctime, which shares one static buffer between the writer threads
+        std::tm local{};
+        char date[64];
+        localtime_r(&started, &local);
+        std::strftime(date, sizeof date, "%a %b %e %H:%M:%S %Y", &local);
+        out << "Started: " << date << "\n";
+        out << "===================\n\n";
+    }
+
+    inline void write_text_footer(std::ostream& out) {
+        out << "\n=== END OF TRACE ===\n";
+    }
+
+    // Prints one event in the text trace format. `spelling` and `is_space` look up
+    // token kinds, `string` the strings errors refer to.
+    template <class SpellingT, class IsSpaceT, class StringT>
+    void write_text_record(std::ostream& out, trace_record const& record, SpellingT&& spelling, IsSpaceT&& is_space, StringT&& string) {
+        using trace_format::tag;
+
+        auto tokens = [&](std::vector<std::uint32_t> const& list) {
+            if (record.normalized) {
+                write_tokens_normalized(out, list, spelling, is_space);
+            } else {
+                for (auto kind : list) out << spelling(kind) << ' ';
+            }
+        };
+
+        switch (record.type) {
+            case tag::lexed:
+                out << "[LEXED] " << spelling(record.lists[0][0]) << '\n';
+                break;
+            case tag::object_call:
+                out << "[CALL] " << spelling(record.lists[0][0]) << '\n';
+                break;
+            case tag::call:
+                out << "[CALL] ";
+                tokens(record.lists[0]);
+                out << '\n';
+                for (std::size_t i = 1; i < record.lists.size(); ++i) {
+                    out << "  ARG[" << i - 1 << "]: ";
+                    tokens(record.lists[i]);
+                    out << '\n';
+                }
+                break;
+            case tag::expanded:
+                out << "[EXPANDED]\n  FROM: ";
+                tokens(record.lists[0]);
+                out << "\n  TO:   ";
+                tokens(record.lists[1]);
+                out << '\n';
+                break;
+            case tag::rescanned:
+                out << "[RESCANNED]\n  FROM:      ";
+                tokens(record.lists[1]);
+                out << "\n  TO:        ";
+                tokens(record.lists[2]);
+                out << "\n  CAUSED BY: ";
+                tokens(record.lists[0]);
+                out << '\n';
+                break;
+            case tag::error:
+                out << "[PPSTEP-ERROR] " << string(record.file) << ':' << record.line << " - " << string(record.message) << '\n';
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Prints a binary trace in the text format `record` writes, byte for byte
+    inline void write_text_trace(trace_reader& reader, std::ostream& out) {
+        auto record = trace_record();
+        auto spelling = [&reader](std::uint32_t kind) { return reader.kind(kind).spelling; };
+        auto is_space = [&reader](std::uint32_t kind) {
+            return IS_CATEGORY(static_cast<boost::wave::token_id>(reader.kind(kind).id), boost::wave::WhiteSpaceTokenType);
+        };
+        auto string = [&reader](std::uint32_t index) { return reader.string(index); };
+
+        while (reader.next_unit()) {
+            auto const& unit = reader.unit();
+            if (!unit.name.empty()) out << "### " << unit.name << '\n';
+            write_text_header(out, unit.started);
+            while (reader.next(record)) {
+                write_text_record(out, record, spelling, is_space, string);
+            }
+            write_text_footer(out);
+        }
+    }
+
+    // A trace event on its way from the hooks to the writer thread: the record, plus
+    // the token kinds and strings it is the first to use
+    struct trace_event {
+        trace_record record;
+        std::vector<std::pair<std::uint32_t, std::string>> new_kinds;  // Wave token ID, spelling
+        std::vector<std::string> new_strings;
+    };
+
+    // Records a trace, in either format, on a thread of its own. The hooks only intern
+    // spellings in the session's symbol table and copy token numbers into a slot of a
+    // bounded SPSC ring; encoding, formatting and file I/O happen on the writer thread.
+    // When the ring is full the hooks wait for the writer, so a slow disk slows
+    // preprocessing down instead of growing the queue. Output goes through a large
+    // buffer that is written out when it fills up and whenever the writer runs dry, so
+    // the file is current while the session waits at a prompt.
+    struct trace_recorder {
+        static constexpr std::size_t queue_slots = 1024;
+        static constexpr std::size_t buffer_size = std::size_t(1) << 20;
+        // Slots drop token lists longer than this rather than keep them for the next event
+        static constexpr std::size_t kept_tokens = std::size_t(1) << 14;
+        // Times the writer yields on an empty queue before it flushes and sleeps
+        static constexpr int idle_spins = 64;
+
+        explicit trace_recorder(symbol_table& symbols)
+            : symbols(&symbols), queue(queue_slots), writer(), mutex(), wake(), writer_idle(false), stopping(false),
+              kinds(), strings(), last_file(), file_string(0), lists_used(0),
+              out(), out_buffer(), binary(false), started(0), unit_name(), buffer(), written_kinds(), written_strings(),
+              last_written_file(0), last_written_line(~std::uint32_t(0)), last_written_column(0) {}
+
+        trace_recorder(trace_recorder const&) = delete;
+        trace_recorder& operator=(trace_recorder const&) = delete;
+
+        ~trace_recorder() {
+            close();
+        }
+
+        // `unit` names the translation unit when the trace is one part of a compile
+        // database; binary traces keep it in their header
+        bool open(std::string const& filename, bool binary_format, std::string_view unit = std::string_view()) {
+            out_buffer.resize(buffer_size);
+            out.rdbuf()->pubsetbuf(out_buffer.data(), static_cast<std::streamsize>(out_buffer.size()));
+            out.open(filename, std::ios::out | std::ios::trunc | std::ios::binary);
+            if (!out.is_open()) return false;
+
+            binary = binary_format;
+            started = std::time(nullptr);
+            unit_name.assign(unit.data(), unit.size());
+            stopping = false;
+            writer = std::thread([this] { run(); });
+            return true;
+        }
+
+        // Waits until everything queued so far is in the file
+        void close() {
+            if (!writer.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+            out.close();
+        }
+
+        template <class TokenT>
+        void lexed(trace_point const& at, TokenT const& token) {
+            auto& e = begin(trace_format::tag::lexed, false, at);
+            next_list(e).push_back(kind_of(e, token));
+            publish(e);
+        }
+
+        template <class CallT, class ArgumentsT>
+        void call(trace_point const& at, CallT const& call, ArgumentsT const& arguments, bool normalized) {
+            auto& e = begin(trace_format::tag::call, normalized, at);
+            put_tokens(e, call);
+            for (std::size_t i = 0; i < arguments.size(); ++i) {
+                put_tokens(e, arguments[i]);
+            }
+            publish(e);
+        }
+
+        template <class TokenT>
+        void object_call(trace_point const& at, TokenT const& macro) {
+            auto& e = begin(trace_format::tag::object_call, false, at);
+            next_list(e).push_back(kind_of(e, macro));
+            publish(e);
+        }
+
+        template <class InitialT, class ResultT>
+        void expanded(trace_point const& at, InitialT const& initial, ResultT const& result, bool normalized) {
+            auto& e = begin(trace_format::tag::expanded, normalized, at);
+            put_tokens(e, initial);
+            put_tokens(e, result);
+            publish(e);
+        }
+
+        template <class CauseT, class InitialT, class ResultT>
+        void rescanned(trace_point const& at, CauseT const& cause, InitialT const& initial, ResultT const& result, bool normalized) {
+            auto& e = begin(trace_format::tag::rescanned, normalized, at);
+            put_tokens(e, cause);
+            put_tokens(e, initial);
+            put_tokens(e, result);
+            publish(e);
+        }
+
+        // Where the input ended, once preprocessing completes
+        void complete(trace_point const& at) {
+            publish(begin(trace_format::tag::position, false, at));
+        }
+
+        void error(std::string_view file, std::size_t line, std::string_view message) {
+            auto& e = claim();
+            e.record.type = trace_format::tag::error;
+            e.record.normalized = false;
+            e.record.depth = 0;
+            e.record.file = string_of(e, file);
+            e.record.line = static_cast<std::uint32_t>(line);
+            e.record.column = 0;
+            e.record.message = string_of(e, message);
+            publish(e);
+        }
+
+    private:
+        // Hook side
+
+        trace_event& claim() {
+            auto* slot = queue.try_claim();
+            while (!slot) {
+                std::this_thread::yield();
+                slot = queue.try_claim();
+            }
+            slot->new_kinds.clear();
+            slot->new_strings.clear();
+            lists_used = 0;
+            return *slot;
+        }
+
+        trace_event& begin(trace_format::tag type, bool normalized, trace_point const& at) {
+            auto& e = claim();
+            if (at.file != last_file) {
+                last_file.assign(at.file.data(), at.file.size());
+                file_string = string_of(e, at.file);
+            }
+            e.record.type = type;
+            e.record.normalized = normalized;
+            e.record.depth = static_cast<std::uint32_t>(at.depth);
+            e.record.file = file_string;
+            e.record.line = static_cast<std::uint32_t>(at.line);
+            e.record.column = static_cast<std::uint32_t>(at.column);
+            return e;
+        }
+
+        void publish(trace_event& e) {
+            e.record.lists.resize(lists_used);
+            queue.publish();
+            // Only the first event after the writer fell asleep pays for waking it
+            if (writer_idle.load() && writer_idle.exchange(false)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                wake.notify_one();
+            }
+        }
+
+        std::vector<std::uint32_t>& next_list(trace_event& e) {
+            auto& lists = e.record.lists;
+            if (lists_used == lists.size()) lists.emplace_back();
+            auto& list = lists[lists_used++];
+            if (list.capacity() > kept_tokens) {
+                list = std::vector<std::uint32_t>();
+            } else {
+                list.clear();
+            }
+            return list;
+        }
+
+        template <class RangeT>
+        void put_tokens(trace_event& e, RangeT const& tokens) {
+            auto& list = next_list(e);
+            for (auto const& token : tokens) {
+                list.push_back(kind_of(e, token));
+            }
+        }
+
+        template <class TokenT>
+        std::uint32_t kind_of(trace_event& e, TokenT const& token) {
+            auto id = static_cast<std::uint32_t>(boost::wave::token_id(token));
+            auto key = token_key(id, symbols->intern_token(token));
+            auto [it, inserted] = kinds.try_emplace(key, static_cast<std::uint32_t>(kinds.size()));
+            if (inserted) e.new_kinds.emplace_back(id, std::string(token_spelling(token)));
+            return it->second;
+        }
+
+        std::uint32_t string_of(trace_event& e, std::string_view text) {
+            auto [it, inserted] = strings.try_emplace(symbols->intern(text), static_cast<std::uint32_t>(strings.size()));
+            if (inserted) e.new_strings.emplace_back(text);
+            return it->second;
+        }
+
+        // Writer side
+
+        void run() {
+            if (binary) {
+                buffer.append(trace_format::magic, sizeof(trace_format::magic));
+                trace_format::put_varint(buffer, trace_format::version);
+                trace_format::put_varint(buffer, static_cast<std::uint64_t>(started));
+                trace_format::put_bytes(buffer, unit_name);
+            } else {
+                write_text_header(out, started);
+            }
+
+            while (true) {
+                if (auto* e = next_event()) {
+                    write(*e);
+                    queue.pop();
+                    continue;
+                }
+
+                flush();
+                std::unique_lock<std::mutex> lock(mutex);
+                writer_idle.store(true);
+                wake.wait(lock, [this] { return stopping || queue.front() != nullptr; });
+                writer_idle.store(false);
+                if (stopping && !queue.front()) break;
+            }
+
+            if (binary) {
+                buffer.push_back(static_cast<char>(trace_format::tag::end));
+            } else {
+                write_text_footer(out);
+            }
+            flush();
+        }
+
+        // The next queued event, giving the hooks a moment to catch up before giving up
+        trace_event* next_event() {
+            for (int spin = 0; spin < idle_spins; ++spin) {
+                if (auto* e = queue.front()) return e;
+                std::this_thread::yield();
+            }
+            return queue.front();
+        }
+
+        void write(trace_event& e) {
+            if (binary) {
+                encode(e);
+                if (buffer.size() >= buffer_size) flush();
+                return;
+            }
+
+            for (auto& [id, spelling] : e.new_kinds) written_kinds.emplace_back(id, std::move(spelling));
+            for (auto& text : e.new_strings) written_strings.push_back(std::move(text));
+            write_text_record(out, e.record,
+                              [this](std::uint32_t kind) -> std::string const& { return written_kinds[kind].second; },
+                              [this](std::uint32_t kind) {
+                                  return IS_CATEGORY(static_cast<boost::wave::token_id>(written_kinds[kind].first), boost::wave::WhiteSpaceTokenType);
+                              },
+                              [this](std::uint32_t index) -> std::string const& { return written_strings[index]; });
+        }
+
+        // Definitions first, then a position record if the position moved, then the event
+        void encode(trace_event const& e) {
+            using trace_format::put_varint;
+            using trace_format::tag;
+
+            for (auto const& [id, spelling] : e.new_kinds) {
+                buffer.push_back(static_cast<char>(tag::token));
+                put_varint(buffer, id);
+                trace_format::put_bytes(buffer, spelling);
+            }
+            for (auto const& text : e.new_strings) {
+                buffer.push_back(static_cast<char>(tag::string));
+                trace_format::put_bytes(buffer, text);
+            }
+
+            auto const& r = e.record;
+            if (r.type == tag::error) {
+                buffer.push_back(static_cast<char>(tag::error));
+                put_varint(buffer, r.file);
+                put_varint(buffer, r.line);
+                put_varint(buffer, r.message);
+                return;
+            }
+
+            if (r.file != last_written_file || r.line != last_written_line || r.column != last_written_column) {
+                last_written_file = r.file;
+                last_written_line = r.line;
+                last_written_column = r.column;
+                buffer.push_back(static_cast<char>(tag::position));
+                put_varint(buffer, r.file);
+                put_varint(buffer, r.line);
+                put_varint(buffer, r.column);
+            }
+            if (r.type == tag::position) return;
+
+            buffer.push_back(static_cast<char>(static_cast<std::uint8_t>(r.type) | (r.normalized ? trace_format::normalized : 0)));
+            put_varint(buffer, r.depth);
+            auto put_list = [this](std::vector<std::uint32_t> const& list) {
+                put_varint(buffer, list.size());
+                for (auto kind : list) put_varint(buffer, kind);
+            };
+            switch (r.type) {
+                case tag::lexed:
+                case tag::object_call:
+                    put_varint(buffer, r.lists[0][0]);
+                    break;
+                case tag::call:
+                    put_list(r.lists[0]);
+                    put_varint(buffer, r.lists.size() - 1);
+                    for (std::size_t i = 1; i < r.lists.size(); ++i) put_list(r.lists[i]);
+                    break;
+                default:
+                    for (auto const& list : r.lists) put_list(list);
+                    break;
+            }
+        }
+
+        void flush() {
+            if (!buffer.empty()) {
+                out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            }
+            out.flush();
+        }
+
+        symbol_table* symbols;
+        spsc_ring<trace_event> queue;
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::atomic<bool> writer_idle;  // the writer is asleep, or about to be
+        bool stopping;                  // guarded by mutex
+
+        // Hook side: what has been numbered so far
+        std::unordered_map<std::uint64_t, std::uint32_t> kinds;  // token_key -> kind number
+        std::unordered_map<symbol_id, std::uint32_t> strings;     // symbol -> string number
+        std::string last_file;
+        std::uint32_t file_string;
+        std::size_t lists_used;
+
+        // Writer side
+        std::ofstream out;
+        std::vector<char> out_buffer;
+        bool binary;
+        std::time_t started;
+        std::string unit_name;
+        std::string buffer;  // binary records not yet written
+        std::vector<std::pair<std::uint32_t, std::string>> written_kinds;
+        std::vector<std::string> written_strings;
+        std::uint32_t last_written_file;
+        std::uint32_t last_written_line;
+        std::uint32_t last_written_column;
+    };
+}
+
+#endif // PPSTEP_TRACE_HPP
@@ -0,0 +1,475 @@
+#ifndef PPSTEP_TRACE_INDEX_HPP
+#define PPSTEP_TRACE_INDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "mapped_file.hpp"
+#include "trace.hpp"
+
+namespace ppstep {
+    // Sidecar index of a binary trace, kept next to it as `<trace>.idx`, in native byte
+    // order:
+    //
+    //   trace_index_header
+    //   units       x index_unit
+    //   checkpoints x index_checkpoint   at the first event of every unit and every `stride` events
+    //   frames      x u64                records that opened the expansions open at a checkpoint
+    //   kinds       x index_bytes        token kinds of every unit, as spelled in the trace
+    //   strings     x index_bytes        strings of every unit, in the trace
+    //   lines       x index_line         first event on each line of each file, by file and line
+    //   macros      x index_macro        called macros, by name
+    //   postings    x u64                events calling each macro, in order
+    //
+    // Events are numbered from 0 across the whole trace, in the order trace_reader::next
+    // returns them. A checkpoint holds everything a reader needs to carry on from its
+    // event: the kinds and strings defined so far, the main position, and the calls and
+    // expansions still open, so replay can start at any checkpoint and catch up from
+    // there. Offsets are into the trace; nothing in the index is copied out of it.
+    struct trace_index_header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t stride;
+        std::uint64_t trace_size;      // the trace this indexes: its size and
+        std::uint64_t trace_started;   // when its first unit was started
+        std::uint64_t events;
+        std::uint64_t units;
+        std::uint64_t checkpoints;
+        std::uint64_t frames;
+        std::uint64_t kinds;
+        std::uint64_t strings;
+        std::uint64_t lines;
+        std::uint64_t macros;
+        std::uint64_t postings;
+    };
+
+    struct index_unit {
+        std::uint64_t offset;  // of its header in the trace
+        std::uint64_t first_event;
+        std::uint64_t events;
+        std::uint64_t first_checkpoint;
+        std::uint64_t checkpoints;
+        std::uint64_t first_kind;
+        std::uint64_t kinds;
+        std::uint64_t first_string;
+        std::uint64_t strings;
+        std::uint64_t first_line;
+        std::uint64_t lines;
+    };
+
+    struct index_checkpoint {
+        std::uint64_t offset;  // of the event's record
+        std::uint64_t event;
+        std::uint64_t first_frame;
+        std::uint32_t expanding;   // open frames: this many call records,
+        std::uint32_t rescanning;  // and this many expanded records, all in trace order
+        std::uint32_t kinds;       // defined before the event
+        std::uint32_t strings;
+        std::uint32_t file;        // main position before the event, if positioned
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t positioned;
+    };
+
+    struct index_bytes {
+        std::uint64_t offset;
+        std::uint32_t size;
+        std::uint32_t id;  // boost::wave::token_id, for kinds
+    };
+
+    struct index_line {
+        std::uint32_t file;  // string of the unit
+        std::uint32_t line;
+        std::uint64_t event;
+    };
+
+    struct index_macro {
+        std::uint64_t name_offset;
+        std::uint32_t name_size;
+        std::uint32_t unused;
+        std::uint64_t first_posting;
+        std::uint64_t postings;
+    };
+
+    constexpr char trace_index_magic[8] = {'P', 'P', 'S', 'I', 'N', 'D', 'E', 'X'};
+    constexpr std::uint32_t trace_index_version = 1;
+    // Replay catches up from the checkpoint before its target, so at most this many events
+    constexpr std::uint32_t trace_index_stride = 4096;
+
+    inline std::string trace_index_path(std::string const& trace_path) {
+        return trace_path + ".idx";
+    }
+
+    // When the first unit of a trace was started, which together with its size tells
+    // one recording from the next
+    inline std::uint64_t trace_started_time(trace_reader const& trace) {
+        auto next = trace.data() + sizeof(trace_format::magic);
+        auto last = trace.data() + trace.size();
+        trace_format::get_varint(next, last);
+        return trace_format::get_varint(next, last);
+    }
+
+    // A validated index mapped alongside the trace it indexes. Records are read with
+    // memcpy, as in the token cache.
+    struct trace_index {
+        trace_index() : file(), trace(nullptr), header(), sections() {}
+
+        // False if there is no index for this trace, or it was built for another recording
+        bool open(std::string const& path, trace_reader const& reader) {
+            if (!file.open(path.c_str())) return false;
+            auto size = file.size();
+            if (size < sizeof(header)) return false;
+            std::memcpy(&header, file.begin(), sizeof(header));
+            if (std::memcmp(header.magic, trace_index_magic, sizeof(header.magic)) != 0
+                || header.version != trace_index_version
+                || header.stride == 0
+                || header.trace_size != reader.size()
+                || header.trace_started != trace_started_time(reader)) return false;
+
+            auto counts = {header.units, header.checkpoints, header.frames, header.kinds, header.strings,
+                           header.lines, header.macros, header.postings};
+            auto sizes = {sizeof(index_unit), sizeof(index_checkpoint), sizeof(std::uint64_t), sizeof(index_bytes), sizeof(index_bytes),
+                          sizeof(index_line), sizeof(index_macro), sizeof(std::uint64_t)};
+            std::uint64_t offset = sizeof(header);
+            auto count = counts.begin();
+            auto record_size = sizes.begin();
+            for (auto& section : sections) {
+                if (*count > (size - offset) / *record_size) return false;
+                section = file.begin() + offset;
+                offset += *count++ * *record_size++;
+            }
+            trace = reader.data();
+            return true;
+        }
+
+        std::uint64_t events() const {
+            return header.events;
+        }
+
+        std::uint64_t units() const {
+            return header.units;
+        }
+
+        index_unit unit(std::uint64_t i) const {
+            return at<index_unit>(unit_section, i);
+        }
+
+        // The unit whose header is at `offset` in the trace
+        std::optional<std::uint64_t> unit_at(std::uint64_t offset) const {
+            auto i = search(header.units, [&](std::uint64_t i) { return unit(i).offset <= offset; });
+            if (i == 0 || unit(i - 1).offset != offset) return {};
+            return i - 1;
+        }
+
+        // The unit an event belongs to
+        std::optional<std::uint64_t> unit_of(std::uint64_t event) const {
+            if (event >= header.events) return {};
+            // Empty units share their first event with the next one, so the last unit
+            // starting at or before the event is the one holding it
+            return search(header.units, [&](std::uint64_t i) { return unit(i).first_event <= event; }) - 1;
+        }
+
+        // The last checkpoint of the unit at or before `event`
+        index_checkpoint checkpoint_before(index_unit const& u, std::uint64_t event) const {
+            auto i = search(u.checkpoints, [&](std::uint64_t i) { return checkpoint(u, i).event <= event; });
+            return checkpoint(u, i == 0 ? 0 : i - 1);
+        }
+
+        std::uint64_t frame(index_checkpoint const& c, std::uint64_t i) const {
+            return at<std::uint64_t>(frame_section, c.first_frame + i);
+        }
+
+        trace_kind kind(index_unit const& u, std::uint64_t i) const {
+            auto k = at<index_bytes>(kind_section, u.first_kind + i);
+            return trace_kind{k.id, bytes(k)};
+        }
+
+        std::string_view string(index_unit const& u, std::uint64_t i) const {
+            return bytes(at<index_bytes>(string_section, u.first_string + i));
+        }
+
+        // The first event on the line, or the first one past it if the line had none
+        std::optional<std::uint64_t> first_event_on(index_unit const& u, std::uint32_t file_string, std::uint32_t line) const {
+            auto i = search(u.lines, [&](std::uint64_t i) {
+                auto l = at<index_line>(line_section, u.first_line + i);
+                return std::make_pair(l.file, l.line) < std::make_pair(file_string, line);
+            });
+            if (i == u.lines) return {};
+            auto l = at<index_line>(line_section, u.first_line + i);
+            if (l.file != file_string) return {};
+            return l.event;
+        }
+
+        // How often the macro is called in the whole trace
+        std::uint64_t call_count(std::string_view name) const {
+            auto m = find_macro(name);
+            return m ? m->postings : 0;
+        }
+
+        // The first call of the macro at or after `event`: which call it is, counting
+        // from 0, and its event
+        std::optional<std::pair<std::uint64_t, std::uint64_t>> next_call(std::string_view name, std::uint64_t event) const {
+            auto m = find_macro(name);
+            if (!m) return {};
+            auto i = search(m->postings, [&](std::uint64_t i) { return posting(m->first_posting + i) < event; });
+            if (i == m->postings) return {};
+            return std::make_pair(i, posting(m->first_posting + i));
+        }
+
+    private:
+        enum section { unit_section, checkpoint_section, frame_section, kind_section, string_section, line_section, macro_section, posting_section };
+
+        template <class T>
+        T at(section s, std::uint64_t i) const {
+            T record;
+            std::memcpy(&record, sections[s] + i * sizeof(T), sizeof(record));
+            return record;
+        }
+
+        index_checkpoint checkpoint(index_unit const& u, std::uint64_t i) const {
+            return at<index_checkpoint>(checkpoint_section, u.first_checkpoint + i);
+        }
+
+        index_macro macro(std::uint64_t i) const {
+            return at<index_macro>(macro_section, i);
+        }
+
+        std::optional<index_macro> find_macro(std::string_view name) const {
+            auto i = search(header.macros, [&](std::uint64_t i) { return macro_name(macro(i)) < name; });
+            if (i == header.macros || macro_name(macro(i)) != name) return {};
+            return macro(i);
+        }
+
+        std::uint64_t posting(std::uint64_t i) const {
+            return at<std::uint64_t>(posting_section, i);
+        }
+
+        std::string_view macro_name(index_macro const& m) const {
+            return std::string_view(trace + m.name_offset, m.name_size);
+        }
+
+        std::string_view bytes(index_bytes const& b) const {
+            return std::string_view(trace + b.offset, b.size);
+        }
+
+        // How many of the first `count` records satisfy `before`, which holds for a prefix
+        template <class BeforeT>
+        static std::uint64_t search(std::uint64_t count, BeforeT&& before) {
+            std::uint64_t first = 0;
+            while (count > 0) {
+                auto half = count / 2;
+                if (before(first + half)) {
+                    first += half + 1;
+                    count -= half + 1;
+                } else {
+                    count = half;
+                }
+            }
+            return first;
+        }
+
+        mapped_file file;
+        char const* trace;
+        trace_index_header header;
+        char const* sections[8];
+    };
+
+    // Builds the index of the trace at `path` in one pass, next to it unless `index_path`
+    // says otherwise. A trace that turns out to be cut short is indexed as far as it can
+    // be read, as replay reads it. False if the trace cannot be read or the index cannot
+    // be written.
+    inline bool index_trace(std::string const& path, std::string index_path = std::string()) {
+        using trace_format::tag;
+
+        auto reader = trace_reader();
+        try {
+            if (!reader.open(path.c_str())) return false;
+        } catch (std::runtime_error const&) {
+            return false;
+        }
+        auto base = reader.data();
+
+        auto header = trace_index_header();
+        std::memcpy(header.magic, trace_index_magic, sizeof(header.magic));
+        header.version = trace_index_version;
+        header.stride = trace_index_stride;
+        header.trace_size = reader.size();
+        header.trace_started = trace_started_time(reader);
+
+        auto units = std::vector<index_unit>();
+        auto checkpoints = std::vector<index_checkpoint>();
+        auto frames = std::vector<std::uint64_t>();
+        auto kinds = std::vector<index_bytes>();
+        auto strings = std::vector<index_bytes>();
+        auto lines = std::vector<index_line>();
+        auto calls = std::unordered_map<std::string_view, std::vector<std::uint64_t>>();
+
+        std::uint64_t event = 0;
+        auto record = trace_record();
+        auto expanding = std::vector<std::uint64_t>();
+        auto rescanning = std::vector<std::uint64_t>();
+        auto unit_lines = std::unordered_map<std::uint64_t, std::uint64_t>();  // file << 32 | line
+        try {
+            while (reader.next_unit()) {
+                units.push_back({reader.unit().offset, event, 0, checkpoints.size(), 0, kinds.size(), 0, strings.size(), 0, lines.size(), 0});
+                auto& u = units.back();
+                expanding.clear();
+                rescanning.clear();
+                unit_lines.clear();
+
+                auto finish = [&] {
+                    u.events = event - u.first_event;
+                    u.checkpoints = checkpoints.size() - u.first_checkpoint;
+                    u.kinds = reader.kind_count();
+                    u.strings = reader.string_count();
+                    for (std::size_t i = 0; i < reader.kind_count(); ++i) {
+                        auto const& k = reader.kind(static_cast<std::uint32_t>(i));
+                        kinds.push_back({static_cast<std::uint64_t>(k.spelling.data() - base), static_cast<std::uint32_t>(k.spelling.size()), k.id});
+                    }
+                    for (std::size_t i = 0; i < reader.string_count(); ++i) {
+                        auto s = reader.string(static_cast<std::uint32_t>(i));
+                        strings.push_back({static_cast<std::uint64_t>(s.data() - base), static_cast<std::uint32_t>(s.size()), 0});
+                    }
+                    for (auto const& [at, first] : unit_lines) {
+                        lines.push_back({static_cast<std::uint32_t>(at >> 32), static_cast<std::uint32_t>(at), first});
+                    }
+                    std::sort(lines.begin() + static_cast<std::ptrdiff_t>(u.first_line), lines.end(), [](index_line const& a, index_line const& b) {
+                        return std::make_pair(a.file, a.line) < std::make_pair(b.file, b.line);
+                    });
+                    u.lines = lines.size() - u.first_line;
+                };
+
+                try {
+                    while (reader.next(record)) {
+                        if (event == u.first_event || event % trace_index_stride == 0) {
+                            auto c = index_checkpoint();
+                            c.offset = record.offset;
+                            c.event = event;
+                            c.first_frame = frames.size();
+                            c.expanding = static_cast<std::uint32_t>(expanding.size());
+                            c.rescanning = static_cast<std::uint32_t>(rescanning.size());
+                            c.kinds = static_cast<std::uint32_t>(reader.kind_count());
+                            c.strings = static_cast<std::uint32_t>(reader.string_count());
+                            if (auto at = reader.position()) {
+                                c.file = at->file;
+                                c.line = at->line;
+                                c.column = at->column;
+                                c.positioned = 1;
+                            }
+                            checkpoints.push_back(c);
+                            frames.insert(frames.end(), expanding.begin(), expanding.end());
+                            frames.insert(frames.end(), rescanning.begin(), rescanning.end());
+                        }
+
+                        // The same frames replay keeps, by the record that opened them
+                        if (record.type != tag::error) {
+                            auto own = (record.type == tag::call || record.type == tag::object_call) && record.depth > 0 ? 1u : 0u;
+                            while (expanding.size() + rescanning.size() > record.depth - own && !rescanning.empty()) {
+                                rescanning.pop_back();
+                            }
+                            unit_lines.try_emplace(std::uint64_t(record.file) << 32 | record.line, event);
+                        }
+                        switch (record.type) {
+                            case tag::object_call:
+                            case tag::call: {
+                                expanding.push_back(record.offset);
+                                if (auto name = called_macro(reader, record)) calls[reader.kind(*name).spelling].push_back(event);
+                                break;
+                            }
+                            case tag::expanded:
+                                if (!expanding.empty()) expanding.pop_back();
+                                rescanning.push_back(record.offset);
+                                break;
+                            case tag::rescanned:
+                                if (!rescanning.empty()) rescanning.pop_back();
+                                break;
+                            default:
+                                break;
+                        }
+                        ++event;
+                    }
+                } catch (std::runtime_error const&) {
+                    finish();
+                    break;
+                }
+                finish();
+            }
+        } catch (std::runtime_error const&) {
+            ;
+        }
+        header.events = event;
+
+        auto names = std::vector<std::string_view>();
+        names.reserve(calls.size());
+        for (auto const& call : calls) {
+            names.push_back(call.first);
+        }
+        std::sort(names.begin(), names.end());
+        auto macros = std::vector<index_macro>();
+        auto postings = std::vector<std::uint64_t>();
+        for (auto name : names) {
+            auto const& events = calls[name];
+            macros.push_back({static_cast<std::uint64_t>(name.data() - base), static_cast<std::uint32_t>(name.size()), 0, postings.size(), events.size()});
+            postings.insert(postings.end(), events.begin(), events.end());
+        }
+
+        header.units = units.size();
+        header.checkpoints = checkpoints.size();
+        header.frames = frames.size();
+        header.kinds = kinds.size();
+        header.strings = strings.size();
+        header.lines = lines.size();
+        header.macros = macros.size();
+        header.postings = postings.size();
+
+        // Written whole and renamed into place, so a replay never maps half an index
+        if (index_path.empty()) index_path = trace_index_path(path);
+        std::ostringstream temporary;
+        temporary << index_path << ".tmp." << ::getpid() << '.' << std::hash<std::thread::id>()(std::this_thread::get_id());
+        {
+            std::ofstream out(temporary.str(), std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) return false;
+            auto put = [&out](auto const& records) {
+                out.write(reinterpret_cast<char const*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(records[0])));
+            };
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            put(units);
+            put(checkpoints);
+            put(frames);
+            put(kinds);
+            put(strings);
+            put(lines);
+            put(macros);
+            put(postings);
+            if (!out) {
+                out.close();
+                std::remove(temporary.str().c_str());
+                return false;
+            }
+        }
+        if (std::rename(temporary.str().c_str(), index_path.c_str()) != 0) {
+            std::remove(temporary.str().c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+#endif // PPSTEP_TRACE_INDEX_HPP
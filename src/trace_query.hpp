@@ -0,0 +1,490 @@
+#ifndef PPSTEP_TRACE_QUERY_HPP
+#define PPSTEP_TRACE_QUERY_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/wave/token_ids.hpp>
+
+#include "trace.hpp"
+
+namespace ppstep {
+    // Aggregate queries over binary traces, for ppstep-query. Each trace is read front to
+    // back exactly once; only the totals, and at most `limit` rows, outlive the pass.
+    enum class trace_query_kind {
+        top,    // macros by calls or output tokens
+        depth,  // deepest top-level invocations
+        match,  // expansions whose result contains a token pattern
+        files,  // events per file
+    };
+
+    struct trace_query {
+        trace_query_kind kind = trace_query_kind::top;
+        bool by_tokens = false;
+        std::size_t limit = 20;  // rows kept; 0 keeps them all
+        std::vector<std::string> pattern;
+    };
+
+    struct macro_totals {
+        macro_totals& operator+=(macro_totals const& other) {
+            calls += other.calls;
+            tokens_out += other.tokens_out;
+            max_depth = std::max(max_depth, other.max_depth);
+            return *this;
+        }
+
+        std::uint64_t calls = 0;
+        std::uint64_t tokens_out = 0;  // significant tokens of its expansions, before rescanning
+        std::uint32_t max_depth = 0;
+    };
+
+    struct file_totals {
+        file_totals& operator+=(file_totals const& other) {
+            lexed += other.lexed;
+            calls += other.calls;
+            expansions += other.expansions;
+            rescans += other.rescans;
+            errors += other.errors;
+            return *this;
+        }
+
+        std::uint64_t events() const {
+            return lexed + calls + expansions + rescans + errors;
+        }
+
+        std::uint64_t lexed = 0;
+        std::uint64_t calls = 0;
+        std::uint64_t expansions = 0;
+        std::uint64_t rescans = 0;
+        std::uint64_t errors = 0;
+    };
+
+    // Where a row came from: the trace (by its place on the command line), the event
+    // number `goto event` takes, and the main position at that event
+    struct query_location {
+        std::size_t trace = 0;
+        std::uint64_t event = 0;
+        std::string file;
+        std::uint32_t line = 0;
+        std::uint32_t column = 0;
+    };
+
+    // A macro called outside of any other expansion, and everything up to the next one
+    struct top_level_invocation {
+        query_location at;
+        std::string macro;
+        std::uint32_t depth = 0;
+        std::uint64_t events = 0;
+    };
+
+    struct expansion_match {
+        query_location at;
+        std::string macro;
+        std::string result;
+    };
+
+    struct trace_query_result {
+        // Adds a later trace's results, as if its events followed this one's
+        void merge(trace_query_result&& other, trace_query const& query) {
+            events += other.events;
+            for (auto& [name, totals] : other.macros) macros[name] += totals;
+            for (auto& [name, totals] : other.files) files[name] += totals;
+            invocation_count += other.invocation_count;
+            for (auto& invocation : other.invocations) keep_invocation(std::move(invocation), query.limit);
+            match_count += other.match_count;
+            for (auto& match : other.matches) {
+                if (query.limit != 0 && matches.size() >= query.limit) break;
+                matches.push_back(std::move(match));
+            }
+        }
+
+        // The deepest `limit` invocations, kept as a heap with the shallowest on top
+        void keep_invocation(top_level_invocation&& invocation, std::size_t limit) {
+            if (limit != 0 && invocations.size() >= limit) {
+                if (!deeper(invocation, invocations.front())) return;
+                std::pop_heap(invocations.begin(), invocations.end(), deeper);
+                invocations.pop_back();
+            }
+            invocations.push_back(std::move(invocation));
+            std::push_heap(invocations.begin(), invocations.end(), deeper);
+        }
+
+        // Ties go to whichever came first
+        static bool deeper(top_level_invocation const& a, top_level_invocation const& b) {
+            return std::make_tuple(b.depth, a.at.trace, a.at.event) < std::make_tuple(a.depth, b.at.trace, b.at.event);
+        }
+
+        std::uint64_t events = 0;
+        std::unordered_map<std::string, macro_totals> macros;
+        std::unordered_map<std::string, file_totals> files;
+        std::uint64_t invocation_count = 0;
+        std::vector<top_level_invocation> invocations;
+        std::uint64_t match_count = 0;
+        std::vector<expansion_match> matches;
+        std::string error;  // why the trace could not be read to the end
+    };
+
+    // Splits a pattern into C tokens: identifiers, pp-numbers, literals and punctuators,
+    // so "F(x,1)" and "F ( x , 1 )" are the same pattern
+    inline std::vector<std::string> split_token_pattern(std::string_view text) {
+        static constexpr std::string_view punctuators[] = {
+            "%:%:", "...", "<<=", ">>=", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+            "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=", "##", "::", ".*", "%:", "<:", ":>", "<%", "%>",
+        };
+        auto word = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+
+        auto tokens = std::vector<std::string>();
+        std::size_t i = 0;
+        while (i < text.size()) {
+            auto c = text[i];
+            auto start = i;
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                ++i;
+                continue;
+            }
+            if (c == '"' || c == '\'') {
+                for (++i; i < text.size() && text[i] != c; ++i) {
+                    if (text[i] == '\\') ++i;
+                }
+                if (i >= text.size()) throw std::runtime_error("unterminated literal in pattern");
+                ++i;
+            } else if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && i + 1 < text.size() && std::isdigit(static_cast<unsigned char>(text[i + 1])))) {
+                for (++i; i < text.size(); ++i) {
+                    auto exponent = (text[i - 1] == 'e' || text[i - 1] == 'E' || text[i - 1] == 'p' || text[i - 1] == 'P');
+                    if (!word(text[i]) && text[i] != '.' && !(exponent && (text[i] == '+' || text[i] == '-'))) break;
+                }
+            } else if (word(c)) {
+                while (i < text.size() && word(text[i])) ++i;
+                // Prefixed literals such as L"..." and u8'x'
+                if (i < text.size() && (text[i] == '"' || text[i] == '\'')) {
+                    auto quote = text[i];
+                    for (++i; i < text.size() && text[i] != quote; ++i) {
+                        if (text[i] == '\\') ++i;
+                    }
+                    if (i >= text.size()) throw std::runtime_error("unterminated literal in pattern");
+                    ++i;
+                }
+            } else {
+                auto length = std::size_t(1);
+                for (auto punctuator : punctuators) {
+                    if (text.compare(i, punctuator.size(), punctuator) == 0) {
+                        length = punctuator.size();
+                        break;
+                    }
+                }
+                i += length;
+            }
+            tokens.emplace_back(text.substr(start, i - start));
+        }
+        return tokens;
+    }
+
+    // One pass over the trace at `path`. Totals are kept per token kind and string while
+    // a unit is read, so the hash tables are only touched the first time a spelling
+    // turns up in each unit.
+    inline trace_query_result run_trace_query(std::string const& path, std::size_t trace, trace_query const& query) {
+        using trace_format::tag;
+
+        // Pages already read are given back every so often
+        constexpr std::size_t release_every = std::size_t(16) << 20;
+        constexpr std::int32_t no_symbol = -1;
+
+        struct kind_info {
+            bool significant;
+            std::int32_t symbol;    // in the pattern, or no_symbol
+            macro_totals* macro;    // once the kind has named a call
+        };
+
+        auto result = trace_query_result();
+        auto reader = trace_reader();
+        if (!reader.open(path.c_str())) throw std::runtime_error("could not open " + path);
+
+        // Keyed by views into the mapping until the trace is done
+        auto macros = std::unordered_map<std::string_view, macro_totals>();
+        auto files = std::unordered_map<std::string_view, file_totals>();
+
+        auto symbols = std::vector<std::string_view>();
+        auto pattern = std::vector<std::int32_t>();
+        for (auto const& token : query.pattern) {
+            auto found = std::find(symbols.begin(), symbols.end(), token);
+            pattern.push_back(static_cast<std::int32_t>(found - symbols.begin()));
+            if (found == symbols.end()) symbols.push_back(token);
+        }
+
+        auto kinds = std::vector<kind_info>();
+        auto strings = std::vector<file_totals*>();
+        auto expanding = std::vector<macro_totals*>();
+        auto callers = std::vector<std::string_view>();
+        auto sequence = std::vector<std::int32_t>();
+        auto open = std::optional<top_level_invocation>();
+        auto record = trace_record();
+        std::size_t released = 0;
+
+        auto info = [&](std::uint32_t kind) -> kind_info& {
+            while (kinds.size() <= kind) {
+                auto const& k = reader.kind(static_cast<std::uint32_t>(kinds.size()));
+                auto id = static_cast<boost::wave::token_id>(k.id);
+                auto significant = !IS_CATEGORY(id, boost::wave::WhiteSpaceTokenType) && !IS_CATEGORY(id, boost::wave::EOFTokenType)
+                                   && id != boost::wave::T_PLACEMARKER;
+                auto found = std::find(symbols.begin(), symbols.end(), k.spelling);
+                auto symbol = found == symbols.end() ? no_symbol : static_cast<std::int32_t>(found - symbols.begin());
+                kinds.push_back({significant, symbol, nullptr});
+            }
+            return kinds[kind];
+        };
+
+        auto file_of = [&](std::uint32_t string) -> file_totals& {
+            if (strings.size() <= string) strings.resize(string + 1, nullptr);
+            auto& totals = strings[string];
+            if (!totals) totals = &files[reader.string(string)];
+            return *totals;
+        };
+
+        auto locate = [&](trace_record const& r) {
+            auto at = query_location();
+            at.trace = trace;
+            at.event = result.events;
+            if (r.file < reader.string_count()) at.file = std::string(reader.string(r.file));
+            at.line = r.line;
+            at.column = r.column;
+            return at;
+        };
+
+        auto close_invocation = [&] {
+            if (!open) return;
+            ++result.invocation_count;
+            result.keep_invocation(std::move(*open), query.limit);
+            open.reset();
+        };
+
+        try {
+            while (reader.next_unit()) {
+                kinds.clear();
+                strings.clear();
+                expanding.clear();
+                callers.clear();
+                auto positioned = false;
+
+                while (reader.next(record)) {
+                    if (record.offset - released >= release_every) {
+                        reader.release_read();
+                        released = record.offset;
+                    }
+
+                    auto is_call = record.type == tag::call || record.type == tag::object_call;
+                    switch (query.kind) {
+                        case trace_query_kind::top:
+                            if (is_call) {
+                                auto name = called_macro(reader, record);
+                                macro_totals* totals = nullptr;
+                                if (name) {
+                                    auto& named = info(*name);
+                                    if (!named.macro) named.macro = &macros[reader.kind(*name).spelling];
+                                    totals = named.macro;
+                                    ++totals->calls;
+                                    totals->max_depth = std::max(totals->max_depth, record.depth);
+                                }
+                                expanding.push_back(totals);
+                            } else if (record.type == tag::expanded && !expanding.empty()) {
+                                if (auto* totals = expanding.back()) {
+                                    for (auto kind : record.lists[1]) {
+                                        if (info(kind).significant) ++totals->tokens_out;
+                                    }
+                                }
+                                expanding.pop_back();
+                            }
+                            break;
+
+                        case trace_query_kind::depth:
+                            // A call's depth counts its own frame
+                            if (is_call && record.depth <= 1) {
+                                close_invocation();
+                                open = top_level_invocation();
+                                open->at = locate(record);
+                                if (auto name = called_macro(reader, record)) open->macro = std::string(reader.kind(*name).spelling);
+                            } else if (record.depth == 0 && record.type != tag::error) {
+                                close_invocation();
+                            }
+                            if (open) {
+                                open->depth = std::max(open->depth, record.depth);
+                                ++open->events;
+                            }
+                            break;
+
+                        case trace_query_kind::match:
+                            if (is_call) {
+                                auto name = called_macro(reader, record);
+                                callers.push_back(name ? reader.kind(*name).spelling : std::string_view());
+                            } else if (record.type == tag::expanded) {
+                                sequence.clear();
+                                for (auto kind : record.lists[1]) {
+                                    auto const& k = info(kind);
+                                    if (k.significant) sequence.push_back(k.symbol);
+                                }
+                                if (!pattern.empty() && std::search(sequence.begin(), sequence.end(), pattern.begin(), pattern.end()) != sequence.end()) {
+                                    if (query.limit == 0 || result.matches.size() < query.limit) {
+                                        auto match = expansion_match();
+                                        match.at = locate(record);
+                                        if (!callers.empty()) match.macro = std::string(callers.back());
+                                        auto text = std::ostringstream();
+                                        write_tokens_normalized(text, record.lists[1], [&](std::uint32_t kind) { return reader.kind(kind).spelling; },
+                                                                [&](std::uint32_t kind) { return !info(kind).significant; });
+                                        match.result = text.str();
+                                        result.matches.push_back(std::move(match));
+                                    }
+                                    ++result.match_count;
+                                }
+                                if (!callers.empty()) callers.pop_back();
+                            }
+                            break;
+
+                        case trace_query_kind::files:
+                            // Errors carry their own file; other events need a main position
+                            positioned = positioned || reader.position().has_value();
+                            if (positioned || record.type == tag::error) {
+                                auto& totals = file_of(record.file);
+                                switch (record.type) {
+                                    case tag::lexed: ++totals.lexed; break;
+                                    case tag::call:
+                                    case tag::object_call: ++totals.calls; break;
+                                    case tag::expanded: ++totals.expansions; break;
+                                    case tag::rescanned: ++totals.rescans; break;
+                                    default: ++totals.errors; break;
+                                }
+                            }
+                            break;
+                    }
+                    ++result.events;
+                }
+                close_invocation();
+            }
+        } catch (std::runtime_error const& e) {
+            close_invocation();
+            result.error = e.what();
+        }
+
+        for (auto const& [name, totals] : macros) result.macros[std::string(name)] += totals;
+        for (auto const& [name, totals] : files) result.files[std::string(name)] += totals;
+        return result;
+    }
+
+    // Rows with the most of `key` first, then by name
+    template <class TotalsT, class KeyT>
+    std::vector<std::pair<std::string const*, TotalsT const*>> top_rows(std::unordered_map<std::string, TotalsT> const& totals, KeyT&& key) {
+        auto rows = std::vector<std::pair<std::string const*, TotalsT const*>>();
+        rows.reserve(totals.size());
+        for (auto const& [name, row] : totals) rows.emplace_back(&name, &row);
+        std::sort(rows.begin(), rows.end(), [&](auto const& a, auto const& b) {
+            auto ka = key(*a.second);
+            auto kb = key(*b.second);
+            return ka != kb ? ka > kb : *a.first < *b.first;
+        });
+        return rows;
+    }
+
+    inline void print_more(std::ostream& os, std::size_t shown, std::uint64_t total, char const* what) {
+        if (total > shown) os << "... " << (total - shown) << " more " << what << '\n';
+    }
+
+    // `traces` names the traces when there are several, so rows can say where they are from
+    inline void print_trace_query(std::ostream& os, trace_query_result& result, trace_query const& query, std::vector<std::string> const& traces) {
+        auto where = [&](query_location const& at) {
+            auto text = at.file + ':' + std::to_string(at.line) + ':' + std::to_string(at.column);
+            if (traces.size() > 1) text = traces[at.trace] + ": " + text;
+            return text;
+        };
+        auto shown = [&](std::size_t size) { return query.limit == 0 ? size : std::min(size, query.limit); };
+
+        switch (query.kind) {
+            case trace_query_kind::top: {
+                if (result.macros.empty()) {
+                    os << "No macro calls in the trace" << std::endl;
+                    return;
+                }
+                auto rows = top_rows(result.macros, [&](macro_totals const& t) { return query.by_tokens ? t.tokens_out : t.calls; });
+                os << std::left << std::setw(32) << "macro" << std::right
+                   << std::setw(12) << "calls"
+                   << std::setw(12) << "tok out"
+                   << std::setw(7) << "depth" << '\n';
+                auto count = shown(rows.size());
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto const& t = *rows[i].second;
+                    os << std::left << std::setw(32) << *rows[i].first << std::right
+                       << std::setw(12) << t.calls
+                       << std::setw(12) << t.tokens_out
+                       << std::setw(7) << t.max_depth << '\n';
+                }
+                print_more(os, count, rows.size(), "macros");
+                break;
+            }
+
+            case trace_query_kind::depth: {
+                if (result.invocations.empty()) {
+                    os << "No macro calls in the trace" << std::endl;
+                    return;
+                }
+                std::sort_heap(result.invocations.begin(), result.invocations.end(), trace_query_result::deeper);
+                os << std::right << std::setw(7) << "depth" << std::setw(12) << "events" << std::setw(12) << "event"
+                   << "  " << std::left << std::setw(32) << "macro" << "location" << '\n';
+                for (auto const& invocation : result.invocations) {
+                    os << std::right << std::setw(7) << invocation.depth
+                       << std::setw(12) << invocation.events
+                       << std::setw(12) << invocation.at.event << "  "
+                       << std::left << std::setw(32) << invocation.macro << where(invocation.at) << '\n';
+                }
+                print_more(os, result.invocations.size(), result.invocation_count, "top-level invocations");
+                break;
+            }
+
+            case trace_query_kind::match:
+                for (auto const& match : result.matches) {
+                    os << "event " << match.at.event << ": " << (match.macro.empty() ? "?" : match.macro) << " at " << where(match.at) << '\n'
+                       << "  " << match.result << '\n';
+                }
+                os << result.match_count << (result.match_count == 1 ? " expansion matches" : " expansions match") << '\n';
+                break;
+
+            case trace_query_kind::files: {
+                if (result.files.empty()) {
+                    os << "No events in the trace" << std::endl;
+                    return;
+                }
+                auto rows = top_rows(result.files, [](file_totals const& t) { return t.events(); });
+                os << std::right << std::setw(12) << "events"
+                   << std::setw(12) << "lexed"
+                   << std::setw(10) << "calls"
+                   << std::setw(10) << "expanded"
+                   << std::setw(11) << "rescanned"
+                   << std::setw(8) << "errors" << "  file" << '\n';
+                auto count = shown(rows.size());
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto const& t = *rows[i].second;
+                    os << std::setw(12) << t.events()
+                       << std::setw(12) << t.lexed
+                       << std::setw(10) << t.calls
+                       << std::setw(10) << t.expansions
+                       << std::setw(11) << t.rescans
+                       << std::setw(8) << t.errors << "  " << *rows[i].first << '\n';
+                }
+                print_more(os, count, rows.size(), "files");
+                break;
+            }
+        }
+        os << std::flush;
+    }
+}
+
+#endif // PPSTEP_TRACE_QUERY_HPP
@@ -153,9 +153,9 @@ namespace ppstep {
         return acc;
     }
 
-    template <class Container>
+    template <class Container, class Pattern>
     std::optional<std::pair<typename Container::const_iterator, typename Container::const_iterator>>
-    find_sublist(Container const& data, Container const& pattern, typename Container::const_iterator it) {
+    find_sublist(Container const& data, Pattern const& pattern, typename Container::const_iterator it) {
         auto end = std::end(data);
         auto match = std::search(it, end, std::begin(pattern), std::end(pattern));
         if (match != end) {
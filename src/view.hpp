@@ -4,7 +4,11 @@
 #include <vector>
 #include <string>
 #include <variant>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <cstdlib>
+#include <fstream>
 
 #include <boost/wave/grammars/cpp_grammar_gen.hpp>
 
@@ -17,6 +21,8 @@
 #include "client_fwd.hpp"
 #include "server_fwd.hpp"
 #include "utils.hpp"
+#include "profiler.hpp"
+#include "replay_context.hpp"
 
 
 namespace ppstep::detail {
@@ -42,15 +48,51 @@ namespace ppstep {
     template <class TokenT, class ContainerT>
     struct client_cli {
 
-        client_cli(client<TokenT, ContainerT>& cl, std::string prefix) : cl(cl), steps_requested(0), prefix(std::move(prefix)) {}
+        client_cli(client<TokenT, ContainerT>& cl, std::string prefix) : cl(cl), steps_requested(0), rewound(0), prefix(std::move(prefix)) {}
 
-        template <class Attr>
-        void step(Attr const& attr) {
-            if (attr) {
-                steps_requested = boost::fusion::at_c<1>(*attr);
+        // While rewound, steps move forward through history first and only the rest run live
+        template <class ContextT, class Attr>
+        void step(ContextT& ctx, Attr const& attr) {
+            std::size_t steps = attr ? boost::fusion::at_c<1>(*attr) : 1;
+            if (steps <= rewound) {
+                rewound -= steps;
+                current_state(ctx);
+                return;
+            }
+            steps_requested = steps - rewound;
+            rewound = 0;
+        }
+
+        template <class ContextT, class Attr>
+        void step_back(ContextT& ctx, Attr const& attr) {
+            if (cl.history_size() == 0) {
+                std::cout << "No history to step back through." << std::endl;
+                return;
+            }
+            std::size_t steps = attr ? boost::fusion::at_c<1>(*attr) : 1;
+            auto oldest = cl.history_size() - 1;
+            if (steps > oldest - rewound) {
+                std::cout << "Reached the oldest event in history." << std::endl;
+                rewound = oldest;
+            } else {
+                rewound += steps;
+            }
+            current_state(ctx);
+        }
+
+        template <class ContextT>
+        void reverse_continue(ContextT& ctx) {
+            if (cl.history_size() == 0) {
+                std::cout << "No history to step back through." << std::endl;
+                return;
+            }
+            if (auto found = cl.find_breakpoint_before(rewound)) {
+                rewound = *found;
             } else {
-                steps_requested = 1;
+                std::cout << "No earlier breakpoint; reached the oldest event in history." << std::endl;
+                rewound = cl.history_size() - 1;
             }
+            current_state(ctx);
         }
 
         template <class Attr>
@@ -70,6 +112,7 @@ namespace ppstep {
 
         void step_continue() {
             steps_requested = 1;
+            rewound = 0;
             cl.set_mode(stepping_mode::UNTIL_BREAK);
         }
         
@@ -77,7 +120,13 @@ namespace ppstep {
         template <class Attr>
         void start_record(Attr const& attr) {
             std::string filename(attr.begin(), attr.end());
-            if (cl.start_recording(filename)) {
+            bool binary = filename.compare(0, 8, "--binary") == 0 && (filename.size() == 8 || std::isspace(static_cast<unsigned char>(filename[8])));
+            if (binary) filename.erase(0, std::min(filename.find_first_not_of(" \t", 8), filename.size()));
+            if (filename.empty()) {
+                std::cout << "Expected a file name to record to" << std::endl;
+                return;
+            }
+            if (cl.start_recording(filename, binary)) {
                 std::cout << "Recording to " << filename << std::endl;
             } else {
                 std::cout << "Failed to open " << filename << " for recording" << std::endl;
@@ -97,6 +146,30 @@ namespace ppstep {
             }
         }
         
+        template <class Attr>
+        void show_profile(Attr const& attr) {
+            auto const& state = cl.get_state();
+            auto rows = profile_rows();
+            state.profiler.collect(state.symbols, rows);
+            print_profile(std::cout, rows, attr ? boost::fusion::at_c<1>(*attr) : 20);
+        }
+
+        template <class Attr>
+        void write_flamegraph(Attr const& attr) {
+            std::string filename(attr.begin(), attr.end());
+            std::ofstream out(filename, std::ios::out | std::ios::trunc);
+            if (!out.is_open()) {
+                std::cout << "Failed to open " << filename << " for writing" << std::endl;
+                return;
+            }
+
+            auto const& state = cl.get_state();
+            auto stacks = folded_stacks();
+            state.profiler.collect_stacks(state.symbols, stacks);
+            write_folded_stacks(out, stacks);
+            std::cout << "Wrote " << stacks.size() << " expansion stacks to " << filename << std::endl;
+        }
+
         template <class ContextT, class Attr>
         void expand_macro(ContextT& ctx, Attr const& attr) {
             using position_type = typename ContextT::position_type;
@@ -180,14 +253,144 @@ namespace ppstep {
             std::cout << std::flush;
         }
         
+        // A replayed trace has no preprocessor behind it to run these against
+        template <class Attr>
+        void expand_macro(replay_context&, Attr const&) {
+            not_replayable("expand");
+        }
+
+        template <class Attr>
+        void define_macro(replay_context&, Attr const&) {
+            not_replayable("#define");
+        }
+
+        template <class Attr>
+        void undefine_macro(replay_context&, Attr const&) {
+            not_replayable("#undef");
+        }
+
+        template <class Attr>
+        void include_file(replay_context&, Attr const&) {
+            not_replayable("#include");
+        }
+
+        void show_macros(replay_context const&) {
+            not_replayable("macros");
+        }
+
+        void not_replayable(char const* command) {
+            std::cout << '"' << command << "\" needs a live preprocessor and is not available while replaying a trace." << std::endl;
+        }
+
+        // Moving around a trace needs one to move around in
+        template <class Context, class Attr>
+        void goto_event(Context&, Attr const&) {
+            only_replayable("goto");
+        }
+
+        template <class Context, class Attr>
+        void goto_line(Context&, Attr const&) {
+            only_replayable("goto");
+        }
+
+        template <class Context, class Attr>
+        void find_call(Context&, Attr const&) {
+            only_replayable("find");
+        }
+
+        void only_replayable(char const* command) {
+            std::cout << '"' << command << "\" is only available while replaying a trace." << std::endl;
+        }
+
+        template <class Attr>
+        void goto_event(replay_context& ctx, Attr const& attr) {
+            auto event = static_cast<std::uint64_t>(attr);
+            auto const* index = ctx.navigator().index();
+            if (!index) {
+                std::cout << "The trace could not be indexed." << std::endl;
+                return;
+            }
+            if (event >= index->events()) {
+                std::cout << "The trace has " << index->events() << " events." << std::endl;
+                return;
+            }
+            jump(ctx, event);
+        }
+
+        // `line` is a line of the file being preprocessed, or `file:line` for another one,
+        // named by its path or just its last components
+        template <class Attr>
+        void goto_line(replay_context& ctx, Attr const& attr) {
+            auto spec = std::string(attr.begin(), attr.end());
+            auto colon = spec.rfind(':');
+            auto file = colon == std::string::npos ? ctx.get_main_pos().get_file() : spec.substr(0, colon);
+            auto number = colon == std::string::npos ? spec : spec.substr(colon + 1);
+            if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos) {
+                std::cout << "Expected a line number, found \"" << number << "\"." << std::endl;
+                return;
+            }
+
+            auto& nav = ctx.navigator();
+            auto const* index = nav.index();
+            auto unit = nav.unit();
+            if (!index || !unit) {
+                std::cout << "The trace could not be indexed." << std::endl;
+                return;
+            }
+            auto line = static_cast<std::uint32_t>(std::stoul(number));
+            for (std::uint64_t i = 0; i < unit->strings; ++i) {
+                if (!names_file(index->string(*unit, i), file)) continue;
+                auto event = index->first_event_on(*unit, static_cast<std::uint32_t>(i), line);
+                if (!event) continue;
+                jump(ctx, *event);
+                return;
+            }
+            std::cout << "Nothing happened on or after line " << line << " of " << file << '.' << std::endl;
+        }
+
+        template <class Attr>
+        void find_call(replay_context& ctx, Attr const& attr) {
+            auto name = std::string(attr.begin(), attr.end());
+            auto& nav = ctx.navigator();
+            auto const* index = nav.index();
+            if (!index) {
+                std::cout << "The trace could not be indexed." << std::endl;
+                return;
+            }
+            auto calls = index->call_count(name);
+            auto found = index->next_call(name, nav.next_event());
+            if (!found) {
+                std::cout << (calls == 0 ? "No calls of " : "No more calls of ") << name << " (" << calls << " in the trace)." << std::endl;
+                return;
+            }
+            std::cout << name << ": call " << found->first + 1 << " of " << calls << '.' << std::endl;
+            jump(ctx, found->second);
+        }
+
+        static bool names_file(std::string_view path, std::string_view file) {
+            if (path == file) return true;
+            return path.size() > file.size() && path.compare(path.size() - file.size(), file.size(), file) == 0
+                && path[path.size() - file.size() - 1] == '/';
+        }
+
+        // The replay jumps once the prompt returns and stops at the first event from there on
+        void jump(replay_context& ctx, std::uint64_t event) {
+            std::cout << "Jumping to event " << event << '.' << std::endl;
+            ctx.navigator().jump_to(event);
+            steps_requested = 1;
+            rewound = 0;
+            cl.set_mode(stepping_mode::FREE);
+        }
+        
         void expanding_trace() {
-            auto const& expanding = cl.get_state().expanding;
+            auto const& state = cl.get_state();
+            auto const& expanding = state.expanding;
 
             std::size_t idx = 0;
             for (auto it = expanding.rbegin(); it != expanding.rend(); ++it, ++idx) {
                 std::cout << idx << ": ";
                 try {
-                    print_token_container(std::cout, *it) << std::endl;
+                    print_token_container(std::cout, state.range(*it)) << std::endl;
                 } catch (...) {
                     std::cout << "<error_printing_tokens>" << std::endl;
                 }
@@ -195,14 +398,15 @@ namespace ppstep {
         }
         
         void rescanning_trace() {
-            auto const& rescanning = cl.get_state().rescanning;
+            auto const& state = cl.get_state();
+            auto const& rescanning = state.rescanning;
 
             std::size_t idx = 0;
             for (auto it = rescanning.rbegin(); it != rescanning.rend(); ++it, ++idx) {
                 auto const& [cause, initial] = *it;
                 std::cout << idx << ": ";
                 try {
-                    print_token_container(std::cout, initial) << '\n';
+                    print_token_container(std::cout, state.range(initial)) << '\n';
                 } catch (...) {
                     std::cout << "<error_printing_tokens>\n";
                 }
@@ -213,7 +417,7 @@ namespace ppstep {
                 }
                 std::cout << std::string(padding_width, ' ') << "  caused by ";
                 try {
-                    print_token_container(std::cout, cause) << std::endl;
+                    print_token_container(std::cout, state.range(cause)) << std::endl;
                 } catch (...) {
                     std::cout << "<error_printing_tokens>" << std::endl;
                 }
@@ -225,8 +429,8 @@ namespace ppstep {
         }
         
         void explain_current_state() {
-            auto latest = cl.newest_history();
-            if (latest == cl.oldest_history())
+            auto latest = cl.event_at(rewound);
+            if (!latest)
                 return;
             
             try {
@@ -238,14 +442,20 @@ namespace ppstep {
 
         template <class ContextT>
         void current_state(ContextT& ctx) {
-            auto latest = cl.newest_history();
-            if (latest == cl.oldest_history())
+            auto latest = cl.event_at(rewound);
+            if (!latest)
                 return;
             
             try {
-                auto pos = ctx.get_main_pos();
-                auto pos_file = boost::filesystem::path(pos.get_file().begin(), pos.get_file().end()).filename().string();
-                std::cout << '[' << pos_file << ':' << pos.get_line() << ':'  << pos.get_column() << "]: ";
+                if (rewound) {
+                    // Rewound states show where the input stood back then
+                    auto where = cl.position_at(rewound);
+                    std::cout << '[' << boost::filesystem::path(where).filename().string() << "] (-" << rewound << "): ";
+                } else {
+                    auto pos = ctx.get_main_pos();
+                    auto pos_file = boost::filesystem::path(pos.get_file().begin(), pos.get_file().end()).filename().string();
+                    std::cout << '[' << pos_file << ':' << pos.get_line() << ':'  << pos.get_column() << "]: ";
+                }
                 
                 // Wrap the event printing in try-catch - this is where corrupted tokens can cause crashes
                 try {
@@ -275,17 +485,21 @@ namespace ppstep {
 
             auto anything = +(print);
 
-#define PPSTEP_ACTION(...) ([this, &ctx](auto const& attr){ __VA_ARGS__; })
+#define PPSTEP_ACTION(...) ([this, &ctx]([[maybe_unused]] auto const& attr){ __VA_ARGS__; })
 
             qi::rule<Iterator, ascii::space_type> grammar =
                 // PUT RECORDING COMMANDS FIRST BEFORE OTHER COMMANDS
                   lexeme[(lit("record") | lit("rec")) > +space > anything[PPSTEP_ACTION(start_record(attr))]]
               | (lit("stoprecord") | lit("sr"))[PPSTEP_ACTION(stop_record())]
               | lit("status")[PPSTEP_ACTION(status())]
-              | lexeme[(lit("step") | lit("s")) >> -(+space >> uint_)][PPSTEP_ACTION(step(attr))]
+              | lexeme[lit("profile") >> -(+space >> uint_)][PPSTEP_ACTION(show_profile(attr))]
+              | lexeme[lit("flamegraph") > +space > anything[PPSTEP_ACTION(write_flamegraph(attr))]]
+              | lexeme[(lit("step") | lit("s")) >> -(+space >> uint_)][PPSTEP_ACTION(step(ctx, attr))]
               | (lit("continue") | lit("c"))[PPSTEP_ACTION(step_continue())]
               | lexeme[(lit("backtrace") | lit("bt"))[PPSTEP_ACTION(expanding_trace())]]
               | lexeme[(lit("forwardtrace") | lit("ft"))[PPSTEP_ACTION(rescanning_trace())]]
+              | lexeme[lit("back") >> -(+space >> uint_)][PPSTEP_ACTION(step_back(ctx, attr))]
+              | (lit("reverse-continue") | lit("rc"))[PPSTEP_ACTION(reverse_continue(ctx))]
               | lexeme[
                   (lit("break") | lit("b")) >> *space > (
                         lit("error")[PPSTEP_ACTION(cl.set_break_on_error(true))]
@@ -311,6 +525,12 @@ namespace ppstep {
                       | (lit("l") > +space > anything[PPSTEP_ACTION(remove_breakpoint(attr, preprocessing_event_type::LEXED))])
                 )]
               | lexeme[(lit("target") | lit("t")) > +space > anything[PPSTEP_ACTION(set_target(attr))]]
+              | lexeme[
+                  lit("goto") > +space > (
+                        (lit("event") > +space > qi::ulong_long[PPSTEP_ACTION(goto_event(ctx, attr))])
+                      | (lit("line") > +space > anything[PPSTEP_ACTION(goto_line(ctx, attr))])
+                )]
+              | lexeme[lit("find") > +space > anything[PPSTEP_ACTION(find_call(ctx, attr))]]
               | lexeme[(lit("expand") | lit("e")) > +space > anything[PPSTEP_ACTION(expand_macro(ctx, attr))]]
               | lexeme[lit("#define") > +space > anything[PPSTEP_ACTION(define_macro(ctx, attr))]]
               | lexeme[lit("#undef") > +space > anything[PPSTEP_ACTION(undefine_macro(ctx, attr))]]
@@ -322,7 +542,7 @@ namespace ppstep {
 
 #undef PPSTEP_ACTION
 
-            qi::on_error<qi::fail>(grammar, [](auto const& args, auto const& ctx, auto const&) {
+            qi::on_error<qi::fail>(grammar, [](auto const& args, auto const&, auto const&) {
                 std::cout << "Found unexpected argument \"" << boost::fusion::at_c<2>(args) << "\" while parsing \"" << boost::fusion::at_c<0>(args) << "\". Expected: " << boost::fusion::at_c<3>(args) << std::endl;
             });
 
@@ -376,6 +596,7 @@ namespace ppstep {
     private:
         client<TokenT, ContainerT>& cl;
         std::size_t steps_requested;
+        std::size_t rewound;  // how many events back from the newest the prompt is showing
         std::string prefix;
     };
 }
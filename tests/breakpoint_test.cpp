@@ -0,0 +1,137 @@
+// Breakpoint conditions: compiling and evaluating `&&`/`||` clauses over the facts of
+// an event, rejecting malformed conditions with std::runtime_error, and which
+// breakpoints apply to a macro through exact names, globs and regexes.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "breakpoint.hpp"
+#include "name_automaton.hpp"
+#include "check.hpp"
+
+namespace {
+    ppstep::breakpoint_facts facts(std::size_t depth, std::vector<std::vector<ppstep::symbol_id>> arguments = {},
+                                   std::vector<ppstep::symbol_id> result = {}) {
+        auto f = ppstep::breakpoint_facts();
+        f.depth = depth;
+        f.size = result.size();
+        f.result = std::move(result);
+        f.arguments = std::move(arguments);
+        return f;
+    }
+
+    void conditions() {
+        auto symbols = ppstep::symbol_table();
+        auto holds = [&symbols](char const* source, ppstep::breakpoint_facts const& f) {
+            return ppstep::breakpoint_condition::compile(source, symbols).evaluate(f);
+        };
+        auto bar = symbols.intern("BAR");
+        auto baz = symbols.intern("BAZ");
+
+        CHECK(ppstep::breakpoint_condition().evaluate(facts(0)));
+        CHECK(ppstep::breakpoint_condition().empty());
+
+        CHECK(holds("depth>8", facts(9)));
+        CHECK(!holds("depth>8", facts(8)));
+        CHECK(holds("depth >= 8", facts(8)));
+        CHECK(holds("depth<=2", facts(2)));
+        CHECK(holds("depth<3", facts(2)));
+        CHECK(holds("depth==2", facts(2)));
+        CHECK(holds("depth != 2", facts(3)));
+
+        CHECK(holds("argc == 2", facts(1, {{bar}, {baz}})));
+        CHECK(holds("arg[1].size == 2", facts(1, {{bar}, {bar, baz}})));
+        CHECK(!holds("arg[2].size == 0", facts(1, {{bar}, {baz}})));
+        CHECK(holds("arg[0] contains BAR", facts(1, {{bar}, {baz}})));
+        CHECK(!holds("arg[1] contains BAR", facts(1, {{bar}, {baz}})));
+        CHECK(!holds("arg[5] contains BAR", facts(1, {{bar}})));
+        CHECK(holds("result contains BAZ", facts(1, {}, {bar, baz})));
+        CHECK(holds("result.size == 2 && size == 2", facts(1, {}, {bar, baz})));
+
+        // `&&` binds tighter than `||`, in either spelling
+        CHECK(holds("depth>8 && arg[0] contains BAR", facts(9, {{bar}})));
+        CHECK(!holds("depth>8 && arg[0] contains BAR", facts(9, {{baz}})));
+        CHECK(holds("depth>8 and arg[0] contains BAZ or depth==1", facts(1, {{bar}})));
+        CHECK(holds("depth==1 || depth==2 && argc==5", facts(1)));
+        CHECK(!holds("depth==3 || depth==2 && argc==5", facts(2)));
+
+        auto condition = ppstep::breakpoint_condition::compile("arg[0] contains X || result contains Y", symbols);
+        CHECK(condition.source() == "arg[0] contains X || result contains Y");
+        CHECK(condition.uses_arguments());
+        CHECK(condition.uses_result());
+        CHECK(!ppstep::breakpoint_condition::compile("depth > 1", symbols).uses_result());
+    }
+
+    void malformed() {
+        auto symbols = ppstep::symbol_table();
+        for (auto source : {"", "depth", "depth >", "depth > x", "depth ~ 3", "depths > 3", "arg 0 contains X",
+                            "arg[0 contains X", "arg[].size > 1", "arg[0].length > 1", "result > 3", "result contains",
+                            "depth > 1 &&", "depth > 1 || ", "depth > 1 depth > 2", "argc == 1 & argc == 2"}) {
+            if (!ppstep_test::rejects([&] { ppstep::breakpoint_condition::compile(source, symbols); })) {
+                std::fprintf(stderr, "accepted: \"%s\"\n", source);
+                CHECK(!"malformed condition was accepted");
+            }
+        }
+    }
+
+    void lists() {
+        auto symbols = ppstep::symbol_table();
+        auto list = ppstep::breakpoint_list();
+        auto cat = symbols.intern("BOOST_PP_CAT");
+        auto seq = symbols.intern("BOOST_PP_SEQ_FOR_EACH");
+        auto other = symbols.intern("OTHER");
+
+        CHECK(list.empty());
+        list.add("OTHER", ppstep::breakpoint_condition(), symbols);
+        list.add("BOOST_PP_*", ppstep::breakpoint_condition::compile("depth > 1", symbols), symbols);
+        list.add("/.*_SEQ_.*/", ppstep::breakpoint_condition(), symbols);
+        CHECK(!list.empty());
+
+        CHECK(list.of(other, symbols).size() == 1);
+        CHECK(list.of(cat, symbols).size() == 1);
+        CHECK(list.of(seq, symbols).size() == 2);
+        CHECK(list.of(symbols.intern("UNRELATED"), symbols).empty());
+        CHECK(list.of(ppstep::no_symbol, symbols).empty());
+
+        // The memo is dropped when the breakpoints change
+        list.remove("BOOST_PP_*", symbols);
+        CHECK(list.of(cat, symbols).empty());
+        CHECK(list.of(seq, symbols).size() == 1);
+        list.remove("OTHER", symbols);
+        CHECK(list.of(other, symbols).empty());
+
+        CHECK(ppstep::breakpoint_list::is_pattern("A*"));
+        CHECK(ppstep::breakpoint_list::is_pattern("/A/"));
+        CHECK(!ppstep::breakpoint_list::is_pattern("A_B"));
+        CHECK(ppstep_test::rejects([&] { list.add("/(/", ppstep::breakpoint_condition(), symbols); }));
+    }
+
+    // A name that alone visits more DFA states than the automaton keeps: whether the
+    // 13th character from the end is an `a` takes 2^13 states to track
+    void large_names() {
+        auto automaton = ppstep::name_automaton();
+        automaton.add_regex("a............$");
+
+        auto name = std::string();
+        std::uint32_t seed = 1;
+        for (int i = 0; i < 3 * 8192; ++i) {
+            seed = seed * 1103515245 + 12345;
+            name += (seed >> 16) & 1 ? 'a' : 'b';
+        }
+        for (auto end : {name.size(), name.size() - 1, name.size() - 2}) {
+            auto prefix = std::string_view(name).substr(0, end);
+            auto expected = prefix[prefix.size() - 13] == 'a';
+            CHECK(automaton.match(prefix).empty() != expected);
+        }
+    }
+}
+
+int main() {
+    conditions();
+    malformed();
+    lists();
+    large_names();
+    return ppstep_test::finish("breakpoint_test");
+}
@@ -0,0 +1,68 @@
+#ifndef PPSTEP_TESTS_CHECK_HPP
+#define PPSTEP_TESTS_CHECK_HPP
+
+// Just enough of a harness for the test programs: every failed check is reported,
+// and the program's exit status says whether any failed.
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+namespace ppstep_test {
+    inline int failures = 0;
+
+    inline void report(bool passed, char const* what, char const* file, int line) {
+        if (passed) return;
+        ++failures;
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+
+    // Runs `body` and reports whether it threw std::runtime_error, as bad input must;
+    // anything else escaping is a failure of its own
+    template <class BodyT>
+    bool rejects(BodyT&& body) {
+        try {
+            body();
+        } catch (std::runtime_error const&) {
+            return true;
+        } catch (std::exception const& e) {
+            std::fprintf(stderr, "unexpected exception: %s\n", e.what());
+        }
+        return false;
+    }
+
+    // A file name under the system temporary directory, unique to this process
+    inline std::string temp_path(std::string_view name) {
+        auto path = std::filesystem::temp_directory_path() / ("ppstep_test_" + std::to_string(::getpid()) + "_" + std::string(name));
+        return path.string();
+    }
+
+    inline void write_file(std::string const& path, std::string_view bytes) {
+        std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    }
+
+    inline std::string read_file(std::string const& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    inline int finish(char const* name) {
+        if (failures == 0) {
+            std::printf("%s: all checks passed\n", name);
+            return 0;
+        }
+        std::printf("%s: %d checks failed\n", name, failures);
+        return 1;
+    }
+}
+
+#define CHECK(condition) ::ppstep_test::report(static_cast<bool>(condition), #condition, __FILE__, __LINE__)
+
+#endif // PPSTEP_TESTS_CHECK_HPP
@@ -0,0 +1,7 @@
+#ifndef FROM_COMMAND_LINE
+#error the entry's -U won over the command line's -D
+#endif
+#ifdef FROM_ENTRY
+#error the entry's -D won over the command line's -U
+#endif
+int unit;
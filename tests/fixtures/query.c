@@ -0,0 +1,9 @@
+#define CAT(a, b) a ## b
+#define TWICE(x) CAT(x, x)
+#define ONE 1
+#define WRAP(x) (x)
+
+int once = ONE;
+int twice = TWICE(ONE);
+int joined = CAT(to, ken);
+int wrapped = WRAP(TWICE(2));
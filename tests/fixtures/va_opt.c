@@ -0,0 +1,6 @@
+#define F(a, ...) f(a __VA_OPT__(,) __VA_ARGS__)
+#define G(x) F(x, 1, 2) F(x)
+#define H(x) [G(x)]
+
+H(7)
+G(8)
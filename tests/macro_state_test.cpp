@@ -0,0 +1,120 @@
+// Round trip of a context's macro table through save_macro_state and
+// load_macro_state, with -D and -U keeping precedence over the snapshot, and the
+// loader's handling of damaged snapshots: only ever std::runtime_error.
+
+#define BOOST_WAVE_ENABLE_COMMANDLINE_MACROS 1
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/wave.hpp>
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+#include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
+#include <boost/wave/cpplexer/re2clex/cpp_re2c_lexer.hpp>
+
+#include "macro_state.hpp"
+#include "check.hpp"
+
+namespace {
+    using token_type = boost::wave::cpplexer::lex_token<>;
+    using context_type = boost::wave::context<char const*, boost::wave::cpplexer::lex_iterator<token_type>>;
+
+    constexpr char input[] = "";
+
+    struct macro {
+        bool defined = false;
+        bool has_params = false;
+        std::vector<std::string> parameters;
+        std::string definition;  // without whitespace
+    };
+
+    macro lookup(context_type const& ctx, std::string const& name) {
+        auto result = macro();
+        bool is_predefined;
+        context_type::position_type pos;
+        std::vector<token_type> parameters;
+        context_type::token_sequence_type definition;
+        result.defined = ctx.get_macro_definition(name, result.has_params, is_predefined, pos, parameters, definition);
+        for (auto const& token : parameters) result.parameters.emplace_back(token.get_value().c_str());
+        for (auto const& token : definition) {
+            if (!IS_CATEGORY(token, boost::wave::WhiteSpaceTokenType)) result.definition += token.get_value().c_str();
+        }
+        return result;
+    }
+
+    void round_trip(std::string const& path) {
+        auto saved = context_type(input, input, "saved.c");
+        saved.add_macro_definition(std::string("OBJ=42"));
+        saved.add_macro_definition(std::string("F(a,b)=a + b"));
+        saved.add_macro_definition(std::string("GONE=1"));
+        saved.add_macro_definition(std::string("EMPTY="));
+        ppstep::save_macro_state(saved, path);
+
+        // A -D on the new command line comes before the snapshot and wins
+        auto loaded = context_type(input, input, "loaded.c");
+        loaded.add_macro_definition(std::string("OBJ=7"));
+        CHECK(ppstep::load_macro_state(loaded, path) == 3);
+        // and a -U comes after it
+        loaded.remove_macro_definition(std::string("GONE"), true);
+
+        auto f = lookup(loaded, "F");
+        CHECK(f.defined && f.has_params);
+        CHECK(f.parameters == (std::vector<std::string>{"a", "b"}));
+        CHECK(f.definition == "a+b");
+        CHECK(lookup(loaded, "OBJ").definition == "7");
+        CHECK(lookup(loaded, "EMPTY").defined);
+        CHECK(lookup(loaded, "EMPTY").definition.empty());
+        CHECK(!lookup(loaded, "GONE").defined);
+        CHECK(lookup(loaded, "__STDC__").defined);
+    }
+
+    void corrupt(std::string const& path) {
+        auto snapshot = ppstep_test::read_file(path);
+        auto ctx = context_type(input, input, "corrupt.c");
+        auto rejected = [&](std::string const& bytes) {
+            ppstep_test::write_file(path, bytes);
+            return ppstep_test::rejects([&] { ppstep::load_macro_state(ctx, path); });
+        };
+
+        // Every macro the header counts must be there, so any cut is caught
+        for (std::size_t size = 0; size < snapshot.size(); ++size) {
+            CHECK(rejected(snapshot.substr(0, size)));
+        }
+
+        auto with = [&snapshot](std::size_t offset, std::uint32_t value) {
+            auto bytes = snapshot;
+            std::memcpy(&bytes[offset], &value, sizeof(value));
+            return bytes;
+        };
+        auto const version = sizeof(ppstep::macro_state_detail::magic);
+        auto const string_count = version + sizeof(std::uint32_t);
+
+        CHECK(rejected(with(0, 0)));
+        CHECK(rejected(with(version, ppstep::macro_state_detail::version + 1)));
+        CHECK(rejected(with(string_count, ~std::uint32_t(0))));
+
+        // The macro count follows the string table
+        std::uint32_t strings;
+        std::memcpy(&strings, &snapshot[string_count], sizeof(strings));
+        auto offset = string_count + sizeof(std::uint32_t);
+        for (std::uint32_t i = 0; i < strings; ++i) {
+            std::uint32_t size;
+            std::memcpy(&size, &snapshot[offset], sizeof(size));
+            offset += sizeof(size) + size;
+        }
+        CHECK(rejected(with(offset, ~std::uint32_t(0))));
+        // The first macro's name, then its parameter count after flags and position
+        CHECK(rejected(with(offset + sizeof(std::uint32_t), strings)));
+        CHECK(rejected(with(offset + 2 * sizeof(std::uint32_t) + 1 + ppstep::macro_state_detail::position_size, ~std::uint32_t(0))));
+    }
+}
+
+int main() {
+    auto path = ppstep_test::temp_path("macros");
+    round_trip(path);
+    corrupt(path);
+    std::remove(path.c_str());
+    return ppstep_test::finish("macro_state_test");
+}
@@ -0,0 +1,144 @@
+// Round trip of lexed token streams through token_blob_writer, the token cache
+// directory and token_blob::parse, and the parser's handling of damaged cache files:
+// anything that does not hold up must be a miss, never a stream Wave would choke on.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+
+#include "token_cache.hpp"
+#include "check.hpp"
+
+namespace {
+    using token_type = boost::wave::cpplexer::lex_token<>;
+    using position_type = token_type::position_type;
+
+    constexpr auto language = boost::wave::support_cpp;
+
+    std::vector<token_type> sample_tokens() {
+        using namespace boost::wave;
+        return {
+            token_type(T_PP_DEFINE, "#define", position_type("a.h", 1, 1)),
+            token_type(T_SPACE, " ", position_type("a.h", 1, 8)),
+            token_type(T_IDENTIFIER, "F", position_type("a.h", 1, 9)),
+            token_type(T_NEWLINE, "\n", position_type("a.h", 1, 10)),
+            token_type(T_IDENTIFIER, "F", position_type("a.h", 2, 1)),
+            token_type(T_INTLIT, "42", position_type("a.h", 2, 3)),
+            token_type(T_EOF, "", position_type("a.h", 3, 1)),
+        };
+    }
+
+    std::shared_ptr<ppstep::mapped_file const> map(std::string const& path) {
+        auto file = std::make_shared<ppstep::mapped_file>();
+        CHECK(file->open(path.c_str()));
+        return file;
+    }
+
+    std::optional<ppstep::token_blob> parse(std::string const& path, std::string const& blob, ppstep::token_cache_key const& key) {
+        ppstep_test::write_file(path, blob);
+        return ppstep::token_blob::parse(map(path), key);
+    }
+
+    void round_trip(std::string const& path, std::string const& blob, ppstep::token_cache_key const& key) {
+        auto tokens = sample_tokens();
+        auto parsed = parse(path, blob, key);
+        CHECK(parsed);
+        if (!parsed) return;
+
+        CHECK(parsed->token_count == tokens.size());
+        for (std::size_t i = 0; i < tokens.size() && i < parsed->token_count; ++i) {
+            auto record = parsed->record(i);
+            CHECK(record.id == static_cast<std::uint32_t>(boost::wave::token_id(tokens[i])));
+            CHECK(parsed->strings[record.value] == ppstep::token_spelling(tokens[i]));
+            CHECK(record.line == tokens[i].get_position().get_line());
+            CHECK(record.column == tokens[i].get_position().get_column());
+        }
+        // Repeated spellings share one string
+        CHECK(parsed->strings.size() == tokens.size() - 1);
+
+        // Another language or other contents are other streams
+        auto other_language = key;
+        other_language.language = static_cast<std::uint32_t>(boost::wave::support_c99);
+        CHECK(!parse(path, blob, other_language));
+        auto other_contents = key;
+        ++other_contents.content_hash;
+        CHECK(!parse(path, blob, other_contents));
+    }
+
+    void through_directory(std::string const& directory, std::string const& blob, ppstep::token_cache_key const& key) {
+        auto& cache = ppstep::token_cache::shared();
+        CHECK(cache.set_directory(directory));
+        CHECK(cache.is_enabled());
+        CHECK(!cache.find(key));
+        cache.store(key, blob);
+        auto found = cache.find(key);
+        CHECK(found && found->token_count == sample_tokens().size());
+        std::filesystem::remove_all(directory);
+    }
+
+    void corrupt(std::string const& path, std::string const& blob, ppstep::token_cache_key const& key) {
+        // Cut off anywhere
+        for (std::size_t size = 0; size < blob.size(); ++size) {
+            CHECK(!parse(path, blob.substr(0, size), key));
+        }
+
+        auto header = ppstep::token_cache_header();
+        std::memcpy(&header, blob.data(), sizeof(header));
+        auto records = blob.size() - header.token_count * sizeof(ppstep::token_record);
+
+        // Each field of a record that the replay lexer trusts
+        auto damaged = [&](std::size_t index, std::size_t field, std::uint32_t value) {
+            auto bytes = blob;
+            std::memcpy(&bytes[records + index * sizeof(ppstep::token_record) + field], &value, sizeof(value));
+            return !parse(path, bytes, key);
+        };
+        CHECK(damaged(2, offsetof(ppstep::token_record, value), header.string_count));
+        CHECK(damaged(2, offsetof(ppstep::token_record, value), ~std::uint32_t(0)));
+        CHECK(damaged(5, offsetof(ppstep::token_record, id), 0));
+        CHECK(damaged(5, offsetof(ppstep::token_record, id), ~std::uint32_t(0)));
+        CHECK(damaged(0, offsetof(ppstep::token_record, id), boost::wave::T_LAST_TOKEN));
+
+        // Counts larger than the file
+        auto counted = [&](std::size_t field, std::uint32_t value) {
+            auto bytes = blob;
+            std::memcpy(&bytes[field], &value, sizeof(value));
+            return !parse(path, bytes, key);
+        };
+        CHECK(counted(offsetof(ppstep::token_cache_header, token_count), header.token_count + 1));
+        CHECK(counted(offsetof(ppstep::token_cache_header, token_count), ~std::uint32_t(0)));
+        CHECK(counted(offsetof(ppstep::token_cache_header, string_count), ~std::uint32_t(0)));
+        CHECK(counted(offsetof(ppstep::token_cache_header, version), ppstep::token_cache_version + 1));
+
+        auto magic = blob;
+        magic[0] = 'X';
+        CHECK(!parse(path, magic, key));
+    }
+}
+
+int main() {
+    auto source = ppstep_test::temp_path("a.h");
+    auto path = ppstep_test::temp_path("a.tok");
+    ppstep_test::write_file(source, "#define F\nF 42\n");
+
+    auto content = ppstep::mapped_file();
+    CHECK(content.open(source.c_str()));
+    auto key = ppstep::token_cache_key::of(content, language);
+
+    auto writer = ppstep::token_blob_writer<token_type>();
+    for (auto const& token : sample_tokens()) writer.add(token);
+    auto blob = writer.finish(key);
+
+    round_trip(path, blob, key);
+    through_directory(ppstep_test::temp_path("cache"), blob, key);
+    corrupt(path, blob, key);
+
+    std::remove(source.c_str());
+    std::remove(path.c_str());
+    return ppstep_test::finish("token_cache_test");
+}
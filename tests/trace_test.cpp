@@ -0,0 +1,217 @@
+// Round trip of the binary trace format through trace_recorder and trace_reader, and
+// the reader's handling of truncated and corrupt traces: bad input may only ever end
+// a unit early or throw std::runtime_error.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+
+#include "trace.hpp"
+#include "check.hpp"
+
+namespace {
+    using token_type = boost::wave::cpplexer::lex_token<>;
+    using position_type = token_type::position_type;
+    using tokens = std::vector<token_type>;
+    using ppstep::trace_format::tag;
+
+    token_type make(boost::wave::token_id id, char const* spelling) {
+        return token_type(id, spelling, position_type("a.c", 1, 1));
+    }
+
+    token_type name(char const* spelling) {
+        return make(boost::wave::T_IDENTIFIER, spelling);
+    }
+
+    // Spellings of a record's token list
+    std::vector<std::string_view> spelled(ppstep::trace_reader const& reader, std::vector<std::uint32_t> const& list) {
+        auto result = std::vector<std::string_view>();
+        for (auto kind : list) result.push_back(reader.kind(kind).spelling);
+        return result;
+    }
+
+    using spellings = std::vector<std::string_view>;
+
+    // Reads every unit and record, the way ppstep-query and --replay do
+    void read_all(std::string const& path) {
+        auto reader = ppstep::trace_reader();
+        if (!reader.open(path.c_str())) return;
+        auto record = ppstep::trace_record();
+        while (reader.next_unit()) {
+            while (reader.next(record)) {}
+        }
+    }
+
+    std::string record_sample(std::string const& path) {
+        auto symbols = ppstep::symbol_table();
+        auto recorder = ppstep::trace_recorder(symbols);
+        CHECK(recorder.open(path, true, "unit.c"));
+
+        auto call = tokens{name("F"), make(boost::wave::T_LEFTPAREN, "("), name("x"), make(boost::wave::T_COMMA, ","),
+                           make(boost::wave::T_SPACE, " "), name("y"), make(boost::wave::T_RIGHTPAREN, ")")};
+        auto arguments = std::vector<tokens>{{name("x")}, {make(boost::wave::T_SPACE, " "), name("y")}};
+        auto result = tokens{name("x"), make(boost::wave::T_PLUS, "+"), name("y")};
+
+        recorder.lexed({"a.c", 1, 1, 0}, name("A"));
+        recorder.call({"a.c", 2, 1, 1}, call, arguments, true);
+        recorder.expanded({"a.c", 2, 1, 1}, call, result, true);
+        recorder.rescanned({"a.c", 2, 1, 1}, call, result, result, false);
+        recorder.object_call({"b.c", 7, 3, 2}, name("OBJ"));
+        recorder.error("a.c", 9, "boom");
+        recorder.complete({"a.c", 10, 1, 0});
+        recorder.close();
+        return ppstep_test::read_file(path);
+    }
+
+    void round_trip(std::string const& path) {
+        auto reader = ppstep::trace_reader();
+        CHECK(reader.open(path.c_str()));
+        CHECK(reader.next_unit());
+        CHECK(reader.unit().version == ppstep::trace_format::version);
+        CHECK(reader.unit().name == "unit.c");
+
+        auto record = ppstep::trace_record();
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::lexed);
+        CHECK(record.depth == 0);
+        CHECK(reader.string(record.file) == "a.c");
+        CHECK(record.line == 1 && record.column == 1);
+        CHECK(spelled(reader, record.lists[0]) == spellings{"A"});
+        CHECK(reader.kind(record.lists[0][0]).id == boost::wave::T_IDENTIFIER);
+
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::call);
+        CHECK(record.normalized);
+        CHECK(record.depth == 1);
+        CHECK(record.line == 2);
+        CHECK(record.lists.size() == 3);
+        CHECK(spelled(reader, record.lists[0]) == (spellings{"F", "(", "x", ",", " ", "y", ")"}));
+        CHECK(spelled(reader, record.lists[1]) == spellings{"x"});
+        CHECK(spelled(reader, record.lists[2]) == (spellings{" ", "y"}));
+        auto macro = ppstep::called_macro(reader, record);
+        CHECK(macro && reader.kind(*macro).spelling == "F");
+
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::expanded);
+        CHECK(record.lists.size() == 2);
+        CHECK(spelled(reader, record.lists[1]) == (spellings{"x", "+", "y"}));
+
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::rescanned);
+        CHECK(!record.normalized);
+        CHECK(record.lists.size() == 3);
+        CHECK(spelled(reader, record.lists[2]) == (spellings{"x", "+", "y"}));
+
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::object_call);
+        CHECK(record.depth == 2);
+        CHECK(reader.string(record.file) == "b.c");
+        CHECK(record.line == 7 && record.column == 3);
+        CHECK(spelled(reader, record.lists[0]) == spellings{"OBJ"});
+
+        CHECK(reader.next(record));
+        CHECK(record.type == tag::error);
+        CHECK(reader.string(record.file) == "a.c");
+        CHECK(record.line == 9);
+        CHECK(reader.string(record.message) == "boom");
+
+        CHECK(!reader.next(record));
+        auto end = reader.position();
+        CHECK(end && end->line == 10);
+        CHECK(!reader.next_unit());
+    }
+
+    // Everything up to and including the first record of a unit, for crafting bad ones
+    std::string unit_header() {
+        auto bytes = std::string(ppstep::trace_format::magic, sizeof(ppstep::trace_format::magic));
+        ppstep::trace_format::put_varint(bytes, ppstep::trace_format::version);
+        ppstep::trace_format::put_varint(bytes, 0);
+        ppstep::trace_format::put_bytes(bytes, "");
+        bytes.push_back(static_cast<char>(tag::token));
+        ppstep::trace_format::put_varint(bytes, boost::wave::T_IDENTIFIER);
+        ppstep::trace_format::put_bytes(bytes, "F");
+        return bytes;
+    }
+
+    void corrupt(std::string const& path, std::string const& sample) {
+        using ppstep::trace_format::put_varint;
+
+        // A crashed session leaves a trace cut off anywhere
+        for (std::size_t size = 0; size < sample.size(); ++size) {
+            ppstep_test::write_file(path, std::string_view(sample).substr(0, size));
+            try {
+                read_all(path);
+            } catch (std::runtime_error const&) {
+            } catch (std::exception const&) {
+                CHECK(!"truncated trace threw something other than std::runtime_error");
+            }
+        }
+
+        auto rejected = [&path](std::string const& bytes) {
+            ppstep_test::write_file(path, bytes);
+            return ppstep_test::rejects([&path] { read_all(path); });
+        };
+
+        CHECK(rejected("not a trace at all"));
+
+        auto wrong_version = std::string(ppstep::trace_format::magic, sizeof(ppstep::trace_format::magic));
+        put_varint(wrong_version, ppstep::trace_format::version + 1);
+        CHECK(rejected(wrong_version));
+
+        // An argument count no remaining bytes could hold
+        auto arguments = unit_header();
+        arguments.push_back(static_cast<char>(tag::call));
+        put_varint(arguments, 1);
+        put_varint(arguments, 1);
+        put_varint(arguments, 0);
+        put_varint(arguments, std::uint64_t(1) << 40);
+        CHECK(rejected(arguments));
+
+        // A token count likewise
+        auto count = unit_header();
+        count.push_back(static_cast<char>(tag::expanded));
+        put_varint(count, 1);
+        put_varint(count, std::uint64_t(1) << 40);
+        CHECK(rejected(count));
+
+        // A token kind that was never defined
+        auto kind = unit_header();
+        kind.push_back(static_cast<char>(tag::lexed));
+        put_varint(kind, 0);
+        put_varint(kind, 1);
+        CHECK(rejected(kind));
+
+        // A string that was never defined
+        auto string = unit_header();
+        string.push_back(static_cast<char>(tag::error));
+        put_varint(string, 0);
+        put_varint(string, 1);
+        put_varint(string, 0);
+        CHECK(rejected(string));
+
+        auto unknown = unit_header();
+        unknown.push_back(static_cast<char>(0x3f));
+        CHECK(rejected(unknown));
+
+        // A varint that never ends
+        auto endless = unit_header();
+        endless.push_back(static_cast<char>(tag::lexed));
+        endless.append(16, static_cast<char>(0xff));
+        CHECK(rejected(endless));
+
+        // Garbage after a complete unit
+        CHECK(rejected(sample + "junk"));
+    }
+}
+
+int main() {
+    auto path = ppstep_test::temp_path("trace.bin");
+    auto sample = record_sample(path);
+    round_trip(path);
+    corrupt(path, sample);
+    std::remove(path.c_str());
+    return ppstep_test::finish("trace_test");
+}
@@ -0,0 +1,166 @@
+// ppstep-query: aggregate queries over binary traces, for recordings too big to grep.
+// Each trace is streamed through once with its pages given back as they are read, so
+// memory stays bounded however large the trace is; several traces are read on several
+// threads and their results merged in command line order.
+//
+//   ppstep-query top [--by calls|tokens] TRACE...   macros by calls or output tokens
+//   ppstep-query depth TRACE...                      deepest top-level invocations
+//   ppstep-query match --pattern TOKENS TRACE...     expansions whose result contains TOKENS
+//   ppstep-query files TRACE...                      events per file
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "trace_query.hpp"
+
+namespace po = boost::program_options;
+
+namespace {
+    bool parse_args(int argc, char const** argv, po::variables_map& vm) {
+        po::options_description desc("ppstep-query QUERY TRACE...\n\nqueries: top, depth, match, files\n\noptions");
+        desc.add_options()
+            ("help,h", "produce help message")
+            ("by", po::value<std::string>()->default_value("calls"), "what top ranks macros by: calls or tokens (output tokens)")
+            ("pattern,p", po::value<std::string>(), "tokens match looks for in expansion results, e.g. 'CAT(x, 1)'")
+            ("limit,n", po::value<std::size_t>()->default_value(20), "rows to print; 0 prints them all")
+            ("jobs,j", po::value<unsigned>()->default_value(0), "traces read at once (default: one per core)")
+            ("query", po::value<std::string>(), "query")
+            ("trace", po::value<std::vector<std::string>>(), "binary trace");
+
+        po::positional_options_description p;
+        p.add("query", 1);
+        p.add("trace", -1);
+
+        try {
+            po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+            if (vm.count("help")) {
+                std::cerr << desc << std::endl;
+                return false;
+            }
+            po::notify(vm);
+        } catch (std::exception const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            std::cerr << desc << std::endl;
+            return false;
+        }
+
+        if (!vm.count("query") || !vm.count("trace")) {
+            std::cerr << "error: a query and at least one trace are required" << std::endl;
+            std::cerr << desc << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool make_query(po::variables_map const& args, ppstep::trace_query& query) {
+        auto name = args["query"].as<std::string>();
+        if (name == "top") {
+            query.kind = ppstep::trace_query_kind::top;
+        } else if (name == "depth") {
+            query.kind = ppstep::trace_query_kind::depth;
+        } else if (name == "match") {
+            query.kind = ppstep::trace_query_kind::match;
+        } else if (name == "files") {
+            query.kind = ppstep::trace_query_kind::files;
+        } else {
+            std::cerr << "error: unknown query \"" << name << "\" (expected top, depth, match or files)" << std::endl;
+            return false;
+        }
+
+        auto by = args["by"].as<std::string>();
+        if (by != "calls" && by != "tokens") {
+            std::cerr << "error: --by takes calls or tokens" << std::endl;
+            return false;
+        }
+        query.by_tokens = by == "tokens";
+        query.limit = args["limit"].as<std::size_t>();
+
+        if (query.kind == ppstep::trace_query_kind::match) {
+            if (args.count("pattern")) {
+                try {
+                    query.pattern = ppstep::split_token_pattern(args["pattern"].as<std::string>());
+                } catch (std::runtime_error const& e) {
+                    std::cerr << "error: " << e.what() << std::endl;
+                    return false;
+                }
+            }
+            if (query.pattern.empty()) {
+                std::cerr << "error: match needs a --pattern with at least one token" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char const** argv) {
+    po::variables_map args;
+    if (!parse_args(argc, argv, args))
+        return 1;
+
+    auto query = ppstep::trace_query();
+    if (!make_query(args, query))
+        return 1;
+
+    auto traces = args["trace"].as<std::vector<std::string>>();
+    auto jobs = args["jobs"].as<unsigned>();
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<unsigned>(jobs, static_cast<unsigned>(traces.size()));
+
+    auto results = std::vector<ppstep::trace_query_result>(traces.size());
+    auto failures = std::vector<std::string>(traces.size());
+    std::atomic<std::size_t> next(0);
+
+    auto started = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        for (std::size_t index; (index = next++) < traces.size();) {
+            try {
+                results[index] = ppstep::run_trace_query(traces[index], index, query);
+            } catch (std::runtime_error const& e) {
+                failures[index] = e.what();
+            }
+        }
+    };
+
+    auto workers = std::vector<std::thread>();
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    // Merged in command line order, so the output does not depend on the thread count
+    auto total = ppstep::trace_query_result();
+    std::size_t failed = 0;
+    for (std::size_t index = 0; index < traces.size(); ++index) {
+        if (!failures[index].empty()) {
+            std::cerr << "error: " << failures[index] << std::endl;
+            ++failed;
+            continue;
+        }
+        if (!results[index].error.empty()) {
+            std::cerr << "warning: " << traces[index] << ": " << results[index].error << "; results cover the events before it" << std::endl;
+        }
+        total.merge(std::move(results[index]), query);
+    }
+
+    ppstep::print_trace_query(std::cout, total, query, traces);
+
+    auto wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "Traces: " << traces.size() << " (" << failed << " failed), " << total.events << " events on " << jobs << " threads in "
+              << std::fixed << std::setprecision(2) << wall << " ms" << std::endl;
+
+    return failed > 0 ? 2 : 0;
+}